@@ -0,0 +1,843 @@
+/**
+ * @file aesdsocket-bench.c
+ * @brief Load generator for a running aesdsocket: throughput and packet latency
+ *
+ * Opens N connections to the server, each one sending numbered packets of the
+ * requested size, optionally rate limited and with up to <depth> packets in
+ * flight written with a single send (pipelining). Every packet line is unique,
+ * it is acknowledged when the line shows up in the readback stream of its
+ * connection, which also validates the echo byte for byte. The latency of a
+ * packet runs from the time it was scheduled to be sent, not when the window
+ * let it go, so a server falling behind a fixed rate can't hide its queueing.
+ *
+ * Seek commands (-k) are mixed in between data packets. Their readbacks can't
+ * be told apart from the stream, they are consumed by the scan and not timed.
+ *
+ * With -R every connection reconnects once its packets in flight are echoed,
+ * a reconnect storm that measures the accept path of the server.
+ *
+ * With -B the connections negotiate the binary protocol of the server
+ * (server/binproto.h): every packet is an APPEND command, acknowledged by its
+ * reply instead of a readback of the whole data file, and seeks are SEEKTO
+ * commands.
+ *
+ * With -z <count> extra laggard connections each send a burst of packets
+ * before the measurement and then never read their readbacks, a set of slow
+ * consumers whose effect on the measured connections shows the backpressure
+ * and slow consumer policy of the server (-q and -S).
+ *
+ * Usage: aesdsocket-bench [-H host] [-P port] [-c connections] [-n packets] [-s size]
+ *                         [-r rate] [-p depth] [-k seek_percent] [-t threads]
+ *                         [-T timeout_s] [-R] [-B] [-z laggards] [-f csv|json]
+ */
+/*--------------------------------- Private includes ---------------------------------*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <pthread.h>
+/*--------------------------------- Private definitions ---------------------------------  */
+#define DEFAULT_HOST                            "127.0.0.1"
+#define DEFAULT_PORT                            "9000"
+#define DEFAULT_CONNECTIONS                     10
+#define DEFAULT_PACKETS                         100
+#define DEFAULT_PACKET_SIZE                     64
+#define DEFAULT_DEPTH                           1
+#define DEFAULT_TIMEOUT_S                       10
+#define RX_CHUNK                                (64 * 1024)
+#define MAX_EVENTS                              64
+#define IDLE_WAIT_MS                            100
+#define PACKET_PREFIX_LEN                       19      /* "c%06u-%010lu:" */
+#define SEEK_COMMAND                            "AESDCHAR_IOCSEEKTO:0,0\n"
+/* Binary protocol, see server/binproto.h */
+#define BIN_HELLO                               "\0AESDB1\n"
+#define BIN_HELLO_LEN                           8
+#define BIN_HEADER_LEN                          12
+#define BIN_SEEKTO_LEN                          8
+#define BIN_OP_APPEND                           1
+#define BIN_OP_SEEKTO                           2
+#define LAGGARD_PACKETS                         64
+#define LAGGARD_RCVBUF                          4096
+
+typedef struct bench_config {
+    const char *host;
+    const char *port;
+    unsigned int connections;
+    unsigned long packets;              /* per connection */
+    size_t packet_size;                 /* including the newline */
+    double rate;                        /* packets per second per connection, 0 for back to back */
+    unsigned int depth;                 /* packets in flight per connection */
+    unsigned int seek_percent;
+    unsigned int threads;
+    unsigned int timeout_s;
+    int reconnect;                      /* new connection after every echoed window */
+    int binary;                         /* binary protocol instead of newline packets */
+    unsigned int laggards;              /* connections that never read */
+    int json;
+} bench_config_t;
+
+typedef struct bench_conn {
+    int fd;
+    uint32_t events;                    /* epoll interest currently registered */
+    unsigned int id;
+    unsigned long sent;                 /* data packets queued, the next sequence number */
+    unsigned long acked;                /* data packets seen in the readback stream */
+    uint64_t *send_ns;                  /* scheduled send time of every packet */
+    uint64_t next_send_ns;
+    char *out;                          /* bytes queued for the socket */
+    size_t out_len;
+    size_t out_sent;
+    char *in;                           /* tail of the last receive, then the new bytes */
+    size_t in_len;
+    char *expect;                       /* line of packet <acked> */
+    int hello_pending;                  /* binary: the hello reply is not received yet */
+    unsigned int seed;
+    int done;
+} bench_conn_t;
+
+typedef struct bench_thread {
+    pthread_t thread_id;
+    unsigned int index;
+    bench_conn_t *conns;
+    unsigned int conn_count;
+    uint64_t *latencies;                /* ns, one per acknowledged packet */
+    unsigned long latency_count;
+    unsigned long bytes_out;
+    unsigned long bytes_in;
+    unsigned long errors;
+    unsigned long connects;
+    uint64_t end_ns;
+} bench_thread_t;
+/*---------------------------------- Private Variables ----------------------------------  */
+static bench_config_t config = {
+    .host = DEFAULT_HOST,
+    .port = DEFAULT_PORT,
+    .connections = DEFAULT_CONNECTIONS,
+    .packets = DEFAULT_PACKETS,
+    .packet_size = DEFAULT_PACKET_SIZE,
+    .depth = DEFAULT_DEPTH,
+    .threads = 1,
+    .timeout_s = DEFAULT_TIMEOUT_S,
+};
+static pthread_barrier_t start_barrier;
+static uint64_t start_ns;
+/*--------------------------------- Private Functions ---------------------------------  */
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Write the line of a packet: unique prefix, filler and newline
+ */
+static void format_packet(char *buf, unsigned int conn_id, unsigned long seq)
+{
+    char prefix[PACKET_PREFIX_LEN + 1];
+
+    snprintf(prefix, sizeof(prefix), "c%06u-%010lu:", conn_id % 1000000, seq % 10000000000UL);
+    memcpy(buf, prefix, PACKET_PREFIX_LEN);
+    memset(buf + PACKET_PREFIX_LEN, 'a' + seq % 26, config.packet_size - PACKET_PREFIX_LEN - 1);
+    buf[config.packet_size - 1] = '\n';
+}
+
+static void put_be32(char *p, uint32_t value)
+{
+    p[0] = (char) (value >> 24);
+    p[1] = (char) (value >> 16);
+    p[2] = (char) (value >> 8);
+    p[3] = (char) value;
+}
+
+static uint32_t get_be32(const char *p)
+{
+    const unsigned char *u = (const unsigned char *) p;
+    return ((uint32_t) u[0] << 24) | ((uint32_t) u[1] << 16) | ((uint32_t) u[2] << 8) | u[3];
+}
+
+/**
+ * @brief Write a binary command header
+ */
+static void format_header(char *buf, uint8_t op, uint32_t tag, uint32_t len)
+{
+    buf[0] = (char) op;
+    buf[1] = buf[2] = buf[3] = 0;
+    put_be32(buf + 4, tag);
+    put_be32(buf + 8, len);
+}
+
+/**
+ * @brief Queue the binary protocol hello on a new connection
+ */
+static void conn_start(bench_conn_t *conn)
+{
+    if (config.binary)
+    {
+        memcpy(conn->out, BIN_HELLO, BIN_HELLO_LEN);
+        conn->out_len = BIN_HELLO_LEN;
+        conn->hello_pending = 1;
+    }
+}
+
+static int connect_server(void)
+{
+    struct addrinfo hints, *servinfo, *res;
+    int fd = -1;
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(config.host, config.port, &hints, &servinfo) != 0)
+    {
+        return -1;
+    }
+    for (res = servinfo; res != NULL; res = res->ai_next)
+    {
+        fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+        if (fd == -1)
+        {
+            continue;
+        }
+        if (connect(fd, res->ai_addr, res->ai_addrlen) == 0)
+        {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(servinfo);
+    if (fd != -1)
+    {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    }
+    return fd;
+}
+
+/**
+ * @brief Queue the packets the window and the rate allow, then push the queue out
+ *
+ * @return 1 if bytes are left for EPOLLOUT, 0 if the queue is empty, -1 on error
+ */
+static int conn_send(bench_thread_t *thread, bench_conn_t *conn, uint64_t now)
+{
+    uint64_t interval_ns = (config.rate > 0) ? (uint64_t) (1e9 / config.rate) : 0;
+
+    /* Only the unsent bytes of packets in the window stay queued, they fit in <depth> packets */
+    memmove(conn->out, conn->out + conn->out_sent, conn->out_len - conn->out_sent);
+    conn->out_len -= conn->out_sent;
+    conn->out_sent = 0;
+    while (conn->sent < config.packets && conn->sent - conn->acked < config.depth &&
+           (interval_ns == 0 || now >= conn->next_send_ns))
+    {
+        if (config.seek_percent > 0 && (unsigned int) rand_r(&conn->seed) % 100 < config.seek_percent)
+        {
+            if (config.binary)
+            {
+                format_header(conn->out + conn->out_len, BIN_OP_SEEKTO, 0, BIN_SEEKTO_LEN);
+                memset(conn->out + conn->out_len + BIN_HEADER_LEN, 0, BIN_SEEKTO_LEN);
+                conn->out_len += BIN_HEADER_LEN + BIN_SEEKTO_LEN;
+            }
+            else
+            {
+                memcpy(conn->out + conn->out_len, SEEK_COMMAND, sizeof(SEEK_COMMAND) - 1);
+                conn->out_len += sizeof(SEEK_COMMAND) - 1;
+            }
+        }
+        if (config.binary)
+        {
+            format_header(conn->out + conn->out_len, BIN_OP_APPEND, (uint32_t) conn->sent, config.packet_size);
+            conn->out_len += BIN_HEADER_LEN;
+        }
+        format_packet(conn->out + conn->out_len, conn->id, conn->sent);
+        conn->out_len += config.packet_size;
+        conn->send_ns[conn->sent++] = (interval_ns != 0) ? conn->next_send_ns : now;
+        conn->next_send_ns += interval_ns;
+    }
+
+    while (conn->out_sent < conn->out_len)
+    {
+        ssize_t sent = send(conn->fd, conn->out + conn->out_sent, conn->out_len - conn->out_sent, MSG_NOSIGNAL);
+        if (sent == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 1 : -1;
+        }
+        conn->out_sent += sent;
+        thread->bytes_out += sent;
+    }
+    return 0;
+}
+
+/**
+ * @brief Acknowledge the packets whose APPEND reply is complete in the receive buffer
+ *
+ * @return 0 on success, -1 if the server answered with an error or out of order
+ */
+static int conn_parse_replies(bench_thread_t *thread, bench_conn_t *conn, uint64_t now)
+{
+    size_t pos = 0;
+
+    if (conn->hello_pending)
+    {
+        if (conn->in_len < BIN_HELLO_LEN)
+        {
+            return 0;
+        }
+        if (memcmp(conn->in, BIN_HELLO, BIN_HELLO_LEN) != 0)
+        {
+            fprintf(stderr, "The server doesn't speak the binary protocol\n");
+            return -1;
+        }
+        conn->hello_pending = 0;
+        pos = BIN_HELLO_LEN;
+    }
+    while (conn->in_len - pos >= BIN_HEADER_LEN)
+    {
+        const char *reply = conn->in + pos;
+        uint32_t len = get_be32(reply + 8);
+        if (conn->in_len - pos - BIN_HEADER_LEN < len)
+        {
+            break;
+        }
+        if (reply[1] != 0)
+        {
+            fprintf(stderr, "Command %u failed with status %u\n", (unsigned int) reply[0], (unsigned int) reply[1]);
+            return -1;
+        }
+        if (reply[0] == BIN_OP_APPEND)
+        {
+            if (get_be32(reply + 4) != (uint32_t) conn->acked || conn->acked >= conn->sent)
+            {
+                fprintf(stderr, "Unexpected reply tag %u\n", get_be32(reply + 4));
+                return -1;
+            }
+            thread->latencies[thread->latency_count++] = now - conn->send_ns[conn->acked++];
+        }
+        pos += BIN_HEADER_LEN + len;
+    }
+    memmove(conn->in, conn->in + pos, conn->in_len - pos);
+    conn->in_len -= pos;
+    return 0;
+}
+
+/**
+ * @brief Receive and acknowledge every packet whose line shows up in the stream, or
+ *        whose reply arrived with -B
+ *
+ * @return 1 if the connection is still open, 0 once it reached EOF, -1 on error
+ */
+static int conn_receive(bench_thread_t *thread, bench_conn_t *conn)
+{
+    for (;;)
+    {
+        ssize_t recv_octets = recv(conn->fd, conn->in + conn->in_len, RX_CHUNK, 0);
+        if (recv_octets == 0)
+        {
+            return 0;
+        }
+        if (recv_octets == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 1 : -1;
+        }
+        thread->bytes_in += recv_octets;
+        conn->in_len += recv_octets;
+
+        uint64_t now = now_ns();
+        if (config.binary)
+        {
+            if (conn_parse_replies(thread, conn, now) == -1)
+            {
+                return -1;
+            }
+            continue;
+        }
+        size_t pos = 0;
+        while (conn->acked < conn->sent)
+        {
+            char *match = memmem(conn->in + pos, conn->in_len - pos, conn->expect, config.packet_size);
+            if (match == NULL)
+            {
+                break;
+            }
+            thread->latencies[thread->latency_count++] = now - conn->send_ns[conn->acked];
+            pos = match - conn->in + config.packet_size;
+            format_packet(conn->expect, conn->id, ++conn->acked);
+        }
+        /* A line can straddle two receives, keep what could be its beginning */
+        size_t keep = conn->in_len - pos;
+        if (keep > config.packet_size - 1)
+        {
+            keep = config.packet_size - 1;
+        }
+        memmove(conn->in, conn->in + conn->in_len - keep, keep);
+        conn->in_len = keep;
+    }
+}
+
+/**
+ * @brief Replace the socket of a connection whose packets in flight were all echoed
+ */
+static int conn_reconnect(bench_thread_t *thread, bench_conn_t *conn, int epoll_fd)
+{
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    conn->in_len = conn->out_len = conn->out_sent = 0;
+    conn->fd = connect_server();
+    if (conn->fd == -1)
+    {
+        return -1;
+    }
+    conn_start(conn);
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = conn };
+    conn->events = EPOLLIN;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn->fd, &ev) == -1)
+    {
+        return -1;
+    }
+    thread->connects++;
+    return 0;
+}
+
+static void conn_finish(bench_thread_t *thread, bench_conn_t *conn, int epoll_fd, int failed)
+{
+    if (failed)
+    {
+        thread->errors += config.packets - conn->acked;
+    }
+    if (conn->fd != -1)
+    {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+        close(conn->fd);
+    }
+    conn->done = 1;
+}
+
+static void *bench_thread(void *arg)
+{
+    bench_thread_t *thread = (bench_thread_t *) arg;
+    struct epoll_event events[MAX_EVENTS];
+    unsigned int open_conns = thread->conn_count;
+    int epoll_fd = epoll_create1(0);
+
+    for (unsigned int i = 0; i < thread->conn_count; i++)
+    {
+        bench_conn_t *conn = &thread->conns[i];
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = conn };
+        conn->events = EPOLLIN;
+        if (conn->fd == -1 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn->fd, &ev) == -1)
+        {
+            thread->errors += config.packets;
+            conn->done = 1;
+            open_conns--;
+            continue;
+        }
+        thread->connects++;
+    }
+    pthread_barrier_wait(&start_barrier);
+    uint64_t last_progress = now_ns();
+    for (unsigned int i = 0; i < thread->conn_count; i++)
+    {
+        thread->conns[i].next_send_ns = start_ns;
+    }
+
+    while (open_conns > 0)
+    {
+        uint64_t now = now_ns();
+        int wait_ms = IDLE_WAIT_MS;
+
+        for (unsigned int i = 0; i < thread->conn_count; i++)
+        {
+            bench_conn_t *conn = &thread->conns[i];
+            if (conn->done)
+            {
+                continue;
+            }
+            int status = conn_send(thread, conn, now);
+            if (status == -1)
+            {
+                conn_finish(thread, conn, epoll_fd, 1);
+                open_conns--;
+                continue;
+            }
+            uint32_t events = EPOLLIN | (status ? EPOLLOUT : 0);
+            if (events != conn->events)
+            {
+                struct epoll_event ev = { .events = events, .data.ptr = conn };
+                epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+                conn->events = events;
+            }
+            if (config.rate > 0 && conn->sent < config.packets && conn->sent - conn->acked < config.depth)
+            {
+                int due_ms = (conn->next_send_ns > now) ? (int) ((conn->next_send_ns - now) / 1000000) : 0;
+                if (due_ms < wait_ms)
+                {
+                    wait_ms = due_ms;
+                }
+            }
+        }
+        if (open_conns == 0)
+        {
+            break;
+        }
+
+        int nfds = epoll_wait(epoll_fd, events, MAX_EVENTS, wait_ms);
+        if (nfds == -1 && errno != EINTR)
+        {
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < nfds; i++)
+        {
+            bench_conn_t *conn = (bench_conn_t *) events[i].data.ptr;
+            if (conn->done)
+            {
+                continue;
+            }
+            unsigned long acked = conn->acked;
+            int status = conn_receive(thread, conn);
+            if (conn->acked != acked)
+            {
+                last_progress = now_ns();
+            }
+            if (conn->acked == config.packets || status != 1)
+            {
+                conn_finish(thread, conn, epoll_fd, conn->acked != config.packets);
+                open_conns--;
+            }
+            else if (config.reconnect && conn->acked != acked && conn->acked == conn->sent &&
+                     conn_reconnect(thread, conn, epoll_fd) == -1)
+            {
+                conn_finish(thread, conn, epoll_fd, 1);
+                open_conns--;
+            }
+        }
+        if (now_ns() - last_progress > (uint64_t) config.timeout_s * 1000000000ULL)
+        {
+            fprintf(stderr, "thread %u: no readback for %u s, giving up\n", thread->index, config.timeout_s);
+            for (unsigned int i = 0; i < thread->conn_count; i++)
+            {
+                if (!thread->conns[i].done)
+                {
+                    conn_finish(thread, &thread->conns[i], epoll_fd, 1);
+                }
+            }
+            break;
+        }
+    }
+    thread->end_ns = now_ns();
+    close(epoll_fd);
+    return NULL;
+}
+
+/**
+ * @brief Open the laggard connections and send their packets, their readbacks are never read
+ *
+ * @return array of config.laggards descriptors, -1 for the ones that failed to connect
+ */
+static int *open_laggards(void)
+{
+    int *fds = calloc(config.laggards + 1, sizeof(int));
+    char *packet = malloc(config.packet_size);
+    if (fds == NULL || packet == NULL)
+    {
+        free(fds);
+        free(packet);
+        return NULL;
+    }
+    for (unsigned int i = 0; i < config.laggards; i++)
+    {
+        fds[i] = connect_server();
+        if (fds[i] == -1)
+        {
+            continue;
+        }
+        /* A small window so the server runs into a full socket early */
+        int rcvbuf = LAGGARD_RCVBUF;
+        setsockopt(fds[i], SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof rcvbuf);
+        for (unsigned long seq = 0; seq < LAGGARD_PACKETS; seq++)
+        {
+            format_packet(packet, config.connections + i, seq);
+            if (send(fds[i], packet, config.packet_size, MSG_NOSIGNAL) != (ssize_t) config.packet_size)
+            {
+                break;
+            }
+        }
+    }
+    free(packet);
+    return fds;
+}
+
+static void print_usage(FILE *stream, const char *program)
+{
+    fprintf(stream, "Usage: %s [-H host] [-P port] [-c connections] [-n packets] [-s size] [-r rate]\n"
+                    "       [-p depth] [-k seek_percent] [-t threads] [-T timeout_s] [-R] [-B] [-z laggards]\n"
+                    "       [-f csv|json] [-h]\n", program);
+}
+
+/**
+ * @brief Fill config from the command line
+ *
+ * @return 0 to run the benchmark, 1 if -h asked for the usage, -1 on invalid options
+ */
+static int parse_options(int argc, char **argv)
+{
+    int opt;
+
+    while ((opt = getopt(argc, argv, "H:P:c:n:s:r:p:k:t:T:RBz:f:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'H':
+            config.host = optarg;
+            break;
+        case 'P':
+            config.port = optarg;
+            break;
+        case 'c':
+            config.connections = strtoul(optarg, NULL, 10);
+            break;
+        case 'n':
+            config.packets = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            config.packet_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            config.rate = strtod(optarg, NULL);
+            break;
+        case 'p':
+            config.depth = strtoul(optarg, NULL, 10);
+            break;
+        case 'k':
+            config.seek_percent = strtoul(optarg, NULL, 10);
+            break;
+        case 't':
+            config.threads = strtoul(optarg, NULL, 10);
+            break;
+        case 'T':
+            config.timeout_s = strtoul(optarg, NULL, 10);
+            break;
+        case 'R':
+            config.reconnect = 1;
+            break;
+        case 'B':
+            config.binary = 1;
+            break;
+        case 'z':
+            config.laggards = strtoul(optarg, NULL, 10);
+            break;
+        case 'f':
+            config.json = (strcmp(optarg, "json") == 0);
+            break;
+        case 'h':
+            return 1;
+        default:
+            return -1;
+        }
+    }
+    if (config.connections == 0 || config.packets == 0 || config.depth == 0 || config.threads == 0 ||
+        config.seek_percent > 100)
+    {
+        return -1;
+    }
+    if (config.packet_size < PACKET_PREFIX_LEN + 1)
+    {
+        config.packet_size = PACKET_PREFIX_LEN + 1;
+    }
+    if (config.threads > config.connections)
+    {
+        config.threads = config.connections;
+    }
+    return 0;
+}
+
+static void report(bench_thread_t *threads)
+{
+    unsigned long bytes_out = 0, bytes_in = 0, errors = 0, count = 0, connects = 0;
+    uint64_t end_ns = start_ns;
+
+    for (unsigned int t = 0; t < config.threads; t++)
+    {
+        bytes_out += threads[t].bytes_out;
+        bytes_in += threads[t].bytes_in;
+        errors += threads[t].errors;
+        count += threads[t].latency_count;
+        connects += threads[t].connects;
+        if (threads[t].end_ns > end_ns)
+        {
+            end_ns = threads[t].end_ns;
+        }
+    }
+    uint64_t *latencies = malloc((count + 1) * sizeof(uint64_t));
+    unsigned long filled = 0;
+    for (unsigned int t = 0; t < config.threads && latencies != NULL; t++)
+    {
+        memcpy(latencies + filled, threads[t].latencies, threads[t].latency_count * sizeof(uint64_t));
+        filled += threads[t].latency_count;
+    }
+    if (latencies == NULL)
+    {
+        count = 0;
+    }
+    qsort(latencies, count, sizeof(uint64_t), cmp_u64);
+
+    double seconds = (end_ns - start_ns) / 1e9;
+    double p50 = count ? latencies[(count - 1) * 50 / 100] / 1e3 : 0;
+    double p99 = count ? latencies[(count - 1) * 99 / 100] / 1e3 : 0;
+    double p999 = count ? latencies[(count - 1) * 999 / 1000] / 1e3 : 0;
+    double max = count ? latencies[count - 1] / 1e3 : 0;
+    double packets_s = seconds > 0 ? count / seconds : 0;
+    double out_mb_s = seconds > 0 ? bytes_out / seconds / 1e6 : 0;
+    double in_mb_s = seconds > 0 ? bytes_in / seconds / 1e6 : 0;
+    double connects_s = seconds > 0 ? connects / seconds : 0;
+
+    if (config.json)
+    {
+        printf("{\"connections\": %u, \"packets\": %lu, \"packet_size\": %zu, \"rate\": %.1f, \"depth\": %u, "
+               "\"seek_percent\": %u, \"seconds\": %.3f, \"acked\": %lu, \"errors\": %lu, \"packets_per_s\": %.1f, "
+               "\"sent_mb_per_s\": %.2f, \"received_mb_per_s\": %.2f, \"p50_us\": %.1f, \"p99_us\": %.1f, "
+               "\"p999_us\": %.1f, \"max_us\": %.1f, \"connects\": %lu, \"connects_per_s\": %.1f, \"protocol\": \"%s\", "
+               "\"laggards\": %u}\n",
+               config.connections, config.packets, config.packet_size, config.rate, config.depth, config.seek_percent,
+               seconds, count, errors, packets_s, out_mb_s, in_mb_s, p50, p99, p999, max, connects, connects_s,
+               config.binary ? "binary" : "text", config.laggards);
+    }
+    else
+    {
+        printf("connections,packets,packet_size,rate,depth,seek_percent,seconds,acked,errors,packets_per_s,"
+               "sent_mb_per_s,received_mb_per_s,p50_us,p99_us,p999_us,max_us,connects,connects_per_s,protocol,laggards\n");
+        printf("%u,%lu,%zu,%.1f,%u,%u,%.3f,%lu,%lu,%.1f,%.2f,%.2f,%.1f,%.1f,%.1f,%.1f,%lu,%.1f,%s,%u\n",
+               config.connections, config.packets, config.packet_size, config.rate, config.depth, config.seek_percent,
+               seconds, count, errors, packets_s, out_mb_s, in_mb_s, p50, p99, p999, max, connects, connects_s,
+               config.binary ? "binary" : "text", config.laggards);
+    }
+    free(latencies);
+}
+/*--------------------------------- Public Functions ---------------------------------  */
+int main(int argc, char **argv)
+{
+    int parsed = parse_options(argc, argv);
+    if (parsed != 0)
+    {
+        print_usage((parsed == 1) ? stdout : stderr, argv[0]);
+        return (parsed == 1) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    bench_thread_t *threads = calloc(config.threads, sizeof(bench_thread_t));
+    bench_conn_t *conns = calloc(config.connections, sizeof(bench_conn_t));
+    /* A window of packets, each with a seek and with the binary headers, after the hello */
+    size_t out_cap = BIN_HELLO_LEN + config.depth * (config.packet_size + sizeof(SEEK_COMMAND) +
+                                                     2 * BIN_HEADER_LEN + BIN_SEEKTO_LEN);
+    if (threads == NULL || conns == NULL)
+    {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+    /* Stalled before the measured connections open, they are the slow consumers already */
+    int *laggard_fds = open_laggards();
+    if (laggard_fds == NULL)
+    {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+    for (unsigned int i = 0; i < config.connections; i++)
+    {
+        bench_conn_t *conn = &conns[i];
+        conn->id = i;
+        conn->seed = i + 1;
+        conn->send_ns = malloc(config.packets * sizeof(uint64_t));
+        conn->out = malloc(out_cap);
+        conn->in = malloc(RX_CHUNK + config.packet_size);
+        conn->expect = malloc(config.packet_size);
+        if (conn->send_ns == NULL || conn->out == NULL || conn->in == NULL || conn->expect == NULL)
+        {
+            perror("malloc");
+            return EXIT_FAILURE;
+        }
+        format_packet(conn->expect, conn->id, 0);
+        conn->fd = connect_server();
+        conn_start(conn);
+        if (conn->fd == -1)
+        {
+            fprintf(stderr, "Can't connect to %s:%s: %s\n", config.host, config.port, strerror(errno));
+        }
+    }
+
+    /* Every thread drives a contiguous block of connections, they start together once all are open */
+    pthread_barrier_init(&start_barrier, NULL, config.threads + 1);
+    unsigned int per_thread = (config.connections + config.threads - 1) / config.threads;
+    for (unsigned int t = 0; t < config.threads; t++)
+    {
+        bench_thread_t *thread = &threads[t];
+        unsigned int first = t * per_thread;
+        thread->index = t;
+        thread->conns = conns + first;
+        thread->conn_count = (first + per_thread <= config.connections) ? per_thread :
+                             (first < config.connections ? config.connections - first : 0);
+        thread->latencies = malloc((thread->conn_count * config.packets + 1) * sizeof(uint64_t));
+        if (thread->latencies == NULL || pthread_create(&thread->thread_id, NULL, bench_thread, thread) != 0)
+        {
+            fprintf(stderr, "Can't start thread %u\n", t);
+            return EXIT_FAILURE;
+        }
+    }
+    start_ns = now_ns();
+    pthread_barrier_wait(&start_barrier);
+
+    unsigned long errors = 0;
+    for (unsigned int t = 0; t < config.threads; t++)
+    {
+        pthread_join(threads[t].thread_id, NULL);
+        errors += threads[t].errors;
+    }
+    report(threads);
+
+    for (unsigned int i = 0; i < config.laggards; i++)
+    {
+        if (laggard_fds[i] != -1)
+        {
+            close(laggard_fds[i]);
+        }
+    }
+    free(laggard_fds);
+
+    for (unsigned int t = 0; t < config.threads; t++)
+    {
+        free(threads[t].latencies);
+    }
+    for (unsigned int i = 0; i < config.connections; i++)
+    {
+        free(conns[i].send_ns);
+        free(conns[i].out);
+        free(conns[i].in);
+        free(conns[i].expect);
+    }
+    free(conns);
+    free(threads);
+    pthread_barrier_destroy(&start_barrier);
+    return (errors == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
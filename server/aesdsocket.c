@@ -1,4 +1,5 @@
 /*--------------------------------- Private includes ---------------------------------*/
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -7,310 +8,1176 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <sys/wait.h>
+#include <sys/sendfile.h>
 #include <signal.h>
 #include <fcntl.h>
 #include <syslog.h>
 #include <pthread.h>
-#if (QUEUE_BSD_LINKED)
-#include <queue.h>
-#endif //QUEUE_BSD_LINKED
+#include <sched.h>
 #include <time.h>
-#include "../aesd-char-driver/aesd_ioctl.h"
-/*--------------------------------- Private definitions ---------------------------------  */
-#define PORT                                    "9000"
-#define BACKLOG                                 10
-#define MAXDATASIZE                             1024
-#define UNINIT_VALUE                            -1
+#include <limits.h>
+#include <getopt.h>
+#include "aesdsocket.h"
+#include "event-loop.h"
+#include "uring-io.h"
+#include "append-log.h"
+#include "framing.h"
+#include "group-commit.h"
+#include "data-file.h"
+#include "rx-buffer.h"
+#include "client-registry.h"
+#include "metrics.h"
+#include "timestamp.h"
+#include "binproto.h"
+#include "log-ring.h"
+#include "storage.h"
+#include "readback-cache.h"
+#include "zerocopy.h"
+#include "probes.h"
+/*---------------------------------- Public Variables ----------------------------------  */
+server_config_t server_config = {
+    .daemonize         = 0,
+    .event_loops       = 0,
+    .max_connections   = DEFAULT_MAX_CONNECTIONS,
+    .pool_workers      = 0,
+    .use_uring         = 0,
+    .use_log           = 0,
+    .group_commit      = 0,
+    .commit_batch      = DEFAULT_COMMIT_BATCH,
+    .commit_latency_us = DEFAULT_COMMIT_LATENCY_US,
+    .stats_endpoint    = NULL,
+    .acceptors         = 1,
+    .pin_cpus          = 0,
+    .timestamp_interval_ms = DEFAULT_TIMESTAMP_INTERVAL_MS,
+    .tx_high_water     = DEFAULT_TX_HIGH_WATER,
+    .tx_low_water      = 0,
+    .tx_watermarks_set = 0,
+    .slow_policy       = SLOW_CONSUMER_PAUSE,
+    .stall_timeout_ms  = DEFAULT_STALL_TIMEOUT_MS,
+    .segment_size      = 0,
+    .keep_segments     = 0,
+    .keep_seconds      = 0,
+    .readback_cache_size = 0,
+    .low_latency       = 0,
+    .busy_poll_us      = 0,
+    .packet_buffer_limit = DEFAULT_PACKET_BUFFER_LIMIT,
+    .zerocopy_min      = 0,
+};
+int data_packet_fd = UNINIT_VALUE;
+volatile sig_atomic_t shutdown_requested = 0;
+pthread_mutex_t file_mutex = PTHREAD_MUTEX_INITIALIZER;
+/*---------------------------------- Private Variables ----------------------------------  */
+/* The listening socket, or one SO_REUSEPORT socket per acceptor */
+static int listen_fds[MAX_ACCEPTORS] = { [0 ... MAX_ACCEPTORS - 1] = UNINIT_VALUE };
+static unsigned int num_listeners;
+/* Cleared the first time the data file refuses to be spliced */
+static volatile int sendfile_supported = 1;
+/* CPUs the threads are pinned to, the ones the process may use unless -L names them */
+static cpu_set_t pin_set;
+static int pin_set_known;
+/*--------------------------------- Private Functions ---------------------------------  */
+/**
+ * @brief A special signal handler to clean up the system when SIGTERM or SIGINT is initiated
+ * 
+ * @param signo     [IN]  signal value
+ * 
+ * @return None
+ * 
+ */
+static void special_signal_handler(int signo) 
+{
 
-#define USE_AESD_CHAR_DEVICE                    1
+    if (signo == SIGTERM || signo == SIGINT) {
+        syslog(LOG_DEBUG, "Caught signal, exiting");
+        shutdown_requested = 1;
+        // Wake the epoll loops, they never block in accept()
+        event_loop_request_stop();
+        // Force accept() to return with an error to handle the shutdown_requested,
+        // shutdown() wakes an acceptor blocked in accept() where close() doesn't
+        for (unsigned int i = 0; i < num_listeners; i++)
+        {
+            if (listen_fds[i] != UNINIT_VALUE)
+            {
+                shutdown(listen_fds[i], SHUT_RDWR);
+            }
+        }
+    }
+}
 
-#if (!USE_AESD_CHAR_DEVICE)
-#define FILE_PATH                               "/var/tmp/aesdsocketdata"
-#else
-#define FILE_PATH                               "/dev/aesdchar"
-#define AESD_SEEKTO_COMMAND                     "AESDCHAR_IOCSEEKTO:" 
-#define AESD_SEEKTO_PIVOT_LEN                   19
-#endif /*(!USE_AESD_CHAR_DEVICE)*/
+/**
+ * @brief A helper function used to return the socket IPv based address
+ * 
+ * @param sa     [IN]  Pointer to sockaddr structure
+ * 
+ * @return pointer to sin_addr in case of IPv4 and sin6_addr in IPv6
+ * 
+ */
+void *get_in_addr(struct sockaddr *sa)
+{
+    if (sa->sa_family == AF_INET) {
+        return &(((struct sockaddr_in*)sa)->sin_addr);
+    }
+    return &(((struct sockaddr_in6*)sa)->sin6_addr);
+}
+/**
+ * @brief Number of online CPUs, used when a thread count option is 0
+ */
+static unsigned int online_cpus(void)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return (cpus > 0) ? (unsigned int) cpus : 1;
+}
 
+/**
+ * @brief CPU of the index-th thread, round robin over the pin set
+ * 
+ * @return CPU number, -1 if the allowed CPUs are unknown
+ * 
+ */
+static int pin_set_cpu(unsigned int index)
+{
+    /* Captured before the first pinning narrows the mask of the calling thread. The
+       allowed CPUs need not be numbered 0..n-1 under a cpuset */
+    if (!pin_set_known)
+    {
+        if (sched_getaffinity(0, sizeof(pin_set), &pin_set) == -1 || CPU_COUNT(&pin_set) == 0)
+        {
+            return -1;
+        }
+        pin_set_known = 1;
+    }
+    unsigned int skip = index % CPU_COUNT(&pin_set);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (CPU_ISSET(cpu, &pin_set) && skip-- == 0)
+        {
+            return cpu;
+        }
+    }
+    return -1;
+}
 
 /**
- * @brief Node definition 
+ * @brief Pin a thread to one of the CPUs of the pin set, round robin
+ * 
+ * @param thread     [IN]  thread to pin
+ * @param index      [IN]  acceptor or loop number, wraps around the pin set
+ * 
+ * @return 0 on success, -1 on failure
+ * 
  */
-typedef struct client_thread {
-    pthread_t thread_id;
-    int client_fd;
-    int complete;
-#if (QUEUE_BSD_LINKED)
-    TAILQ_ENTRY(client_thread) entries;
-#else
-    struct client_thread * nxt_node;
-#endif 
-} client_thread_t;
-/*---------------------------------- Private Variables ----------------------------------  */
-static int data_packet_fd = UNINIT_VALUE;
-static int server_socket_fd = UNINIT_VALUE;
-static volatile sig_atomic_t shutdown_requested = 0;
-static pthread_mutex_t file_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_mutex_t thread_list_mutex = PTHREAD_MUTEX_INITIALIZER;
-#if (QUEUE_BSD_LINKED)
-static TAILQ_HEAD(client_thread_list, client_thread) thread_list;
-#else
-static client_thread_t* thread_list;
-#endif
-/*--------------------------------- Private Functions ---------------------------------  */
-void insert_at_end(client_thread_t** head, client_thread_t* new_node) 
+int pin_thread_to_cpu(pthread_t thread, unsigned int index)
 {
-    if (!new_node) return; // Ensure the new node is valid
+    cpu_set_t target;
+    int cpu = pin_set_cpu(index);
+
+    if (cpu == -1)
+    {
+        return -1;
+    }
+    CPU_ZERO(&target);
+    CPU_SET(cpu, &target);
+    int err = pthread_setaffinity_np(thread, sizeof(target), &target);
+    if (err != 0)
+    {
+        aesd_log(LOG_ERR, "Can't pin thread %u to CPU %d: %s\n", index, cpu, strerror(err));
+        return -1;
+    }
+    return 0;
+}
 
-    if (*head == NULL) 
+/**
+ * @brief Parse an unsigned numeric option argument
+ * 
+ * @param arg      [IN]  option argument
+ * @param value    [OUT] parsed value
+ * 
+ * @return 0 on success, -1 if the argument is not a number
+ * 
+ */
+static int parse_unsigned_option(const char *arg, unsigned int *value)
+{
+    char *endptr;
+    unsigned long parsed = strtoul(arg, &endptr, 10);
+    if (*arg == '\0' || *endptr != '\0')
     {
-        *head = new_node;
-        return;
+        return -1;
     }
+    *value = (unsigned int) parsed;
+    return 0;
+}
 
-    client_thread_t* temp = *head;
+/**
+ * @brief Parse the -q argument, <high_kb>[,<low_kb>]
+ * 
+ * @param arg      [IN]  option argument
+ * 
+ * @return 0 on success, -1 if the watermarks are malformed or low is not below high
+ * 
+ */
+static int parse_watermarks_option(const char *arg)
+{
+    char high_arg[32];
+    unsigned int high_kb;
+    unsigned int low_kb = 0;
+    const char *comma = strchr(arg, ',');
+    size_t high_len = (comma != NULL) ? (size_t) (comma - arg) : strlen(arg);
 
-    while (temp->nxt_node != NULL) 
+    if (high_len >= sizeof high_arg)
     {
-        temp = temp->nxt_node;
+        return -1;
     }
-    temp->nxt_node = new_node;
+    memcpy(high_arg, arg, high_len);
+    high_arg[high_len] = '\0';
+    if (parse_unsigned_option(high_arg, &high_kb) == -1 || high_kb == 0 ||
+        (comma != NULL && parse_unsigned_option(comma + 1, &low_kb) == -1) ||
+        low_kb >= high_kb || high_kb > INT_MAX / 1024)
+    {
+        return -1;
+    }
+    server_config.tx_high_water = high_kb * 1024;
+    server_config.tx_low_water = low_kb * 1024;
+    server_config.tx_watermarks_set = 1;
+    return 0;
 }
-client_thread_t* detect_and_rmv_node(client_thread_t** head, client_thread_t* node_to_remove) 
+
+/**
+ * @brief Parse the -r argument, <segment_kb>[,<keep_segments>[,<keep_seconds>]]
+ * 
+ * @param arg      [IN]  option argument
+ * 
+ * @return 0 on success, -1 if a field is not a number or the segment size is out of range
+ * 
+ */
+static int parse_segments_option(const char *arg)
 {
-    client_thread_t* nxt_node_client = NULL;
+    unsigned int *fields[] = { &server_config.segment_size, &server_config.keep_segments, &server_config.keep_seconds };
+    char field[32];
 
-    if (*head == NULL || node_to_remove == NULL)
+    for (size_t i = 0; i < sizeof fields / sizeof fields[0]; i++)
     {
-        goto func_exit;
+        size_t field_len = strcspn(arg, ",");
+        if (field_len >= sizeof field)
+        {
+            return -1;
+        }
+        memcpy(field, arg, field_len);
+        field[field_len] = '\0';
+        if (parse_unsigned_option(field, fields[i]) == -1)
+        {
+            return -1;
+        }
+        arg += field_len;
+        if (*arg == '\0')
+        {
+            break;
+        }
+        if (i + 1 == sizeof fields / sizeof fields[0])
+        {
+            /* More fields than -r takes */
+            return -1;
+        }
+        arg++;
+    }
+    if (server_config.segment_size == 0 || server_config.segment_size > MAX_SEGMENT_KB)
+    {
+        return -1;
+    }
+    server_config.segment_size *= 1024;
+    return 0;
+}
+
+/**
+ * @brief Parse the -L argument, [<cpus>][:<usec>], cpus is a list like 0-3,6 and
+ *        defaults to every allowed CPU, usec is the busy poll time
+ * 
+ * @param arg      [IN]  option argument, NULL for --low-latency alone
+ * 
+ * @return 0 on success, -1 for a malformed list or one without an allowed CPU
+ * 
+ */
+static int parse_low_latency_option(const char *arg)
+{
+    cpu_set_t allowed, wanted;
+    const char *colon = (arg != NULL) ? strchr(arg, ':') : NULL;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1)
+    {
+        return -1;
+    }
+    server_config.busy_poll_us = DEFAULT_BUSY_POLL_US;
+    if (colon != NULL && parse_unsigned_option(colon + 1, &server_config.busy_poll_us) == -1)
+    {
+        return -1;
+    }
+    CPU_ZERO(&wanted);
+    const char *range = arg;
+    while (range != NULL && range != colon && *range != '\0')
+    {
+        char *endptr;
+        unsigned long first = strtoul(range, &endptr, 10);
+        unsigned long last = first;
+        if (endptr == range)
+        {
+            return -1;
+        }
+        if (*endptr == '-')
+        {
+            range = endptr + 1;
+            last = strtoul(range, &endptr, 10);
+            if (endptr == range)
+            {
+                return -1;
+            }
+        }
+        if (first > last || last >= CPU_SETSIZE)
+        {
+            return -1;
+        }
+        for (unsigned long cpu = first; cpu <= last; cpu++)
+        {
+            CPU_SET(cpu, &wanted);
+        }
+        if (*endptr != ',' && endptr != colon && *endptr != '\0')
+        {
+            return -1;
+        }
+        range = (*endptr == ',') ? endptr + 1 : endptr;
+    }
+    if (CPU_COUNT(&wanted) > 0)
+    {
+        CPU_AND(&allowed, &allowed, &wanted);
+    }
+    if (CPU_COUNT(&allowed) == 0)
+    {
+        return -1;
+    }
+    pin_set = allowed;
+    pin_set_known = 1;
+    server_config.low_latency = 1;
+    server_config.pin_cpus = 1;
+    return 0;
+}
+
+/**
+ * @brief Parse the -S argument, pause|drop|disconnect[:<msec>]
+ * 
+ * @param arg      [IN]  option argument
+ * 
+ * @return 0 on success, -1 for an unknown policy or a malformed timeout
+ * 
+ */
+static int parse_slow_consumer_option(const char *arg)
+{
+    static const char *const policy_names[] = {
+        [SLOW_CONSUMER_PAUSE]      = "pause",
+        [SLOW_CONSUMER_DROP]       = "drop",
+        [SLOW_CONSUMER_DISCONNECT] = "disconnect",
+    };
+    const char *colon = strchr(arg, ':');
+    size_t name_len = (colon != NULL) ? (size_t) (colon - arg) : strlen(arg);
+
+    for (size_t i = 0; i < sizeof policy_names / sizeof policy_names[0]; i++)
+    {
+        if (strlen(policy_names[i]) != name_len || strncmp(arg, policy_names[i], name_len) != 0)
+        {
+            continue;
+        }
+        if (colon != NULL &&
+            (parse_unsigned_option(colon + 1, &server_config.stall_timeout_ms) == -1 || server_config.stall_timeout_ms == 0))
+        {
+            return -1;
+        }
+        server_config.slow_policy = (slow_consumer_policy_t) i;
+        return 0;
+    }
+    return -1;
+}
+
+/**
+ * @brief Parse the command line into server_config, if -d is passed it demonize the server process
+ *        -d            run as a daemon
+ *        -e <loops>    serve clients from <loops> epoll threads instead of a thread per connection,
+ *                      0 starts one loop per online CPU
+ *        -c <count>    maximum number of concurrent connections in event mode
+ *        -p <workers>  run the append and readback of complete packets on a bounded worker
+ *                      pool with work stealing, 0 sizes it to the online CPUs. Implies -e 1
+ *                      unless -e is given
+ *        -u            submit the readbacks of the client threads through io_uring,
+ *                      falls back to the synchronous path when the kernel refuses io_uring
+ *        -m            keep an in-memory mirror of the data file and serve readbacks from it
+ *                      with writev, file backend only. Takes precedence over -u
+ *        -g            append the packets of all clients through a single group commit writer,
+ *                      file backend only
+ *        -b <packets>  maximum packets per group commit batch, implies -g
+ *        -l <usec>     time the group commit writer waits for a batch to fill, implies -g
+ *        -s <port>     serve Prometheus metrics on a TCP port, or on a UNIX socket if the
+ *                      argument is a path
+ *        -a <count>    open <count> SO_REUSEPORT listeners, each served by its own acceptor thread
+ *                      (or shared round robin by the event loops), 0 opens one per online CPU
+ *        -A            pin acceptor i, or event loop i, to the i-th CPU the process may use
+ *        -v <level>    log messages up to this syslog level, 0 (LOG_EMERG) to 7 (LOG_DEBUG),
+ *                      LOG_INFO by default
+ *        -i <msec>     interval between two timestamps appended to the data file, 10000 by
+ *                      default, 0 disables them. File backend only
+ *        -q <high_kb>[,<low_kb>]
+ *                      output queue watermarks of a client, 256,0 by default. A client stops
+ *                      being read once high is queued for it and is read again when the queue
+ *                      drains below low. Also sizes the socket send buffer to high and sets
+ *                      TCP_NOTSENT_LOWAT to low
+ *        -S <policy>[:<msec>]
+ *                      what to do with a client whose socket accepted nothing for <msec>,
+ *                      5000 by default: pause (default, keep waiting), drop (abandon the
+ *                      readback) or disconnect
+ *        -r <segment_kb>[,<keep_segments>[,<keep_seconds>]]
+ *                      store the data in segment files of <segment_kb> with a line index each,
+ *                      keep at most <keep_segments> of them and retire those not appended to for
+ *                      <keep_seconds>, 0 keeps them. Readbacks send the retained segments only.
+ *                      File backend only, takes precedence over -m and -u
+ *        -C <max_kb>   read the stored data once for all the readbacks of the same generation
+ *                      and send it from a shared snapshot, as long as it is at most <max_kb>.
+ *                      Ignored with -m and -u, which have their own readback path
+ *        -B <max_kb>   bytes of a text packet a connection buffers in memory, 1024 by default.
+ *                      A longer packet is streamed to a staging file in STAGE_DIR as it arrives
+ *                      and its newline appends it whole, 0 buffers any packet in memory
+ *        -Z <min_kb>   send the readbacks of at least <min_kb> served from memory (-m or -C)
+ *                      with MSG_ZEROCOPY. The buffers stay pinned until the socket error queue
+ *                      reports the kernel done with them. Worth it from about 16 on a NIC with
+ *                      scatter-gather, loopback copies anyway
+ *        -t <backend>  where the packets are stored: file (DATA_FILE_PATH), chardev (DEVICE_PATH)
+ *                      or memory (the aesdchar circular buffer inside the server, for load
+ *                      tests without the driver). chardev by default unless built with
+ *                      USE_AESD_CHAR_DEVICE=0
+ *        -L [<cpus>][:<usec>], --low-latency[=[<cpus>][:<usec>]]
+ *                      pin the acceptors, event loops and client threads to <cpus> (a list
+ *                      like 0-3,6, every allowed CPU if empty), steer each SO_REUSEPORT
+ *                      listener to the CPU of its thread with SO_INCOMING_CPU and move a client
+ *                      thread to the CPU its packets arrive on. The client sockets busy poll
+ *                      for <usec>, 50 by default (SO_BUSY_POLL, above net.core.busy_read it
+ *                      needs CAP_NET_ADMIN), and send without Nagle. Implies -A, best with
+ *                      -a <number of cpus>
+ * 
+ * @param argc     [IN]  number of arguments
+ * @param argv     [IN]  array of pointers to strings passed in arguments execution
+ * 
+ * @return status indicating the correctness of the options and daemonization
+ * 
+ */
+static int check_and_handle_options(int argc, char** argv)
+{
+    static const struct option long_options[] = {
+        { "low-latency", optional_argument, NULL, 'L' },
+        { NULL, 0, NULL, 0 }
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "de:c:p:umgb:l:s:a:Av:i:q:S:r:t:C:L:B:Z:", long_options, NULL)) != -1) 
+    {
+        switch (opt)
+        {
+        case 'd':
+            server_config.daemonize = 1;
+            break;
+        case 'e':
+            if (parse_unsigned_option(optarg, &server_config.event_loops) == -1)
+            {
+                aesd_log(LOG_ERR, "Invalid number of event loops\n");
+                return EXIT_FAILURE;
+            }
+            /* 0 is a valid request for one loop per CPU, keep a marker that the mode is on */
+            if (server_config.event_loops == 0)
+            {
+                server_config.event_loops = online_cpus();
+            }
+            break;
+        case 'p':
+            if (parse_unsigned_option(optarg, &server_config.pool_workers) == -1)
+            {
+                aesd_log(LOG_ERR, "Invalid number of pool workers\n");
+                return EXIT_FAILURE;
+            }
+            if (server_config.pool_workers == 0)
+            {
+                server_config.pool_workers = online_cpus();
+            }
+            break;
+        case 'c':
+            if (parse_unsigned_option(optarg, &server_config.max_connections) == -1 || server_config.max_connections == 0)
+            {
+                aesd_log(LOG_ERR, "Invalid connection limit\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'u':
+            server_config.use_uring = 1;
+            break;
+        case 'm':
+            server_config.use_log = 1;
+            break;
+        case 'b':
+            if (parse_unsigned_option(optarg, &server_config.commit_batch) == -1 || server_config.commit_batch == 0)
+            {
+                aesd_log(LOG_ERR, "Invalid group commit batch size\n");
+                return EXIT_FAILURE;
+            }
+            server_config.group_commit = 1;
+            break;
+        case 'l':
+            if (parse_unsigned_option(optarg, &server_config.commit_latency_us) == -1)
+            {
+                aesd_log(LOG_ERR, "Invalid group commit latency\n");
+                return EXIT_FAILURE;
+            }
+            server_config.group_commit = 1;
+            break;
+        case 'g':
+            server_config.group_commit = 1;
+            break;
+        case 's':
+            server_config.stats_endpoint = optarg;
+            break;
+        case 'a':
+            if (parse_unsigned_option(optarg, &server_config.acceptors) == -1)
+            {
+                aesd_log(LOG_ERR, "Invalid number of acceptors\n");
+                return EXIT_FAILURE;
+            }
+            if (server_config.acceptors == 0)
+            {
+                server_config.acceptors = online_cpus();
+            }
+            if (server_config.acceptors > MAX_ACCEPTORS)
+            {
+                server_config.acceptors = MAX_ACCEPTORS;
+            }
+            break;
+        case 'A':
+            server_config.pin_cpus = 1;
+            break;
+        case 'v':
+        {
+            unsigned int level;
+            if (parse_unsigned_option(optarg, &level) == -1 || level > LOG_DEBUG)
+            {
+                aesd_log(LOG_ERR, "Invalid log level\n");
+                return EXIT_FAILURE;
+            }
+            log_ring_set_level((int) level);
+            break;
+        }
+        case 'i':
+            if (parse_unsigned_option(optarg, &server_config.timestamp_interval_ms) == -1)
+            {
+                aesd_log(LOG_ERR, "Invalid timestamp interval\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'q':
+            if (parse_watermarks_option(optarg) == -1)
+            {
+                aesd_log(LOG_ERR, "Invalid output queue watermarks\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'S':
+            if (parse_slow_consumer_option(optarg) == -1)
+            {
+                aesd_log(LOG_ERR, "Invalid slow consumer policy\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'r':
+            if (parse_segments_option(optarg) == -1)
+            {
+                aesd_log(LOG_ERR, "Invalid segment size or retention\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'C':
+            if (parse_unsigned_option(optarg, &server_config.readback_cache_size) == -1 ||
+                server_config.readback_cache_size > INT_MAX / 1024)
+            {
+                aesd_log(LOG_ERR, "Invalid readback cache size\n");
+                return EXIT_FAILURE;
+            }
+            server_config.readback_cache_size *= 1024;
+            break;
+        case 'B':
+            if (parse_unsigned_option(optarg, &server_config.packet_buffer_limit) == -1 ||
+                server_config.packet_buffer_limit > INT_MAX / 1024)
+            {
+                aesd_log(LOG_ERR, "Invalid packet buffer limit\n");
+                return EXIT_FAILURE;
+            }
+            server_config.packet_buffer_limit *= 1024;
+            break;
+        case 'Z':
+            if (parse_unsigned_option(optarg, &server_config.zerocopy_min) == -1 ||
+                server_config.zerocopy_min > INT_MAX / 1024)
+            {
+                aesd_log(LOG_ERR, "Invalid zerocopy threshold\n");
+                return EXIT_FAILURE;
+            }
+            server_config.zerocopy_min *= 1024;
+            break;
+        case 'L':
+            if (parse_low_latency_option(optarg) == -1)
+            {
+                aesd_log(LOG_ERR, "Invalid low latency CPU list or busy poll time\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 't':
+            if (storage_select(optarg) == -1)
+            {
+                aesd_log(LOG_ERR, "Unknown storage backend %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        default:
+            aesd_log(LOG_ERR, "Invalid arguments\n");
+            return EXIT_FAILURE;
+        }
     }
+    if (!(storage->flags & STORAGE_DATA_FILE))
+    {
+        /* Every write() is an aesdchar entry and seek commands need the packet's own descriptor */
+        if (server_config.group_commit || server_config.use_log || server_config.segment_size > 0)
+        {
+            aesd_log(LOG_INFO, "-g, -m and -r apply to the data file only, ignored for the %s backend\n", storage->name);
+        }
+        server_config.group_commit = 0;
+        server_config.use_log = 0;
+        server_config.segment_size = 0;
+        /* aesdchar has never been timestamped */
+        server_config.timestamp_interval_ms = 0;
+        if (server_config.use_uring && !(storage->flags & STORAGE_DESCRIPTOR))
+        {
+            aesd_log(LOG_INFO, "The %s backend has no descriptor to read, -u ignored\n", storage->name);
+            server_config.use_uring = 0;
+        }
+    }
+    if (server_config.segment_size > 0 && (server_config.use_log || server_config.use_uring))
+    {
+        /* Both read a single data file: the mirror would keep the retired segments and
+           the ring registers one descriptor */
+        aesd_log(LOG_INFO, "Segments are read with the synchronous path, -m and -u ignored\n");
+        server_config.use_log = 0;
+        server_config.use_uring = 0;
+    }
+    if (server_config.use_log)
+    {
+        server_config.use_uring = 0;
+    }
+    if (server_config.readback_cache_size > 0 && (server_config.use_log || server_config.use_uring))
+    {
+        /* The append log already shares one copy of the data between the readbacks */
+        aesd_log(LOG_INFO, "-m and -u read back on their own path, -C ignored\n");
+        server_config.readback_cache_size = 0;
+    }
+    if (server_config.zerocopy_min > 0 && !server_config.use_log && server_config.readback_cache_size == 0)
+    {
+        /* The other readbacks are spliced by sendfile() or read into a reused buffer */
+        aesd_log(LOG_INFO, "-Z applies to the readbacks of -m and -C, ignored\n");
+        server_config.zerocopy_min = 0;
+    }
+    if (server_config.use_uring && !uring_io_supported())
+    {
+        aesd_log(LOG_INFO, "io_uring is not available, using the synchronous I/O path\n");
+        server_config.use_uring = 0;
+    }
+    if (server_config.pool_workers > 0 && server_config.event_loops == 0)
+    {
+        server_config.event_loops = 1;
+    }
+    if (server_config.daemonize && daemon(0, 0) == -1) 
+    {
+        aesd_log(LOG_ERR, "Daemon failed\n");
+        return EXIT_FAILURE;
+    }
+    return 0;
+}
+
+/**
+ * @brief Apply a packet that is an AESD_SEEKTO_COMMAND to the handle of the connection
+ * 
+ * @param ptr_buff    [IN]  packet
+ * @param handle      [IN/OUT] storage handle of the connection
+ * 
+ * @return EXIT_SUCCESS if the packet was a seek command, EXIT_FAILURE if it is data
+ * 
+ */
+int Check_seekCmd(char * ptr_buff, storage_handle_t *handle)
+{
+    int retval = EXIT_FAILURE;
+    if (strncmp(ptr_buff, AESD_SEEKTO_COMMAND, AESD_SEEKTO_PIVOT_LEN) == 0) 
+    {
+        aesd_log(LOG_DEBUG, "[USER SPACE] Detected ICOTL COMMAND\n"); 
+        char *pos_of_valid_digit = strchr(ptr_buff, ':');
+        if (pos_of_valid_digit != NULL) 
+        {
+            /* Get the next value */
+            pos_of_valid_digit++;
+            
+            char *endptr;
+            uint32_t write_cmd = strtoul(pos_of_valid_digit, &endptr, 10);
+            if (*endptr == ',') 
+            {
+                pos_of_valid_digit = endptr + 1; 
+                uint32_t offset = strtoul(pos_of_valid_digit, &endptr, 10);
+                aesd_log(LOG_DEBUG, "[USER SPACE] Detected ICOTL COMMAND offsets (%d,%d)\n", write_cmd, offset); 
+                if (storage->seekto(handle, write_cmd, offset) != 0) 
+                {
+                    aesd_log(LOG_ERR, "[USER SPACE] Error in applying the seek command\n"); 
+                    retval = EXIT_FAILURE;
+                }
+                retval = EXIT_SUCCESS;
+            }
+        }
+    }
+    return retval;
+}
+
+/**
+ * @brief Send the data file to the client with sendfile() so the contents never pass
+ *        through user space
+ * 
+ * @param sock_fd     [IN]  client socket, blocking or not
+ * @param file_fd     [IN]  data file descriptor
+ * @param offset      [IN/OUT]  position to send from, updated with the octets sent. NULL
+ *                              uses and moves the descriptor position (seek command)
+ * @param end         [IN]  offset to stop at when offset is given, -1 sends up to EOF
+ * 
+ * @return READBACK_DONE at EOF, READBACK_WOULD_BLOCK if a non-blocking socket is full,
+ *         READBACK_UNSUPPORTED if the file can't be spliced and nothing was sent, -1 on error
+ * 
+ */
+int readback_sendfile(int sock_fd, int file_fd, off_t *offset, off_t end)
+{
+    int first = 1;
+
+    if (!sendfile_supported)
+    {
+        return READBACK_UNSUPPORTED;
+    }
+    for (;;)
+    {
+        size_t count = SENDFILE_CHUNK;
+        if (offset != NULL && end >= 0)
+        {
+            if (*offset >= end)
+            {
+                return READBACK_DONE;
+            }
+            if (end - *offset < (off_t) count)
+            {
+                count = end - *offset;
+            }
+        }
+        ssize_t sent_octets = sendfile(sock_fd, file_fd, offset, count);
+        if (sent_octets > 0)
+        {
+            metrics_add(METRIC_BYTES_OUT, sent_octets);
+            first = 0;
+            continue;
+        }
+        if (sent_octets == 0)
+        {
+            return READBACK_DONE;
+        }
+        if (errno == EINTR)
+        {
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            return READBACK_WOULD_BLOCK;
+        }
+        if (first && (errno == EINVAL || errno == ENOSYS))
+        {
+            aesd_log(LOG_INFO, "sendfile not supported by %s, copying the readback\n", DATA_FILE_PATH);
+            sendfile_supported = 0;
+            return READBACK_UNSUPPORTED;
+        }
+        return -1;
+    }
+}
 
-    // If the node to remove is the head
-    if (*head == node_to_remove) 
+/**
+ * @brief Apply the output queue limits to a new client socket
+ *        With -q the kernel send buffer is capped to the high watermark and
+ *        TCP_NOTSENT_LOWAT keeps the socket unwritable until the unsent bytes fall
+ *        below the low watermark, so a client that stops reading pins a bounded
+ *        amount of kernel memory and its sender wakes once per drained low
+ *        watermark instead of once per ACK. The blocking sockets of the client
+ *        threads get the stall timeout as SO_SNDTIMEO unless the policy is pause,
+ *        the event loops time their non-blocking sockets themselves. With -L the
+ *        socket busy polls its receive queue and sends the readback chunks without
+ *        waiting for the ACK of the previous one.
+ * 
+ * @param fd        [IN]  accepted client socket
+ * @param blocking  [IN]  1 if the socket is served by a client thread
+ * 
+ * @return None
+ * 
+ */
+void configure_client_socket(int fd, int blocking)
+{
+    if (server_config.tx_watermarks_set)
     {
-        *head = node_to_remove->nxt_node;
-        free(node_to_remove);
-        nxt_node_client = *head;
-        goto func_exit;
+        int sndbuf = (int) server_config.tx_high_water;
+        if (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof sndbuf) == -1)
+        {
+            aesd_log(LOG_DEBUG, "Can't set SO_SNDBUF: %s\n", strerror(errno));
+        }
+        int lowat = (int) server_config.tx_low_water;
+        if (lowat > 0 && setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof lowat) == -1)
+        {
+            aesd_log(LOG_DEBUG, "Can't set TCP_NOTSENT_LOWAT: %s\n", strerror(errno));
+        }
     }
-
-    // Find the node before the node to remove
-    client_thread_t* temp = *head;
-    while (temp->nxt_node != NULL && temp->nxt_node != node_to_remove) 
+    if (blocking && server_config.slow_policy != SLOW_CONSUMER_PAUSE)
     {
-        temp = temp->nxt_node;
+        struct timeval timeout = {
+            .tv_sec  = server_config.stall_timeout_ms / 1000,
+            .tv_usec = (server_config.stall_timeout_ms % 1000) * 1000,
+        };
+        if (setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout) == -1)
+        {
+            aesd_log(LOG_DEBUG, "Can't set SO_SNDTIMEO: %s\n", strerror(errno));
+        }
     }
-
-    // If node was found in the list
-    if (temp->nxt_node == node_to_remove) 
+    if (server_config.low_latency)
     {
-        temp->nxt_node = node_to_remove->nxt_node;
-        free(node_to_remove);
-        nxt_node_client = temp->nxt_node;
+        int yes = 1;
+        int busy_poll = (int) server_config.busy_poll_us;
+        if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof yes) == -1)
+        {
+            aesd_log(LOG_DEBUG, "Can't set TCP_NODELAY: %s\n", strerror(errno));
+        }
+        if (busy_poll > 0 && setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll, sizeof busy_poll) == -1)
+        {
+            aesd_log(LOG_DEBUG, "Can't set SO_BUSY_POLL: %s\n", strerror(errno));
+        }
     }
-func_exit:
-    return nxt_node_client;
 }
 
-#if  (!USE_AESD_CHAR_DEVICE)
 /**
- * @brief timer signal handler 
+ * @brief Move the calling client thread to the CPU that received the last packet of
+ *        its socket (SO_INCOMING_CPU), so the handler runs where the receive left the
+ *        data in cache. A CPU outside the -L set keeps the thread on the whole set
  * 
- * @param signo [IN]: the signal received
+ * @param fd        [IN]  client socket that just received data
  * 
+ * @return None
  * 
- */void timer_handler(int signo) 
+ */
+static void follow_incoming_cpu(int fd)
 {
-    if (signo == SIGALRM) 
-    {
-        syslog(LOG_DEBUG, "SIGALARM signal caught\n");
-        char timestamp[128];
-        time_t now = time(NULL);
-        struct tm *tm_info = localtime(&now);
-
-        // Format timestamp as RFC 2822
-        strftime(timestamp, sizeof(timestamp), "timestamp: %a, %d %b %Y %H:%M:%S %z\n", tm_info);
-
-        // Append to file
-        pthread_mutex_lock(&file_mutex);
-        write(data_packet_fd, timestamp, strlen(timestamp));
-        pthread_mutex_unlock(&file_mutex);
+    cpu_set_t target = pin_set;
+    int cpu;
+    socklen_t len = sizeof cpu;
 
+    if (getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == 0 && cpu >= 0 && cpu < CPU_SETSIZE &&
+        CPU_ISSET(cpu, &pin_set))
+    {
+        CPU_ZERO(&target);
+        CPU_SET(cpu, &target);
+    }
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(target), &target);
+    if (err != 0)
+    {
+        aesd_log(LOG_DEBUG, "Can't move client %d to its incoming CPU: %s\n", fd, strerror(err));
     }
 }
 
 /**
- * @brief Function to initialize the timer and start it 
+ * @brief Apply the slow consumer policy to a client that accepted nothing for the stall timeout
+ * 
+ * @param client_fd [IN]  client socket, for the log
+ * @param droppable [IN]  1 if the stalled output is a readback that can be abandoned
+ * 
+ * @return 0 if the output was dropped and the connection goes on, -1 if it has to be closed
  * 
  */
-void start_timer(void) 
+int slow_consumer_stalled(int client_fd, int droppable)
 {
-    struct sigevent sev;
-    struct itimerspec its;
-    timer_t timerid;
-    struct sigaction sa;
-
-    // Set up signal handler for SIGALRM
-    sa.sa_flags = SA_RESTART;
-    sa.sa_handler = timer_handler;
-    sigemptyset(&sa.sa_mask);
-    sigaction(SIGALRM, &sa, NULL);
-
-    // Create a timer that triggers SIGALRM
-    sev.sigev_notify = SIGEV_SIGNAL;
-    sev.sigev_signo = SIGALRM;
-    sev.sigev_value.sival_ptr = &timerid;
-    timer_create(CLOCK_REALTIME, &sev, &timerid);
-
-    // Configure the timer to fire every 10 seconds
-    its.it_value.tv_sec = 10;  // Initial expiration
-    its.it_value.tv_nsec = 0;
-    its.it_interval.tv_sec = 10;  // Repeats every 10 seconds
-    its.it_interval.tv_nsec = 0;
-
-    // Start the timer
-    timer_settime(timerid, 0, &its, NULL);
+    if (server_config.slow_policy == SLOW_CONSUMER_DROP && droppable)
+    {
+        metrics_add(METRIC_SLOW_CONSUMER_DROPS, 1);
+        aesd_log(LOG_INFO, "Client %d stalled, readback dropped\n", client_fd);
+        return 0;
+    }
+    metrics_add(METRIC_SLOW_CONSUMER_DISCONNECTS, 1);
+    aesd_log(LOG_INFO, "Client %d stalled, disconnecting\n", client_fd);
+    return -1;
 }
-#endif /*(!USE_AESD_CHAR_DEVICE)*/
+
 /**
- * @brief A special signal handler to clean up the system when SIGTERM or SIGINT is initiated
+ * @brief Send the stored data back to the client through the fastest available path:
+ *        io_uring, the in-memory append log, the shared readback snapshot, sendfile
+ *        and finally a copy loop
  * 
- * @param signo     [IN]  signal value
+ * @param accepted_fd [IN]  client socket
+ * @param ring        [IN]  io_uring of the connection, NULL if not used
+ * @param handle      [IN]  storage handle, the readback starts at its position
+ * @param end         [IN]  offset the readback stops at, -1 sends up to the end of the data
+ * @param zc          [IN/OUT] zerocopy tracker of the connection
  * 
- * @return None
+ * @return 0 on success, -1 if the client can't be served anymore
  * 
  */
-static void special_signal_handler(int signo) 
+static int readback_to_client(int accepted_fd, uring_io_t *ring, storage_handle_t *handle, off_t end, zerocopy_t *zc)
 {
+    int readback_status = READBACK_UNSUPPORTED;
+    append_log_cursor_t log_cursor;
+    struct readback_snapshot *snapshot;
+    /* Explicit offset, the shared descriptors are never repositioned and bytes past
+       the watermark, possibly still being written, are never sent */
+    off_t offset = handle->position;
 
-    if (signo == SIGTERM || signo == SIGINT) {
-        syslog(LOG_DEBUG, "Caught signal, exiting");
-        shutdown_requested = 1;
-        // Force accept() to return with an error to handle the shutdown_requested
-        close(server_socket_fd); 
+    if (ring != NULL)
+    {
+        /* No descriptor reads the registered data file, a device is read from the
+           position its packet left */
+        return uring_io_readback(ring, handle->fd, end);
+    }
+    if (server_config.use_log && append_log_snapshot(&log_cursor) == 0)
+    {
+        if (end >= 0 && log_cursor.remaining > (size_t) end)
+        {
+            log_cursor.remaining = end;
+        }
+        readback_status = append_log_send(accepted_fd, &log_cursor, zc);
+        append_log_release(&log_cursor);
+        return (readback_status == READBACK_WOULD_BLOCK) ? slow_consumer_stalled(accepted_fd, 1) : readback_status;
+    }
+    if (server_config.readback_cache_size > 0 && (snapshot = readback_cache_get(handle, offset, end)) != NULL)
+    {
+        readback_status = readback_cache_send(accepted_fd, snapshot, &offset, end, zc);
+        readback_cache_put(snapshot);
+        return (readback_status == READBACK_WOULD_BLOCK) ? slow_consumer_stalled(accepted_fd, 1) : readback_status;
+    }
+    if (storage->send != NULL)
+    {
+        readback_status = storage->send(handle, accepted_fd, &offset, end);
+    }
+    if (readback_status == READBACK_UNSUPPORTED)
+    {
+        /* Read Back everything in the device */
+        char file_buf[MAXDATASIZE];
+        ssize_t read_octets;
+        readback_status = 0;
+        for (;;)
+        {
+            size_t chunk = MAXDATASIZE - 1;
+            if (end >= 0 && end - offset < (off_t) chunk)
+            {
+                chunk = (end > offset) ? end - offset : 0;
+            }
+            if (chunk == 0 || (read_octets = storage->read(handle, file_buf, chunk, &offset)) <= 0)
+            {
+                break;
+            }
+            file_buf[read_octets] = '\0';
+            /* A send may take only part of the chunk, finish it before reading the next */
+            for (ssize_t chunk_sent = 0; chunk_sent < read_octets && readback_status == 0; )
+            {
+                ssize_t sent_octets = send(accepted_fd, file_buf + chunk_sent, read_octets - chunk_sent, MSG_NOSIGNAL);
+                if (sent_octets == -1)
+                {
+                    if (errno != EINTR)
+                    {
+                        readback_status = (errno == EAGAIN || errno == EWOULDBLOCK) ? READBACK_WOULD_BLOCK : -1;
+                    }
+                    continue;
+                }
+                metrics_add(METRIC_BYTES_OUT, sent_octets);
+                chunk_sent += sent_octets;
+            }
+            if (readback_status != 0)
+            {
+                break;
+            }
+        }
     }
+    /* Only reached by a send timeout, the client sockets of the threads are blocking */
+    return (readback_status == READBACK_WOULD_BLOCK) ? slow_consumer_stalled(accepted_fd, 1) : readback_status;
 }
 
 /**
- * @brief A helper function used to return the socket IPv based address
- * 
- * @param sa     [IN]  Pointer to sockaddr structure
+ * @brief Answer one committed packet with its readback and account it
  * 
- * @return pointer to sin_addr in case of IPv4 and sin6_addr in IPv6
+ * @return readback_to_client() result
  * 
  */
-static void *get_in_addr(struct sockaddr *sa)
+static int readback_packet(int accepted_fd, uring_io_t *ring, storage_handle_t *handle, zerocopy_t *zc,
+                           off_t committed_len, uint64_t first_byte_ns)
 {
-    if (sa->sa_family == AF_INET) {
-        return &(((struct sockaddr_in*)sa)->sin_addr);
+    unsigned long sent_before = metrics_thread_value(METRIC_BYTES_OUT);
+
+    AESD_PROBE3(readback_start, accepted_fd, handle->position, committed_len);
+    int readback_status = readback_to_client(accepted_fd, ring, handle, committed_len, zc);
+    unsigned long sent = metrics_thread_value(METRIC_BYTES_OUT) - sent_before;
+    AESD_PROBE2(readback_done, accepted_fd, sent);
+    if (readback_status != -1)
+    {
+        metrics_packet_done(first_byte_ns, sent);
     }
-    return &(((struct sockaddr_in6*)sa)->sin6_addr);
+    return readback_status;
 }
+
 /**
- * @brief check if -d option is passed in the parameters if exists it demonize the server process
+ * @brief Commit the complete packets of a receive and answer each one with a readback
+ *        The data file takes all of them with one append. On the backends that behave
+ *        like aesdchar every write() becomes one entry and a packet may be a seek
+ *        command, so packets are committed one by one there. A staged packet head is
+ *        completed by the first packet and committed on its own.
  * 
- * @param argc     [IN]  number of arguments
- * @param argv     [IN]  array of pointers to strings passed in arguments execution
+ * @param accepted_fd [IN]  client socket
+ * @param frame       [IN]  buffer starting with the complete packets
+ * @param frame_len   [IN]  length of the complete packets, up to the last newline
+ * @param packets     [IN]  number of packets in frame
+ * @param ring        [IN]  io_uring of the connection, NULL if not used
+ * @param handle      [IN/OUT] storage handle of the connection
+ * @param stage       [IN/OUT] staged head of the first packet, emptied by its commit
+ * @param zc          [IN/OUT] zerocopy tracker of the connection
+ * @param first_byte_ns [IN]  metrics_now() when the first byte of the first packet arrived
+ * @param recv_ns     [IN]  metrics_now() of the receive, when the other packets arrived
  * 
- * @return status indicating the correctness of daemonization
+ * @return 0 on success, -1 if the connection has to be closed
  * 
  */
-static int check_and_handle_daemon_option(int argc, char** argv)
+static int process_frame(int accepted_fd, char *frame, size_t frame_len, size_t packets, uring_io_t *ring,
+                         storage_handle_t *handle, storage_stage_t *stage, zerocopy_t *zc, uint64_t first_byte_ns,
+                         uint64_t recv_ns)
 {
-    int opt;
-    while ((opt = getopt(argc, argv, "d")) != -1) 
+    int readback_status = 0;
+    off_t committed_len = -1;
+
+    if (stage->len > 0)
     {
-        if (opt == 'd') 
+        size_t packet_len = framing_find_newline(frame, frame_len) - frame + 1;
+        off_t staged_len = stage->len;
+        if (storage_stage_commit(handle, stage, frame, packet_len, &committed_len) == -1)
         {
-            if (daemon(0, 0) == -1) 
-            {
-                syslog(LOG_ERR, "Daemon failed\n");
-                return EXIT_FAILURE;
-            }
+            return -1;
         }
-        else 
+        AESD_PROBE3(append_done, accepted_fd, staged_len + packet_len, committed_len);
+        readback_status = readback_packet(accepted_fd, ring, handle, zc, committed_len, first_byte_ns);
+        first_byte_ns = recv_ns;
+        frame += packet_len;
+        frame_len -= packet_len;
+        if (--packets == 0 || readback_status == -1)
         {
-            syslog(LOG_ERR, "Invalid arguments\n");
-            return EXIT_FAILURE;
+            return readback_status;
         }
     }
-    return 0;
-}
+    if (storage->flags & STORAGE_SEEK_COMMANDS)
+    {
+        char *packet = frame;
+        while (packets-- > 0 && readback_status != -1)
+        {
+            const char *newline_pos = framing_find_newline(packet, frame + frame_len - packet);
+            size_t packet_len = newline_pos - packet + 1;
 
+            /* A seek command or the append positions the handle for the readback */
+            committed_len = -1;
+            int seek_cmd = (Check_seekCmd(packet, handle) == EXIT_SUCCESS);
+            if (seek_cmd || storage->append(handle, packet, packet_len, &committed_len) != -1)
+            {
+                if (!seek_cmd)
+                {
+                    AESD_PROBE3(append_done, accepted_fd, packet_len, committed_len);
+                }
+                readback_status = readback_packet(accepted_fd, ring, handle, zc, committed_len, first_byte_ns);
+            }
+            else
+            {
+                readback_status = -1;
+            }
+            first_byte_ns = recv_ns;
+            packet += packet_len;
+        }
+        return readback_status;
+    }
+    /* One append for every packet of the receive */
+    if (storage->append(handle, frame, frame_len, &committed_len) == -1)
+    {
+        return -1;
+    }
+    AESD_PROBE3(append_done, accepted_fd, frame_len, committed_len);
+    /* Pipelining clients still get one readback per packet, which stops at the end of
+       that packet like the one packet appends of the event loops. The append returned
+       the end of this frame (data file and group commit requests alike, the memory
+       ring under the lock of the append), the packet ends are counted back from it.
+       -1 (chardev) leaves every readback unbounded */
+    const char *packet = frame;
+    off_t packet_end = committed_len - frame_len;
+    while (packets-- > 0 && readback_status != -1)
+    {
+        size_t packet_len = framing_find_newline(packet, frame + frame_len - packet) - packet + 1;
+        packet += packet_len;
+        packet_end += packet_len;
+        readback_status = readback_packet(accepted_fd, ring, handle, zc, (committed_len >= 0) ? packet_end : -1,
+                                          first_byte_ns);
+        first_byte_ns = recv_ns;
+    }
+    return readback_status;
+}
 /**
- * @brief Helper function to check and resize the buffer used for recv on the socket
- * @param packet_buffer              [IN/OUT]  pointer to the packet_buffer which may be reallocated 
- * @param packet_buffer_capacity     [IN/OUT]  pointer to the current capacity of the buffer pointed to by packet_buffer
- * @param consumed_buffer_size       [IN]  Number of octets consumed in the buffer
- * @param recv_octets                [IN]  total number of received octets from recv call
+ * @brief Serve the binary commands of a connection that negotiated them, or decide
+ *        from the first bytes that it speaks the text protocol
  * 
- * @return status indicating the correctness of resize if needed
+ * @param accepted_fd [IN]  client socket
+ * @param session     [IN/OUT] protocol state of the connection
+ * @param handle      [IN/OUT] storage handle of the connection
+ * @param rx          [IN/OUT] receive buffer, the executed commands are consumed
+ * 
+ * @return 0 on success, -1 if the connection has to be closed
  * 
  */
-static int check_and_resize_buffer(char **packet_buffer, size_t *packet_buffer_capacity, size_t consumed_buffer_size, size_t recv_octets) 
+static int serve_binary(int accepted_fd, binproto_session_t *session, storage_handle_t *handle, rx_buffer_t *rx)
 {
-    if (consumed_buffer_size + recv_octets >= *packet_buffer_capacity) 
+    if (session->mode == BINPROTO_MODE_UNKNOWN)
     {
-        size_t required_capacity = consumed_buffer_size + recv_octets + 1;
-        char *new_buffer = realloc(*packet_buffer, required_capacity);
-        if (new_buffer == NULL) {
-            syslog(LOG_ERR, "realloc failed\n");
-            free(*packet_buffer);
+        ssize_t hello_len = binproto_negotiate(session, rx_buffer_head(rx), rx_buffer_pending(rx));
+        if (hello_len == -1)
+        {
             return -1;
         }
-        *packet_buffer = new_buffer;
-        *packet_buffer_capacity = required_capacity;
+        if (hello_len <= 0)
+        {
+            return 0;
+        }
+        rx_buffer_consume(rx, hello_len, 0);
     }
-    return 0;
-}
-#if (USE_AESD_CHAR_DEVICE)
-static int Check_seekCmd(char * ptr_buff, int fd)
-{
-    int retval = EXIT_FAILURE;
-    if (strncmp(ptr_buff, AESD_SEEKTO_COMMAND, AESD_SEEKTO_PIVOT_LEN) == 0) 
+    for (;;)
     {
-        syslog(LOG_DEBUG, "[USER SPACE] Detected ICOTL COMMAND\n"); 
-        char *pos_of_valid_digit = strchr(ptr_buff, ':');
-        if (pos_of_valid_digit != NULL) 
+        size_t commands;
+        ssize_t consumed = binproto_process(session, handle, rx_buffer_head(rx), rx_buffer_pending(rx), &commands);
+        if (consumed == -1)
         {
-            /* Get the next value */
-            pos_of_valid_digit++;
-            
-            char *endptr;
-            uint32_t write_cmd = strtoul(pos_of_valid_digit, &endptr, 10);
-            if (*endptr == ',') 
-            {
-                pos_of_valid_digit = endptr + 1; 
-                uint32_t offset = strtoul(pos_of_valid_digit, &endptr, 10);
-                syslog(LOG_DEBUG, "[USER SPACE] Detected ICOTL COMMAND offsets (%d,%d)\n", write_cmd, offset); 
-                struct aesd_seekto seek_to = {write_cmd, offset};
-                int ioctl_result = ioctl(fd, AESDCHAR_IOCSEEKTO, &seek_to);
-                if (ioctl_result < 0) 
-                {
-                    syslog(LOG_ERR, "[USER SPACE] Error in calling the ioctl\n"); 
-                    retval = EXIT_FAILURE;
-                }
-                retval = EXIT_SUCCESS;
-            }
+            return -1;
+        }
+        /* One send for every command of the receive, or for every high water mark of replies */
+        int flushed = binproto_flush(session, accepted_fd);
+        if (flushed != 1)
+        {
+            /* 0 is a send timeout, queued replies can't be dropped without breaking the framing */
+            return (flushed == 0) ? slow_consumer_stalled(accepted_fd, 0) : -1;
         }
+        if (consumed == 0)
+        {
+            return 0;
+        }
+        rx_buffer_consume(rx, consumed, commands);
     }
-    return retval;
 }
-#endif
 
-#if USE_AESD_CHAR_DEVICE
-int open_device_file(char* ptr_file_path)
-{
-    return (open(ptr_file_path, O_RDWR | O_APPEND, S_IRWXU | S_IRWXG | S_IRWXO));
-}
-int close_device_file(int fd)
-{
-    return (close(fd));
-}
-#endif
 /**
  * @brief client thread handler
  *        Main functionality is to receive and send data from the socket descriptor
@@ -320,84 +1187,154 @@ static void *handle_client(void *arg)
     client_thread_t *thread_node =  (client_thread_t *) arg;
     int accepted_fd = thread_node->client_fd;
 
-    char buf[MAXDATASIZE];
-    char *packet_buffer = NULL;
-    size_t consumed_buffer_size = 0;
-    size_t packet_buffer_capacity = MAXDATASIZE;
+    rx_buffer_t rx = { 0 };
+    size_t scanned_buffer_size = 0;
+    uint64_t first_byte_ns = 0;
+    uring_io_t ring;
+    int use_ring = 0;
+    binproto_session_t session = { 0 };
+    /* One handle for the whole connection, every packet repositions it with its
+       append or seek command, so threads never share a device position */
+    storage_handle_t store = { .fd = UNINIT_VALUE };
+    storage_stage_t stage = { .fd = UNINIT_VALUE };
+    zerocopy_t zc;
+    zerocopy_init(&zc, accepted_fd);
+    if (storage_open(&store) == -1)
+    {
+        goto client_exit;
+    }
     
-    packet_buffer = malloc(MAXDATASIZE);
-    if (packet_buffer == NULL) 
+    if (server_config.use_uring)
     {
-        syslog(LOG_ERR, "malloc failed\n");
-        close(accepted_fd);
-        return NULL;
+        /* A device is read from the position its last packet left, which the
+           registered file path can't follow, only the socket is registered then */
+        use_ring = (uring_io_init(&ring, accepted_fd, data_packet_fd) == 0);
     }
+    /* Steered once, by the first packet, a client thread migrating on every receive
+       would lose the cache it is meant to keep */
+    int follow_cpu = server_config.low_latency;
     ssize_t recv_octets;
-    while ((recv_octets = recv(accepted_fd, buf, MAXDATASIZE - 1, 0)) > 0) 
+    /* Receive straight into the free tail of the pooled buffer */
+    while (rx_buffer_reserve(&rx, RX_BUFFER_MIN_FREE) == 0 &&
+           (recv_octets = recv(accepted_fd, rx.data + rx.len, rx.cap - rx.len - 1, 0)) > 0) 
     {
-        syslog(LOG_INFO, "Inside the receive function\n");
-        buf[recv_octets] = '\0';
+        aesd_log(LOG_DEBUG, "Inside the receive function\n");
+        uint64_t recv_ns = metrics_now();
+        if (rx_buffer_pending(&rx) == 0 && stage.len == 0)
+        {
+            first_byte_ns = recv_ns;
+        }
+        metrics_add(METRIC_BYTES_IN, recv_octets);
+        rx.len += recv_octets;
+        rx.data[rx.len] = '\0';
+        if (follow_cpu)
+        {
+            follow_incoming_cpu(accepted_fd);
+            follow_cpu = 0;
+        }
 
-        if ((check_and_resize_buffer(&packet_buffer, &packet_buffer_capacity, consumed_buffer_size, recv_octets)) == -1) 
+        if (session.mode != BINPROTO_MODE_TEXT)
         {
-            close(accepted_fd);
-            return NULL;
+            if (serve_binary(accepted_fd, &session, &store, &rx) == -1)
+            {
+                goto client_exit;
+            }
+            if (session.mode != BINPROTO_MODE_TEXT)
+            {
+                continue;
+            }
         }
-        syslog(LOG_INFO, "MEMCOPY\n");
-        memcpy(packet_buffer + consumed_buffer_size, buf, recv_octets);
-        consumed_buffer_size += recv_octets;
 
-        char *newline_pos = memchr(packet_buffer, '\n', consumed_buffer_size);
-        if (newline_pos != NULL) 
+        /* Only the newly received bytes can hold a newline */
+        size_t frame_len = 0;
+        size_t packets = framing_scan(rx_buffer_head(&rx) + scanned_buffer_size, rx_buffer_pending(&rx) - scanned_buffer_size, &frame_len);
+        if (packets > 0) 
         {
-#if USE_AESD_CHAR_DEVICE
-            /* open file */
-            data_packet_fd = open_device_file(FILE_PATH);
-            if (Check_seekCmd(packet_buffer, data_packet_fd) != EXIT_SUCCESS)
-#endif
+            frame_len += scanned_buffer_size;
+            AESD_PROBE3(packet_framed, accepted_fd, packets, frame_len);
+            if (process_frame(accepted_fd, rx_buffer_head(&rx), frame_len, packets, use_ring ? &ring : NULL,
+                              &store, &stage, &zc, first_byte_ns, recv_ns) == -1)
             {
-                pthread_mutex_lock(&file_mutex);
-                ssize_t num_written_octets = write(data_packet_fd, packet_buffer, newline_pos - packet_buffer + 1);
-                pthread_mutex_unlock(&file_mutex);
-                
-                if (num_written_octets == -1) 
-                {
-                    syslog(LOG_ERR, "Error Writing in the file\n"); 
-                    free(packet_buffer);
-                    close(accepted_fd);
-                    return NULL;
-                }
-                lseek(data_packet_fd, 0, SEEK_SET);
+                goto client_exit;
             }
-            /* Read Back everything in the device */
-            char file_buf[MAXDATASIZE];
-            ssize_t read_octets;
-            while ((read_octets = read(data_packet_fd, file_buf, MAXDATASIZE - 1)) > 0) 
+            /* The partial packet stays where it is for the next receive */
+            rx_buffer_consume(&rx, frame_len, packets);
+            /* The partial packet started in this receive */
+            first_byte_ns = recv_ns;
+        }
+        scanned_buffer_size = rx_buffer_pending(&rx);
+        if (server_config.packet_buffer_limit > 0 && scanned_buffer_size >= server_config.packet_buffer_limit)
+        {
+            /* No newline in sight, stream the packet out instead of growing the buffer */
+            if (storage_stage_write(&stage, rx_buffer_head(&rx), scanned_buffer_size) == -1)
             {
-                file_buf[read_octets] = '\0';
-                send(accepted_fd, file_buf, read_octets, 0);
+                goto client_exit;
             }
-            consumed_buffer_size = 0;
-#if USE_AESD_CHAR_DEVICE
-            /* open file */
-            close_device_file(data_packet_fd);
-#endif
+            rx_buffer_consume(&rx, scanned_buffer_size, 0);
+            scanned_buffer_size = 0;
         }
     }
     
-    free(packet_buffer);
-    syslog(LOG_INFO, "Closed connection from client\n");
-    close(accepted_fd);
-    thread_node->complete = 1;
+client_exit:
+    if (use_ring)
+    {
+        uring_io_exit(&ring);
+    }
+    storage_stage_discard(&stage);
+    storage_close(&store);
+    zerocopy_release(&zc, ZEROCOPY_DRAIN_MS);
+    binproto_session_release(&session);
+    rx_buffer_release(&rx);
+    aesd_log(LOG_INFO, "Closed connection from client\n");
+    metrics_add(METRIC_CLOSED, 1);
+    /* Closes the socket, the reaper joins and frees this thread */
+    client_registry_complete(thread_node);
     return NULL;
 }
+/**
+ * @brief Create and bind one listening socket
+ * 
+ * @param res         [IN]  address to bind
+ * @param reuse_port  [IN]  join the SO_REUSEPORT group of the address
+ * 
+ * @return socket descriptor, -1 on failure
+ * 
+ */
+static int open_listener(const struct addrinfo *res, int reuse_port)
+{
+    int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (fd == -1)
+    {
+        return -1;
+    }
+    int yes = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
+    if (reuse_port && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    if (bind(fd, res->ai_addr, res->ai_addrlen) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
 /**
  * @brief Init server functionality till listen
+ *        With several acceptors every one gets its own SO_REUSEPORT socket bound to the
+ *        same address, the kernel spreads the incoming connections over them
+ * 
+ * @param port        [IN]  port to listen on
+ * @param listeners   [IN]  number of listening sockets
  * 
  */
-static int server_init(const char *port) 
+static int server_init(const char *port, unsigned int listeners) 
 {
     struct addrinfo hints, *servinfo, *res;
+    int retval = -1;
     memset(&hints, 0, sizeof hints);
     hints.ai_family = AF_UNSPEC;
     hints.ai_socktype = SOCK_STREAM;
@@ -405,154 +1342,204 @@ static int server_init(const char *port)
 
     if (getaddrinfo(NULL, port, &hints, &servinfo) != 0) 
     {
-        syslog(LOG_ERR, "getaddrinfo failed");
+        aesd_log(LOG_ERR, "getaddrinfo failed");
         return -1;
     }
 
     for (res = servinfo; res != NULL; res = res->ai_next) 
     {
-        server_socket_fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-        if (server_socket_fd == -1)
-            continue;
-
-        int yes = 1;
-        setsockopt(server_socket_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
-
-        if (bind(server_socket_fd, res->ai_addr, res->ai_addrlen) == 0)
+        if ((listen_fds[0] = open_listener(res, listeners > 1)) != -1)
             break;
-
-        close(server_socket_fd);
     }
-    freeaddrinfo(servinfo);
-
     if (res == NULL) {
-        syslog(LOG_ERR, "Failed to bind");
-        return -1;
+        aesd_log(LOG_ERR, "Failed to bind");
+        goto func_exit;
     }
-    if (listen(server_socket_fd, BACKLOG) == -1) {
-        syslog(LOG_ERR, "Listen failed");
-        return -1;
+    num_listeners = 1;
+    for (; num_listeners < listeners; num_listeners++)
+    {
+        if ((listen_fds[num_listeners] = open_listener(res, 1)) == -1)
+        {
+            aesd_log(LOG_ERR, "Can't open SO_REUSEPORT listener %u: %s\n", num_listeners, strerror(errno));
+            goto func_exit;
+        }
     }
-    return 0;
+    for (unsigned int i = 0; i < num_listeners; i++)
+    {
+        /* Listener i is served by the thread pinned to the i-th CPU, the SO_REUSEPORT
+           group hands it the connections whose packets arrive on that CPU */
+        int cpu = (server_config.low_latency && num_listeners > 1) ? pin_set_cpu(i) : -1;
+        if (cpu != -1 && setsockopt(listen_fds[i], SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof cpu) == -1)
+        {
+            aesd_log(LOG_DEBUG, "Can't steer listener %u to CPU %d: %s\n", i, cpu, strerror(errno));
+        }
+        if (listen(listen_fds[i], BACKLOG) == -1) {
+            aesd_log(LOG_ERR, "Listen failed");
+            goto func_exit;
+        }
+    }
+    retval = 0;
+
+func_exit:
+    freeaddrinfo(servinfo);
+    return retval;
 }
 
 /**
- * @brief Server main thread
+ * @brief Accept loop of one listener, every client gets its own thread
+ *        Threads inherit the CPU affinity of their creator, so the clients of a
+ *        pinned acceptor are handled on its CPU
+ * 
+ * @param arg     [IN]  index of the listener in listen_fds
  * 
  */
-static void run_server(const char *port, const char *file_path) 
+static void *accept_clients(void *arg)
 {
-#if (!QUEUE_BSD_LINKED)
-    client_thread_t* client;
-#endif
-#if (!USE_AESD_CHAR_DEVICE)
-    data_packet_fd = open(file_path, O_CREAT | O_RDWR | O_APPEND, S_IRWXU | S_IRWXG | S_IRWXO);
-    if (data_packet_fd == -1) 
-    {
-        syslog(LOG_ERR, "Error opening/creating the file\n");
-        exit(EXIT_FAILURE);
-    }
-#endif
-
-    if (server_init(port) == -1)
-    {
-        exit(EXIT_FAILURE);
-    }
-    syslog(LOG_INFO, "Server waiting for connections...");
-#if (QUEUE_BSD_LINKED)
-    TAILQ_INIT(&thread_list);
-#else
-    thread_list = NULL;
-#endif
+    int listen_fd = listen_fds[(uintptr_t) arg];
 
     while (!shutdown_requested) {
         char s[INET6_ADDRSTRLEN];
         struct sockaddr_storage client_addr;
         socklen_t sin_size = sizeof client_addr;
-        int client_fd = accept(server_socket_fd, (struct sockaddr *)&client_addr, &sin_size);
+        int client_fd = accept(listen_fd, (struct sockaddr *)&client_addr, &sin_size);
         if (client_fd == -1)
         {
             continue;
         }
+        AESD_PROBE1(accept, client_fd);
+        configure_client_socket(client_fd, 1);
         inet_ntop(client_addr.ss_family, get_in_addr((struct sockaddr *)&client_addr), s, sizeof s);
-        syslog(LOG_INFO, "Accepted connection from %s\n", s);
+        aesd_log(LOG_INFO, "Accepted connection from %s\n", s);
 
-        client_thread_t *new_client = malloc(sizeof(client_thread_t));
+        // register the node before the thread can complete it
+        client_thread_t *new_client = client_registry_add(client_fd);
         if (!new_client) 
         {
-            syslog(LOG_ERR, "Can't allocate memory for a thread\n");
+            aesd_log(LOG_ERR, "Can't allocate memory for a thread\n");
             close(client_fd);
             continue;
         }
-        // initialize the node 
-        new_client->client_fd = client_fd;
-        new_client->complete = 0;
-        new_client->nxt_node = NULL;
-        pthread_create(&new_client->thread_id, NULL, handle_client, new_client);
-        pthread_mutex_lock(&thread_list_mutex);
-#if (QUEUE_BSD_LINKED)
-        TAILQ_INSERT_TAIL(&thread_list, new_client, entries);
-#else
-        insert_at_end(&thread_list, new_client);
-#endif
-        pthread_mutex_unlock(&thread_list_mutex);
-        pthread_mutex_lock(&thread_list_mutex);
-#if (QUEUE_BSD_LINKED)
-        client_thread_t *client, *tmp;
-        TAILQ_FOREACH_SAFE(client, &thread_list, entries, tmp) 
-#else
-        client      = thread_list; 
-        while (client != NULL)
-#endif
-        {
-            if (client->complete) 
-            {
-                pthread_join(client->thread_id, NULL);
-#if (QUEUE_BSD_LINKED)
-                TAILQ_REMOVE(&thread_list, client, entries);
-                free(client);
-            }
-#else
-                client = detect_and_rmv_node(&thread_list, client);
+        /* Counted before the thread can count its close */
+        metrics_add(METRIC_ACCEPTED, 1);
+        if (pthread_create(&new_client->thread_id, NULL, handle_client, new_client) != 0)
+        {
+            aesd_log(LOG_ERR, "Can't create a client thread\n");
+            client_registry_remove(new_client);
+            close(client_fd);
+            metrics_add(METRIC_CLOSED, 1);
+        }
+    }
+    return NULL;
+}
 
-            }
-            else
-            {
-                client = client->nxt_node;
-            }
-#endif
-        }
-        pthread_mutex_unlock(&thread_list_mutex);
-    }
-    /* Clean all nodes in the linked list */
-    pthread_mutex_lock(&thread_list_mutex);
-#if (QUEUE_BSD_LINKED)
-    client_thread_t *client, *tmp;
-    TAILQ_FOREACH_SAFE(client, &thread_list, entries, tmp) 
-#else 
-    client      = thread_list; 
-    while (client != NULL)
-#endif
-    {
-        pthread_join(client->thread_id, NULL);
-#if (QUEUE_BSD_LINKED)
-        TAILQ_REMOVE(&thread_list, client, entries);
-        free(client);
-#else
-        
-        client = detect_and_rmv_node(&thread_list, client);
-#endif
-    }
-    pthread_mutex_unlock(&thread_list_mutex);
-
-    close(server_socket_fd);
-#if    (!USE_AESD_CHAR_DEVICE)
-    close(data_packet_fd);
-#endif  //(!USE_AESD_CHAR_DEVICE)
-
-#if (!USE_AESD_CHAR_DEVICE)
-    unlink(file_path);
-#endif /*(!USE_AESD_CHAR_DEVICE)*/
+/**
+ * @brief Server main thread
+ * 
+ */
+static void run_server(const char *port, const char *file_path) 
+{
+    if (storage->start(file_path) == -1)
+    {
+        aesd_log(LOG_ERR, "Can't start the %s storage backend\n", storage->name);
+        exit(EXIT_FAILURE);
+    }
+    if (server_config.use_log && (append_log_init() == -1 || append_log_load(data_packet_fd) == -1))
+    {
+        aesd_log(LOG_ERR, "Can't mirror the data file, reading back from the file\n");
+        append_log_destroy();
+        server_config.use_log = 0;
+    }
+    if (server_config.group_commit &&
+        group_commit_start(server_config.commit_batch, server_config.commit_latency_us) == -1)
+    {
+        aesd_log(LOG_ERR, "Can't start the group commit writer, appending from the clients\n");
+        server_config.group_commit = 0;
+    }
+    /* Started once the append path is complete, it goes through append_packets() like a packet */
+    if (timestamp_start(server_config.timestamp_interval_ms, append_packets) == -1)
+    {
+        aesd_log(LOG_ERR, "Running without timestamps\n");
+    }
+    if (server_config.readback_cache_size > 0 && readback_cache_init(server_config.readback_cache_size) == -1)
+    {
+        server_config.readback_cache_size = 0;
+    }
+
+    if (server_init(port, server_config.acceptors) == -1)
+    {
+        exit(EXIT_FAILURE);
+    }
+    if (server_config.stats_endpoint != NULL && metrics_start(server_config.stats_endpoint) == -1)
+    {
+        aesd_log(LOG_ERR, "Running without the stats listener\n");
+    }
+    aesd_log(LOG_INFO, "Server waiting for connections...");
+    if (server_config.event_loops > 0)
+    {
+        if (event_loop_run(listen_fds, num_listeners, server_config.event_loops, server_config.max_connections,
+                           server_config.pool_workers) == -1)
+        {
+            aesd_log(LOG_ERR, "Event loops failed\n");
+        }
+        goto server_exit;
+    }
+    if (client_registry_init() == -1)
+    {
+        goto server_exit;
+    }
+
+    /* The main thread serves the first listener, one more thread per extra listener */
+    pthread_t acceptor_ids[MAX_ACCEPTORS];
+    unsigned int acceptors = 1;
+    if (server_config.pin_cpus)
+    {
+        pin_thread_to_cpu(pthread_self(), 0);
+    }
+    for (; acceptors < num_listeners; acceptors++)
+    {
+        if (pthread_create(&acceptor_ids[acceptors], NULL, accept_clients, (void *) (uintptr_t) acceptors) != 0)
+        {
+            aesd_log(LOG_ERR, "Can't create acceptor thread %u\n", acceptors);
+            break;
+        }
+        if (server_config.pin_cpus)
+        {
+            pin_thread_to_cpu(acceptor_ids[acceptors], acceptors);
+        }
+    }
+    /* Listeners without an acceptor would strand the connections hashed to them */
+    while (num_listeners > acceptors)
+    {
+        num_listeners--;
+        close(listen_fds[num_listeners]);
+        listen_fds[num_listeners] = UNINIT_VALUE;
+    }
+    accept_clients((void *) (uintptr_t) 0);
+    for (unsigned int i = 1; i < acceptors; i++)
+    {
+        pthread_join(acceptor_ids[i], NULL);
+    }
+    /* Wake the clients blocked in recv() and reap every thread */
+    client_registry_shutdown();
+
+server_exit:
+    metrics_stop();
+    for (unsigned int i = 0; i < num_listeners; i++)
+    {
+        close(listen_fds[i]);
+    }
+    rx_pool_destroy();
+    timestamp_stop();
+    group_commit_stop();
+    if (server_config.readback_cache_size > 0)
+    {
+        readback_cache_destroy();
+    }
+    storage->stop();
+    if (server_config.use_log)
+    {
+        append_log_destroy();
+    }
 }
 
 
@@ -561,23 +1548,24 @@ int main(int argc, char** argv)
     // Set up signal handling
     signal(SIGTERM, special_signal_handler);
     signal(SIGINT, special_signal_handler);
+    // sendfile() can't take MSG_NOSIGNAL, report a vanished client as EPIPE instead
+    signal(SIGPIPE, SIG_IGN);
 
     // Open syslog
     openlog("aesdsocket", LOG_PID, LOG_USER);
 
-    // Handle daemon option
-    if (check_and_handle_daemon_option(argc, argv) != 0) 
+    // Handle command line options
+    if (check_and_handle_options(argc, argv) != 0) 
     {
         exit(EXIT_FAILURE);
     }
-#if  (!USE_AESD_CHAR_DEVICE)
-    // Start the timestamp logging 
-    start_timer();
-#endif /*(!USE_AESD_CHAR_DEVICE)*/
+    // Take syslog() off the packet path, after daemon() since the drainer is a thread
+    log_ring_start();
     // Run the server
-    run_server(PORT, FILE_PATH);
+    run_server(PORT, storage->default_path);
 
     // Clean up
+    log_ring_stop();
     closelog();
     return 0;
 }
\ No newline at end of file
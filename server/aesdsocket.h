@@ -0,0 +1,103 @@
+/**
+ * @file aesdsocket.h
+ * @brief Definitions shared between the aesdsocket server modules
+ *
+ */
+#ifndef AESDSOCKET_H
+#define AESDSOCKET_H
+/*--------------------------------- Public includes ---------------------------------*/
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+/*--------------------------------- Public definitions ---------------------------------  */
+#define PORT                                    "9000"
+#define BACKLOG                                 10
+#define MAXDATASIZE                             1024
+#define UNINIT_VALUE                            -1
+
+/* Only picks the storage backend used without -t, see storage.h */
+#ifndef USE_AESD_CHAR_DEVICE
+#define USE_AESD_CHAR_DEVICE                    1
+#endif /*USE_AESD_CHAR_DEVICE*/
+
+#define DATA_FILE_PATH                          "/var/tmp/aesdsocketdata"
+#define DEVICE_PATH                             "/dev/aesdchar"
+/* Where packets longer than -B are staged until their newline */
+#define STAGE_DIR                               "/var/tmp"
+#define AESD_SEEKTO_COMMAND                     "AESDCHAR_IOCSEEKTO:"
+#define AESD_SEEKTO_PIVOT_LEN                   19
+
+#define DEFAULT_MAX_CONNECTIONS                 10240
+#define MAX_ACCEPTORS                           64
+/* Segment index entries are 32 bit positions */
+#define MAX_SEGMENT_KB                          (1024 * 1024)
+#define SENDFILE_CHUNK                          (1024 * 1024)
+#define DEFAULT_COMMIT_BATCH                    64
+#define DEFAULT_COMMIT_LATENCY_US               0
+#define DEFAULT_TX_HIGH_WATER                   (256 * 1024)
+#define DEFAULT_STALL_TIMEOUT_MS                5000
+#define DEFAULT_BUSY_POLL_US                    50
+#define DEFAULT_PACKET_BUFFER_LIMIT             (1024 * 1024)
+
+/* readback_sendfile() results */
+#define READBACK_DONE                           0
+#define READBACK_WOULD_BLOCK                    1
+#define READBACK_UNSUPPORTED                    2
+
+/**
+ * @brief What happens to a client whose socket accepted nothing for the stall timeout
+ */
+typedef enum {
+    SLOW_CONSUMER_PAUSE = 0,        /* keep waiting, nothing more is read from it meanwhile */
+    SLOW_CONSUMER_DROP,             /* abandon the stalled readback, binary replies can't be dropped so
+                                       binary connections are closed */
+    SLOW_CONSUMER_DISCONNECT,       /* close the connection */
+} slow_consumer_policy_t;
+
+/**
+ * @brief Runtime configuration filled from the command line
+ */
+typedef struct server_config {
+    int daemonize;                  /* -d: detach from the terminal */
+    unsigned int event_loops;       /* -e: number of epoll loops, 0 keeps thread-per-connection */
+    unsigned int max_connections;   /* -c: connection slots shared by the event loops */
+    unsigned int pool_workers;      /* -p: workers running complete packet jobs, 0 disables the pool */
+    int use_uring;                  /* -u: io_uring append/readback in the client threads */
+    int use_log;                    /* -m: read back from the in-memory append log (file backend) */
+    int group_commit;               /* -g: append through the group commit writer (file backend) */
+    unsigned int commit_batch;      /* -b: packets per group commit writev() */
+    unsigned int commit_latency_us; /* -l: time the writer waits for a batch to fill */
+    const char *stats_endpoint;     /* -s: port or UNIX socket path of the metrics listener */
+    unsigned int acceptors;         /* -a: SO_REUSEPORT listeners, 1 keeps a single listener */
+    int pin_cpus;                   /* -A: pin the acceptors and the event loops to CPUs */
+    unsigned int timestamp_interval_ms; /* -i: period of the data file timestamps, 0 disables them */
+    unsigned int tx_high_water;     /* -q: bytes queued for a client before it stops being read */
+    unsigned int tx_low_water;      /* -q: queued bytes below which reading resumes, 0 waits for a full drain */
+    int tx_watermarks_set;          /* -q given: the socket buffers of the clients follow the watermarks */
+    slow_consumer_policy_t slow_policy; /* -S: policy for clients that stop reading */
+    unsigned int stall_timeout_ms;  /* -S: time without send progress that makes a client slow */
+    unsigned int segment_size;      /* -r: bytes per data segment, 0 keeps a single data file */
+    unsigned int keep_segments;     /* -r: segments retained, 0 keeps them all */
+    unsigned int keep_seconds;      /* -r: age after the last append a segment is retired at, 0 never */
+    unsigned int readback_cache_size; /* -C: bytes of stored data the shared readback snapshot holds, 0 disables it */
+    int low_latency;                /* -L: steer connections to the CPU their packets arrive on */
+    unsigned int busy_poll_us;      /* -L: SO_BUSY_POLL of the client sockets, 0 leaves it off */
+    unsigned int packet_buffer_limit; /* -B: bytes of a packet buffered before it is staged, 0 never stages */
+    unsigned int zerocopy_min;      /* -Z: readbacks from memory at least this long use MSG_ZEROCOPY, 0 never */
+} server_config_t;
+/*---------------------------------- Public Variables ----------------------------------  */
+extern server_config_t server_config;
+extern int data_packet_fd;
+extern volatile sig_atomic_t shutdown_requested;
+extern pthread_mutex_t file_mutex;
+/*--------------------------------- Public Functions ---------------------------------  */
+struct sockaddr;
+void *get_in_addr(struct sockaddr *sa);
+int readback_sendfile(int sock_fd, int file_fd, off_t *offset, off_t end);
+int pin_thread_to_cpu(pthread_t thread, unsigned int index);
+void configure_client_socket(int fd, int blocking);
+int slow_consumer_stalled(int client_fd, int droppable);
+struct storage_handle;
+int Check_seekCmd(char * ptr_buff, struct storage_handle *handle);
+
+#endif /*AESDSOCKET_H*/
@@ -0,0 +1,332 @@
+/**
+ * @file append-log.c
+ * @brief In-process append-only mirror of the data file used for readbacks
+ *
+ * Publication protocol: the appender copies the bytes and links any new
+ * segment first, then stores the new total length with release semantics.
+ * Readers load the length with acquire semantics under log_lock, together with
+ * a reference on the head, and never look past that length.
+ */
+/*--------------------------------- Private includes ---------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <syslog.h>
+#include <pthread.h>
+#include "aesdsocket.h"
+#include "append-log.h"
+#include "zerocopy.h"
+#include "metrics.h"
+#include "log-ring.h"
+/*--------------------------------- Private definitions ---------------------------------  */
+#define APPEND_LOG_IOV_MAX                      64
+
+typedef struct log_segment {
+    atomic_uint refs;
+    size_t used;                    /* appender side fill level */
+    struct log_segment *next;
+    char data[APPEND_LOG_SEGMENT_SIZE];
+} log_segment_t;
+/*---------------------------------- Private Variables ----------------------------------  */
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static log_segment_t *log_head;
+static log_segment_t *log_tail;
+static atomic_size_t log_published;
+static int log_failed;
+/*--------------------------------- Private Functions ---------------------------------  */
+static log_segment_t *segment_alloc(void)
+{
+    log_segment_t *segment = malloc(sizeof(log_segment_t));
+    if (segment != NULL)
+    {
+        atomic_init(&segment->refs, 1);
+        segment->used = 0;
+        segment->next = NULL;
+    }
+    return segment;
+}
+
+/**
+ * @brief Drop a reference, freeing the segment and releasing its successor when it was the last one
+ */
+static void segment_put(log_segment_t *segment)
+{
+    while (segment != NULL && atomic_fetch_sub(&segment->refs, 1) == 1)
+    {
+        log_segment_t *next = segment->next;
+        free(segment);
+        segment = next;
+    }
+}
+
+/* Reference of a zerocopy send on the chain it reads from */
+static void segment_get_ref(void *segment)
+{
+    atomic_fetch_add(&((log_segment_t *) segment)->refs, 1);
+}
+
+static void segment_put_ref(void *segment)
+{
+    segment_put((log_segment_t *) segment);
+}
+/*--------------------------------- Public Functions ---------------------------------  */
+int append_log_init(void)
+{
+    log_head = log_tail = segment_alloc();
+    if (log_head == NULL)
+    {
+        aesd_log(LOG_ERR, "Can't allocate the append log\n");
+        return -1;
+    }
+    atomic_store(&log_published, 0);
+    log_failed = 0;
+    return 0;
+}
+
+int append_log_load(int fd)
+{
+    char buf[APPEND_LOG_SEGMENT_SIZE];
+    off_t offset = 0;
+    ssize_t read_octets;
+
+    while ((read_octets = pread(fd, buf, sizeof(buf), offset)) > 0)
+    {
+        if (append_log_append(buf, read_octets) == -1)
+        {
+            return -1;
+        }
+        offset += read_octets;
+    }
+    return (read_octets == -1) ? -1 : 0;
+}
+
+void append_log_destroy(void)
+{
+    pthread_mutex_lock(&log_lock);
+    log_segment_t *head = log_head;
+    log_head = log_tail = NULL;
+    atomic_store(&log_published, 0);
+    pthread_mutex_unlock(&log_lock);
+    segment_put(head);
+}
+
+int append_log_append(const char *buf, size_t len)
+{
+    if (log_failed || log_tail == NULL)
+    {
+        return -1;
+    }
+    while (len > 0)
+    {
+        if (log_tail->used == APPEND_LOG_SEGMENT_SIZE)
+        {
+            log_segment_t *segment = segment_alloc();
+            if (segment == NULL)
+            {
+                aesd_log(LOG_ERR, "Append log out of memory, reading back from the file\n");
+                log_failed = 1;
+                return -1;
+            }
+            /* The reference from the log moves to the predecessor's link */
+            log_tail->next = segment;
+            log_tail = segment;
+        }
+        size_t chunk = APPEND_LOG_SEGMENT_SIZE - log_tail->used;
+        if (chunk > len)
+        {
+            chunk = len;
+        }
+        memcpy(log_tail->data + log_tail->used, buf, chunk);
+        log_tail->used += chunk;
+        buf += chunk;
+        len -= chunk;
+        atomic_fetch_add_explicit(&log_published, chunk, memory_order_release);
+    }
+    return 0;
+}
+
+void append_log_batch_init(append_log_batch_t *batch, size_t offset)
+{
+    memset(batch, 0, sizeof(*batch));
+    batch->lead = offset % APPEND_LOG_SEGMENT_SIZE;
+}
+
+int append_log_batch_add(append_log_batch_t *batch, const char *buf, size_t len)
+{
+    while (len > 0 && !batch->failed)
+    {
+        if (batch->last == NULL || batch->last->used == APPEND_LOG_SEGMENT_SIZE)
+        {
+            log_segment_t *segment = segment_alloc();
+            if (segment == NULL)
+            {
+                batch->failed = 1;
+                break;
+            }
+            if (batch->last == NULL)
+            {
+                /* Laid out like the log tail it continues */
+                segment->used = batch->lead;
+                batch->first = segment;
+            }
+            else
+            {
+                batch->last->next = segment;
+            }
+            batch->last = segment;
+        }
+        size_t chunk = APPEND_LOG_SEGMENT_SIZE - batch->last->used;
+        if (chunk > len)
+        {
+            chunk = len;
+        }
+        memcpy(batch->last->data + batch->last->used, buf, chunk);
+        batch->last->used += chunk;
+        batch->len += chunk;
+        buf += chunk;
+        len -= chunk;
+    }
+    return batch->failed ? -1 : 0;
+}
+
+int append_log_batch_publish(append_log_batch_t *batch)
+{
+    int retval = 0;
+
+    if (log_failed || log_tail == NULL)
+    {
+        retval = -1;
+    }
+    else if (batch->failed)
+    {
+        aesd_log(LOG_ERR, "Append log out of memory, reading back from the file\n");
+        log_failed = 1;
+        retval = -1;
+    }
+    else if (batch->len > 0 && log_tail->used == APPEND_LOG_SEGMENT_SIZE && batch->lead == 0)
+    {
+        /* The batch starts a segment, its references move to the links */
+        log_tail->next = batch->first;
+        log_tail = batch->last;
+        batch->first = batch->last = NULL;
+        atomic_fetch_add_explicit(&log_published, batch->len, memory_order_release);
+    }
+    else if (batch->len > 0 && log_tail->used == batch->lead)
+    {
+        /* Complete the tail with the head of the batch and link the rest */
+        log_segment_t *head = batch->first;
+        memcpy(log_tail->data + batch->lead, head->data + batch->lead, head->used - batch->lead);
+        log_tail->used = head->used;
+        if (head->next != NULL)
+        {
+            log_tail->next = head->next;
+            log_tail = batch->last;
+            head->next = NULL;
+        }
+        batch->first = batch->last = NULL;
+        segment_put(head);
+        atomic_fetch_add_explicit(&log_published, batch->len, memory_order_release);
+    }
+    else
+    {
+        /* Laid out for another tail, copy it like separate appends */
+        size_t offset = batch->lead;
+        for (log_segment_t *segment = batch->first; segment != NULL && retval == 0; segment = segment->next)
+        {
+            retval = append_log_append(segment->data + offset, segment->used - offset);
+            offset = 0;
+        }
+    }
+    append_log_batch_discard(batch);
+    return retval;
+}
+
+void append_log_batch_discard(append_log_batch_t *batch)
+{
+    segment_put(batch->first);
+    batch->first = batch->last = NULL;
+    batch->len = 0;
+}
+
+int append_log_snapshot(append_log_cursor_t *cursor)
+{
+    int retval = -1;
+
+    memset(cursor, 0, sizeof(*cursor));
+    pthread_mutex_lock(&log_lock);
+    if (log_head != NULL && !log_failed)
+    {
+        atomic_fetch_add(&log_head->refs, 1);
+        cursor->head = cursor->segment = log_head;
+        cursor->remaining = atomic_load_explicit(&log_published, memory_order_acquire);
+        retval = 0;
+    }
+    pthread_mutex_unlock(&log_lock);
+    return retval;
+}
+
+int append_log_send(int sock_fd, append_log_cursor_t *cursor, zerocopy_t *zc)
+{
+    zerocopy_ref_t ref = { .get = segment_get_ref, .put = segment_put_ref, .owner = cursor->head };
+    zc = zerocopy_for(zc, cursor->remaining);
+
+    while (cursor->remaining > 0)
+    {
+        struct iovec iov[APPEND_LOG_IOV_MAX];
+        int iov_count = 0;
+        log_segment_t *segment = cursor->segment;
+        size_t offset = cursor->offset;
+        size_t left = cursor->remaining;
+
+        while (left > 0 && iov_count < APPEND_LOG_IOV_MAX)
+        {
+            size_t chunk = APPEND_LOG_SEGMENT_SIZE - offset;
+            if (chunk > left)
+            {
+                chunk = left;
+            }
+            iov[iov_count].iov_base = segment->data + offset;
+            iov[iov_count].iov_len = chunk;
+            iov_count++;
+            left -= chunk;
+            segment = segment->next;
+            offset = 0;
+        }
+
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = iov_count };
+        /* The head pins every segment after it until the kernel is done */
+        ssize_t sent_octets = (zc != NULL) ? zerocopy_sendmsg(zc, &msg, &ref) : sendmsg(sock_fd, &msg, MSG_NOSIGNAL);
+        if (sent_octets == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? READBACK_WOULD_BLOCK : -1;
+        }
+
+        metrics_add(METRIC_BYTES_OUT, sent_octets);
+        /* Advance the cursor over what the socket accepted */
+        cursor->remaining -= sent_octets;
+        size_t advance = cursor->offset + sent_octets;
+        while (advance >= APPEND_LOG_SEGMENT_SIZE && cursor->segment->next != NULL)
+        {
+            advance -= APPEND_LOG_SEGMENT_SIZE;
+            cursor->segment = cursor->segment->next;
+        }
+        cursor->offset = advance;
+    }
+    return READBACK_DONE;
+}
+
+void append_log_release(append_log_cursor_t *cursor)
+{
+    segment_put(cursor->head);
+    memset(cursor, 0, sizeof(*cursor));
+}
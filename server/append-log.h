@@ -0,0 +1,112 @@
+/**
+ * @file append-log.h
+ * @brief In-process append-only mirror of the data file used for readbacks
+ *
+ * The log is a chain of fixed size segments. Bytes below the published length
+ * never change, so any number of readers can send them with writev() while
+ * the single appender keeps filling the tail. A reader pins the chain by
+ * holding a reference on its first segment; every segment holds a reference on
+ * its successor, so dropping segments from the log never frees memory a
+ * reader is still sending.
+ */
+#ifndef APPEND_LOG_H
+#define APPEND_LOG_H
+
+#include <stddef.h>
+
+#define APPEND_LOG_SEGMENT_SIZE                 (64 * 1024)
+
+struct log_segment;
+struct zerocopy;
+
+/**
+ * @brief Position of a reader inside a snapshot of the log
+ */
+typedef struct append_log_cursor {
+    struct log_segment *head;       /* reference keeping the snapshot alive */
+    struct log_segment *segment;    /* segment holding the next byte to send */
+    size_t offset;                  /* offset of that byte inside segment */
+    size_t remaining;               /* bytes of the snapshot not sent yet */
+} append_log_cursor_t;
+
+/**
+ * @brief Bytes mirrored ahead of their publication, linked into the log in its turn
+ */
+typedef struct append_log_batch {
+    struct log_segment *first;
+    struct log_segment *last;
+    size_t lead;                    /* bytes of first left empty, where the log tail will be filled to */
+    size_t len;
+    int failed;                     /* memory ran out while copying */
+} append_log_batch_t;
+
+int append_log_init(void);
+
+/**
+ * @brief Mirror the current contents of the data file, used once at startup
+ */
+int append_log_load(int fd);
+
+void append_log_destroy(void);
+
+/**
+ * @brief Append and publish bytes, appends must be serialized by the caller
+ *        (the watermark publication of data-file.c) so the log keeps the order
+ *        of the data file
+ *
+ * @return 0 on success, -1 if memory ran out, the log is then unusable
+ */
+int append_log_append(const char *buf, size_t len);
+
+/**
+ * @brief Start a batch of bytes that will be published at log offset, the length of the
+ *        data published before them
+ */
+void append_log_batch_init(append_log_batch_t *batch, size_t offset);
+
+/**
+ * @brief Copy bytes into the batch, runs concurrently with the appends
+ *
+ * @return 0 on success, -1 if memory ran out, publishing the batch then stops the log
+ */
+int append_log_batch_add(append_log_batch_t *batch, const char *buf, size_t len);
+
+/**
+ * @brief append_log_append() of the whole batch, serialized the same way. Links its
+ *        segments into the log and only copies the bytes that complete the current
+ *        tail segment. The batch is empty afterwards
+ *
+ * @return 0 on success, -1 if the log is unusable
+ */
+int append_log_batch_publish(append_log_batch_t *batch);
+
+/**
+ * @brief Free a batch that won't be published, safe on an empty batch
+ */
+void append_log_batch_discard(append_log_batch_t *batch);
+
+/**
+ * @brief Pin everything published so far
+ *
+ * @return 0 on success, -1 if the log is unusable and the file must be read instead
+ */
+int append_log_snapshot(append_log_cursor_t *cursor);
+
+/**
+ * @brief Send the rest of a snapshot with writev style gathers
+ *
+ * @param zc        [IN]  zerocopy tracker of the connection, NULL copies the bytes. A rest
+ *                        of at least -Z is sent with MSG_ZEROCOPY and stays pinned until
+ *                        the kernel completes it
+ *
+ * @return READBACK_DONE when the snapshot is sent, READBACK_WOULD_BLOCK if a
+ *         non-blocking socket is full, -1 on error
+ */
+int append_log_send(int sock_fd, append_log_cursor_t *cursor, struct zerocopy *zc);
+
+/**
+ * @brief Drop the reference of a snapshot, safe on a released cursor
+ */
+void append_log_release(append_log_cursor_t *cursor);
+
+#endif /*APPEND_LOG_H*/
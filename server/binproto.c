@@ -0,0 +1,350 @@
+/**
+ * @file binproto.c
+ * @brief Length-prefixed binary command protocol, negotiated per connection
+ *
+ * Responses are built in the output buffer of the session and sent by the
+ * caller once the receive is exhausted or the -q high watermark is queued,
+ * whichever comes first, so a pipelined batch costs one send and the memory
+ * held by a connection stays bounded whatever the client queues.
+ */
+/*--------------------------------- Private includes ---------------------------------*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <endian.h>
+#include <sys/socket.h>
+#include "aesdsocket.h"
+#include "binproto.h"
+#include "storage.h"
+#include "metrics.h"
+#include "log-ring.h"
+/*--------------------------------- Private definitions ---------------------------------  */
+#define BINPROTO_OUT_MIN_SIZE                   4096
+
+typedef struct binproto_header {
+    uint8_t op;
+    uint32_t tag;
+    uint32_t len;
+} binproto_header_t;
+/*--------------------------------- Private Functions ---------------------------------  */
+static uint32_t get_be32(const char *p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof value);
+    return be32toh(value);
+}
+
+static uint64_t get_be64(const char *p)
+{
+    uint64_t value;
+    memcpy(&value, p, sizeof value);
+    return be64toh(value);
+}
+
+static void put_be32(char *p, uint32_t value)
+{
+    value = htobe32(value);
+    memcpy(p, &value, sizeof value);
+}
+
+static void put_be64(char *p, uint64_t value)
+{
+    value = htobe64(value);
+    memcpy(p, &value, sizeof value);
+}
+
+/**
+ * @brief Append len bytes to the output buffer
+ *
+ * @return pointer to the bytes to fill, NULL if memory ran out
+ */
+static char *out_append(binproto_session_t *session, size_t len)
+{
+    size_t needed = session->out_len + len;
+    if (needed > session->out_cap)
+    {
+        size_t cap = (session->out_cap > 0) ? session->out_cap : BINPROTO_OUT_MIN_SIZE;
+        while (cap < needed)
+        {
+            cap *= 2;
+        }
+        char *out = realloc(session->out, cap);
+        if (out == NULL)
+        {
+            aesd_log(LOG_ERR, "Can't grow the binary response buffer\n");
+            return NULL;
+        }
+        session->out = out;
+        session->out_cap = cap;
+    }
+    char *room = session->out + session->out_len;
+    session->out_len = needed;
+    return room;
+}
+
+/**
+ * @brief Queue a response header and make room for its payload, written by the caller
+ *        right after the header
+ *
+ * @return pointer to the payload, NULL if memory ran out
+ */
+static char *queue_response(binproto_session_t *session, const binproto_header_t *request,
+                            binproto_status_t status, uint32_t payload_len)
+{
+    char *header = out_append(session, BINPROTO_HEADER_LEN + payload_len);
+    if (header == NULL)
+    {
+        return NULL;
+    }
+    header[0] = (char) request->op;
+    header[1] = (char) status;
+    header[2] = header[3] = 0;
+    put_be32(header + 4, request->tag);
+    put_be32(header + 8, payload_len);
+    return header + BINPROTO_HEADER_LEN;
+}
+
+/**
+ * @brief Give back the end of the payload of the last queued response
+ */
+static void shrink_response(binproto_session_t *session, char *payload, uint32_t payload_len)
+{
+    put_be32(payload - BINPROTO_HEADER_LEN + 8, payload_len);
+    session->out_len = (payload - session->out) + payload_len;
+}
+
+static int execute_append(binproto_session_t *session, storage_handle_t *handle, const binproto_header_t *request,
+                          const char *payload)
+{
+    off_t end;
+
+    if (storage->append(handle, payload, request->len, &end) == -1)
+    {
+        return (queue_response(session, request, BINPROTO_STATUS_IO_ERROR, 0) == NULL) ? -1 : 0;
+    }
+    char *reply = queue_response(session, request, BINPROTO_STATUS_OK, sizeof(uint64_t));
+    if (reply == NULL)
+    {
+        return -1;
+    }
+    put_be64(reply, (end >= 0) ? (uint64_t) end : 0);
+    return 0;
+}
+
+static int execute_seekto(binproto_session_t *session, storage_handle_t *handle, const binproto_header_t *request,
+                          const char *payload)
+{
+    binproto_status_t status;
+
+    if (request->len != 2 * sizeof(uint32_t))
+    {
+        status = BINPROTO_STATUS_BAD_REQUEST;
+    }
+    else
+    {
+        int found = storage->seekto(handle, get_be32(payload), get_be32(payload + 4));
+        status = (found == 0) ? BINPROTO_STATUS_OK : (found == 1) ? BINPROTO_STATUS_OUT_OF_RANGE : BINPROTO_STATUS_IO_ERROR;
+    }
+    return (queue_response(session, request, status, 0) == NULL) ? -1 : 0;
+}
+
+static int execute_read(binproto_session_t *session, storage_handle_t *handle, const binproto_header_t *request,
+                        const char *payload)
+{
+    if (request->len != sizeof(uint64_t) + sizeof(uint32_t))
+    {
+        return (queue_response(session, request, BINPROTO_STATUS_BAD_REQUEST, 0) == NULL) ? -1 : 0;
+    }
+    uint64_t offset = get_be64(payload);
+    uint32_t length = get_be32(payload + 8);
+    if (length > BINPROTO_MAX_PAYLOAD)
+    {
+        length = BINPROTO_MAX_PAYLOAD;
+    }
+
+    /* Read straight behind the header, the length is trimmed to what was read */
+    char *reply = queue_response(session, request, BINPROTO_STATUS_OK, length);
+    if (reply == NULL)
+    {
+        return -1;
+    }
+    off_t from = (offset == BINPROTO_OFFSET_CURRENT) ? handle->position : (off_t) offset;
+    if (offset != BINPROTO_OFFSET_CURRENT && from < storage->first())
+    {
+        /* Retired by the segment retention */
+        shrink_response(session, reply, 0);
+        reply[-BINPROTO_HEADER_LEN + 1] = (char) BINPROTO_STATUS_OUT_OF_RANGE;
+        return 0;
+    }
+    /* A read stops at the end of a segment or an entry, keep going until the length or the end */
+    ssize_t read_octets = 0;
+    while (read_octets < (ssize_t) length)
+    {
+        ssize_t chunk = storage->read(handle, reply + read_octets, length - read_octets, &from);
+        if (chunk <= 0)
+        {
+            read_octets = (chunk == -1) ? -1 : read_octets;
+            break;
+        }
+        read_octets += chunk;
+    }
+    if (read_octets > 0 && offset == BINPROTO_OFFSET_CURRENT)
+    {
+        /* The position follows retention, from may have moved past it */
+        handle->position = from;
+    }
+    if (read_octets == -1)
+    {
+        shrink_response(session, reply, 0);
+        reply[-BINPROTO_HEADER_LEN + 1] = (char) BINPROTO_STATUS_IO_ERROR;
+        return 0;
+    }
+    shrink_response(session, reply, (uint32_t) read_octets);
+    return 0;
+}
+
+static int execute_stats(binproto_session_t *session, const binproto_header_t *request)
+{
+    static const metric_counter_t fields[] = {
+        METRIC_ACCEPTED, METRIC_CLOSED, METRIC_BYTES_IN, METRIC_BYTES_OUT, METRIC_BINARY_COMMANDS
+    };
+    char *reply = queue_response(session, request, BINPROTO_STATUS_OK,
+                                 (1 + sizeof(fields) / sizeof(fields[0])) * sizeof(uint64_t));
+    if (reply == NULL)
+    {
+        return -1;
+    }
+    put_be64(reply, (uint64_t) storage->length());
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++)
+    {
+        put_be64(reply + (i + 1) * sizeof(uint64_t), metrics_total(fields[i]));
+    }
+    return 0;
+}
+/*--------------------------------- Public Functions ---------------------------------  */
+ssize_t binproto_negotiate(binproto_session_t *session, const char *buf, size_t len)
+{
+    size_t compared = (len < BINPROTO_HELLO_LEN) ? len : BINPROTO_HELLO_LEN;
+
+    if (memcmp(buf, BINPROTO_HELLO, compared) != 0)
+    {
+        session->mode = BINPROTO_MODE_TEXT;
+        return 0;
+    }
+    if (compared < BINPROTO_HELLO_LEN)
+    {
+        return BINPROTO_HELLO_INCOMPLETE;
+    }
+    /* The reply to the hello is the hello itself, not a framed response */
+    char *reply = out_append(session, BINPROTO_HELLO_LEN);
+    if (reply == NULL)
+    {
+        return -1;
+    }
+    memcpy(reply, BINPROTO_HELLO, BINPROTO_HELLO_LEN);
+    session->mode = BINPROTO_MODE_BINARY;
+    return BINPROTO_HELLO_LEN;
+}
+
+ssize_t binproto_process(binproto_session_t *session, storage_handle_t *handle, const char *buf, size_t len, size_t *commands)
+{
+    size_t consumed = 0;
+
+    *commands = 0;
+    /* Resumed below the low watermark with replies still queued, move them to the front
+       so the buffer doesn't grow by the bytes already sent */
+    if (session->out_sent > 0)
+    {
+        memmove(session->out, session->out + session->out_sent, session->out_len - session->out_sent);
+        session->out_len -= session->out_sent;
+        session->out_sent = 0;
+    }
+    while (len - consumed >= BINPROTO_HEADER_LEN && session->out_len < server_config.tx_high_water)
+    {
+        const char *frame = buf + consumed;
+        binproto_header_t request = {
+            .op  = (uint8_t) frame[0],
+            .tag = get_be32(frame + 4),
+            .len = get_be32(frame + 8),
+        };
+        if (request.len > BINPROTO_MAX_PAYLOAD)
+        {
+            aesd_log(LOG_ERR, "Binary frame of %u bytes, closing the connection\n", request.len);
+            return -1;
+        }
+        if (len - consumed - BINPROTO_HEADER_LEN < request.len)
+        {
+            break;
+        }
+
+        const char *payload = frame + BINPROTO_HEADER_LEN;
+        int status;
+        switch (request.op)
+        {
+        case BINPROTO_OP_APPEND:
+            status = execute_append(session, handle, &request, payload);
+            break;
+        case BINPROTO_OP_SEEKTO:
+            status = execute_seekto(session, handle, &request, payload);
+            break;
+        case BINPROTO_OP_READ:
+            status = execute_read(session, handle, &request, payload);
+            break;
+        case BINPROTO_OP_STATS:
+            status = execute_stats(session, &request);
+            break;
+        default:
+            status = (queue_response(session, &request, BINPROTO_STATUS_UNSUPPORTED, 0) == NULL) ? -1 : 0;
+            break;
+        }
+        if (status == -1)
+        {
+            return -1;
+        }
+        consumed += BINPROTO_HEADER_LEN + request.len;
+        (*commands)++;
+    }
+    metrics_add(METRIC_BINARY_COMMANDS, *commands);
+    return (ssize_t) consumed;
+}
+
+int binproto_flush(binproto_session_t *session, int sock_fd)
+{
+    while (session->out_sent < session->out_len)
+    {
+        ssize_t sent = send(sock_fd, session->out + session->out_sent, session->out_len - session->out_sent, MSG_NOSIGNAL);
+        if (sent == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        metrics_add(METRIC_BYTES_OUT, sent);
+        session->out_sent += sent;
+    }
+    session->out_len = session->out_sent = 0;
+    /* A large READ reply doesn't pin its buffer for the rest of the connection */
+    if (session->out_cap > server_config.tx_high_water)
+    {
+        free(session->out);
+        session->out = NULL;
+        session->out_cap = 0;
+    }
+    return 1;
+}
+
+size_t binproto_pending(const binproto_session_t *session)
+{
+    return session->out_len - session->out_sent;
+}
+
+void binproto_session_release(binproto_session_t *session)
+{
+    free(session->out);
+    memset(session, 0, sizeof(*session));
+}
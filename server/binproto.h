@@ -0,0 +1,123 @@
+/**
+ * @file binproto.h
+ * @brief Length-prefixed binary command protocol, negotiated per connection
+ *
+ * A connection whose first bytes are BINPROTO_HELLO switches to binary frames,
+ * the server answers with the same hello. Any other first byte keeps the
+ * newline text protocol for the whole connection.
+ *
+ * Every request and response starts with a 12 byte header, integers are big
+ * endian:
+ *   u8 op | u8 status (0 in requests) | u16 reserved | u32 tag | u32 payload length
+ * The response echoes the op and the tag of its request, so a client can keep
+ * many commands in flight. Commands execute in order and every complete
+ * command of a receive is answered with a single send.
+ *
+ *   APPEND  payload: bytes to append
+ *           reply:   u64 data length after the append (0 for chardev), rewinds the
+ *                    read position to the oldest data like a text packet does
+ *   SEEKTO  payload: u32 write_cmd | u32 write_cmd_offset
+ *           reply:   empty, moves the read position of the connection
+ *   READ    payload: u64 offset | u32 length, BINPROTO_OFFSET_CURRENT reads from the
+ *                    read position and advances it, an explicit offset leaves it
+ *                    alone. Offsets are logical, with -r they keep counting across
+ *                    segments and an offset of a retired segment is OUT_OF_RANGE
+ *           reply:   up to length bytes, fewer at the end of the data
+ *   STATS   payload: empty
+ *           reply:   u64 data length | accepted | closed | bytes in | bytes out | commands
+ */
+#ifndef BINPROTO_H
+#define BINPROTO_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "storage.h"
+
+#define BINPROTO_HELLO                          "\0AESDB1\n"
+#define BINPROTO_HELLO_LEN                      8
+#define BINPROTO_HEADER_LEN                     12
+#define BINPROTO_MAX_PAYLOAD                    (1024 * 1024)
+#define BINPROTO_OFFSET_CURRENT                 UINT64_MAX
+/* binproto_negotiate() result while the hello is still arriving */
+#define BINPROTO_HELLO_INCOMPLETE               (-2)
+
+typedef enum {
+    BINPROTO_OP_APPEND = 1,
+    BINPROTO_OP_SEEKTO,
+    BINPROTO_OP_READ,
+    BINPROTO_OP_STATS,
+} binproto_op_t;
+
+typedef enum {
+    BINPROTO_STATUS_OK = 0,
+    BINPROTO_STATUS_BAD_REQUEST,        /* payload of the wrong size */
+    BINPROTO_STATUS_UNSUPPORTED,        /* unknown op */
+    BINPROTO_STATUS_IO_ERROR,
+    BINPROTO_STATUS_OUT_OF_RANGE,       /* seek past the stored commands, read of retired data */
+} binproto_status_t;
+
+typedef enum {
+    BINPROTO_MODE_UNKNOWN = 0,          /* fewer bytes than the hello received so far */
+    BINPROTO_MODE_TEXT,
+    BINPROTO_MODE_BINARY,
+} binproto_mode_t;
+
+/**
+ * @brief Protocol state of a connection, all zero for a new connection
+ */
+typedef struct binproto_session {
+    binproto_mode_t mode;
+    char *out;                  /* responses not sent yet */
+    size_t out_len;
+    size_t out_sent;
+    size_t out_cap;
+} binproto_session_t;
+
+/**
+ * @brief Decide the protocol of a connection from its first bytes, queues the hello
+ *        reply when the client asks for binary frames
+ *
+ * @param session   [IN/OUT] session still in BINPROTO_MODE_UNKNOWN
+ * @param buf       [IN]  unconsumed received bytes
+ * @param len       [IN]  number of bytes in buf
+ *
+ * @return bytes of buf the hello used, 0 if the connection speaks text,
+ *         BINPROTO_HELLO_INCOMPLETE if more bytes are needed to decide, -1 if the reply
+ *         can't be queued and the connection has to be closed
+ */
+ssize_t binproto_negotiate(binproto_session_t *session, const char *buf, size_t len);
+
+/**
+ * @brief Execute the complete commands at the start of buf and queue their responses,
+ *        stops once server_config.tx_high_water bytes of responses are queued
+ *
+ * @param session   [IN/OUT] binary session
+ * @param handle    [IN/OUT] storage handle of the connection, holds the read position
+ * @param buf       [IN]  unconsumed received bytes
+ * @param len       [IN]  number of bytes in buf
+ * @param commands  [OUT] number of commands executed
+ *
+ * @return bytes consumed, 0 if no command is complete, -1 on a framing error after
+ *         which the connection can't be resynchronized
+ */
+ssize_t binproto_process(binproto_session_t *session, storage_handle_t *handle, const char *buf, size_t len, size_t *commands);
+
+/**
+ * @brief Send the queued responses
+ *
+ * @return 1 when everything is sent, 0 if a non-blocking socket is full, -1 on error
+ */
+int binproto_flush(binproto_session_t *session, int sock_fd);
+
+/**
+ * @brief Bytes of responses queued and not sent yet
+ */
+size_t binproto_pending(const binproto_session_t *session);
+
+/**
+ * @brief Free the output buffer, the session may be reused for a new connection
+ */
+void binproto_session_release(binproto_session_t *session);
+
+#endif /*BINPROTO_H*/
@@ -0,0 +1,224 @@
+/**
+ * @file client-registry.c
+ * @brief Registry of the thread-per-connection clients
+ *
+ * The list is kept in accept order, so its head is always the oldest live
+ * connection. The sum of the accept times is maintained with the list, which
+ * gives the mean age without walking it.
+ */
+/*--------------------------------- Private includes ---------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <syslog.h>
+#include <pthread.h>
+#include "aesdsocket.h"
+#include "client-registry.h"
+#include "log-ring.h"
+/*--------------------------------- Private definitions ---------------------------------  */
+typedef struct client_registry {
+    pthread_mutex_t lock;
+    client_thread_t *head;
+    client_thread_t *tail;
+    unsigned long live;
+    unsigned long accepted;
+    unsigned long reaped;
+    unsigned long long accepted_sum_ms;     /* sum of the accept times of the live clients */
+    int stopping;
+    int wake_fd;
+    pthread_t reaper_id;
+    _Atomic(client_thread_t *) done_list;
+} client_registry_t;
+/*---------------------------------- Private Variables ----------------------------------  */
+static client_registry_t registry = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake_fd = UNINIT_VALUE,
+};
+/*--------------------------------- Private Functions ---------------------------------  */
+static unsigned long long timespec_ms(const struct timespec *ts)
+{
+    return (unsigned long long) ts->tv_sec * 1000ULL + ts->tv_nsec / 1000000;
+}
+
+/**
+ * @brief Unlink a client, registry.lock must be held
+ */
+static void registry_unlink(client_thread_t *client)
+{
+    if (client->prev != NULL)
+    {
+        client->prev->next = client->next;
+    }
+    else
+    {
+        registry.head = client->next;
+    }
+    if (client->next != NULL)
+    {
+        client->next->prev = client->prev;
+    }
+    else
+    {
+        registry.tail = client->prev;
+    }
+    client->prev = client->next = NULL;
+    registry.live--;
+    registry.accepted_sum_ms -= timespec_ms(&client->accepted_at);
+}
+
+static void *reaper_thread(void *arg)
+{
+    (void) arg;
+    int stop = 0;
+
+    while (!stop)
+    {
+        uint64_t count;
+        if (read(registry.wake_fd, &count, sizeof count) == -1 && errno == EINTR)
+        {
+            continue;
+        }
+
+        client_thread_t *client = atomic_exchange(&registry.done_list, NULL);
+        while (client != NULL)
+        {
+            client_thread_t *nxt_done = client->nxt_done;
+            pthread_join(client->thread_id, NULL);
+            pthread_mutex_lock(&registry.lock);
+            registry_unlink(client);
+            registry.reaped++;
+            pthread_mutex_unlock(&registry.lock);
+            free(client);
+            client = nxt_done;
+        }
+
+        pthread_mutex_lock(&registry.lock);
+        stop = registry.stopping && registry.live == 0;
+        pthread_mutex_unlock(&registry.lock);
+    }
+    return NULL;
+}
+/*--------------------------------- Public Functions ---------------------------------  */
+int client_registry_init(void)
+{
+    registry.wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (registry.wake_fd == -1)
+    {
+        aesd_log(LOG_ERR, "Can't create the reaper eventfd: %s\n", strerror(errno));
+        return -1;
+    }
+    if (pthread_create(&registry.reaper_id, NULL, reaper_thread, NULL) != 0)
+    {
+        aesd_log(LOG_ERR, "Can't create the reaper thread\n");
+        close(registry.wake_fd);
+        registry.wake_fd = UNINIT_VALUE;
+        return -1;
+    }
+    return 0;
+}
+
+client_thread_t *client_registry_add(int client_fd)
+{
+    client_thread_t *client = calloc(1, sizeof(client_thread_t));
+    if (client == NULL)
+    {
+        return NULL;
+    }
+    client->client_fd = client_fd;
+    clock_gettime(CLOCK_MONOTONIC, &client->accepted_at);
+
+    pthread_mutex_lock(&registry.lock);
+    client->prev = registry.tail;
+    if (registry.tail != NULL)
+    {
+        registry.tail->next = client;
+    }
+    else
+    {
+        registry.head = client;
+    }
+    registry.tail = client;
+    registry.live++;
+    registry.accepted++;
+    registry.accepted_sum_ms += timespec_ms(&client->accepted_at);
+    pthread_mutex_unlock(&registry.lock);
+    return client;
+}
+
+void client_registry_remove(client_thread_t *client)
+{
+    pthread_mutex_lock(&registry.lock);
+    registry_unlink(client);
+    pthread_mutex_unlock(&registry.lock);
+    free(client);
+}
+
+void client_registry_complete(client_thread_t *client)
+{
+    /* Closed under the lock so the shutdown never acts on a recycled descriptor */
+    pthread_mutex_lock(&registry.lock);
+    close(client->client_fd);
+    client->client_fd = UNINIT_VALUE;
+    pthread_mutex_unlock(&registry.lock);
+
+    client_thread_t *head = atomic_load(&registry.done_list);
+    do
+    {
+        client->nxt_done = head;
+    } while (!atomic_compare_exchange_weak(&registry.done_list, &head, client));
+
+    uint64_t one = 1;
+    ssize_t ignored = write(registry.wake_fd, &one, sizeof one);
+    (void) ignored;
+}
+
+void client_registry_shutdown(void)
+{
+    client_registry_stats_t stats;
+
+    if (registry.wake_fd == UNINIT_VALUE)
+    {
+        return;
+    }
+    pthread_mutex_lock(&registry.lock);
+    registry.stopping = 1;
+    for (client_thread_t *client = registry.head; client != NULL; client = client->next)
+    {
+        if (client->client_fd != UNINIT_VALUE)
+        {
+            shutdown(client->client_fd, SHUT_RDWR);
+        }
+    }
+    pthread_mutex_unlock(&registry.lock);
+
+    uint64_t one = 1;
+    ssize_t ignored = write(registry.wake_fd, &one, sizeof one);
+    (void) ignored;
+    pthread_join(registry.reaper_id, NULL);
+    close(registry.wake_fd);
+    registry.wake_fd = UNINIT_VALUE;
+
+    client_registry_get_stats(&stats);
+    aesd_log(LOG_INFO, "Client registry: %lu connections accepted, %lu reaped\n", stats.accepted, stats.reaped);
+}
+
+void client_registry_get_stats(client_registry_stats_t *stats)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    unsigned long long now_ms = timespec_ms(&now);
+
+    pthread_mutex_lock(&registry.lock);
+    stats->live = registry.live;
+    stats->accepted = registry.accepted;
+    stats->reaped = registry.reaped;
+    stats->oldest_age_ms = (registry.head != NULL) ? now_ms - timespec_ms(&registry.head->accepted_at) : 0;
+    stats->mean_age_ms = (registry.live > 0) ? now_ms - registry.accepted_sum_ms / registry.live : 0;
+    pthread_mutex_unlock(&registry.lock);
+}
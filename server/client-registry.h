@@ -0,0 +1,72 @@
+/**
+ * @file client-registry.h
+ * @brief Registry of the thread-per-connection clients
+ *
+ * Clients sit on an intrusive doubly linked list, so registering and
+ * unregistering one is O(1) whatever the number of connections. A finishing
+ * client thread queues itself and signals an eventfd; a reaper thread joins
+ * and frees it right away, so the accept path never walks the list and no
+ * finished thread waits for the next connection to be joined.
+ */
+#ifndef CLIENT_REGISTRY_H
+#define CLIENT_REGISTRY_H
+
+#include <pthread.h>
+#include <time.h>
+
+/**
+ * @brief Node definition
+ */
+typedef struct client_thread {
+    pthread_t thread_id;
+    int client_fd;
+    struct timespec accepted_at;        /* CLOCK_MONOTONIC */
+    struct client_thread *prev;         /* registry links */
+    struct client_thread *next;
+    struct client_thread *nxt_done;     /* completion queue link */
+} client_thread_t;
+
+/**
+ * @brief Snapshot of the registry
+ */
+typedef struct client_registry_stats {
+    unsigned long live;                 /* connections with a running thread */
+    unsigned long accepted;
+    unsigned long reaped;
+    unsigned long oldest_age_ms;        /* age of the oldest live connection */
+    unsigned long mean_age_ms;          /* mean age of the live connections */
+} client_registry_stats_t;
+
+/**
+ * @brief Start the reaper thread
+ *
+ * @return 0 on success, -1 on failure
+ */
+int client_registry_init(void);
+
+/**
+ * @brief Allocate and register a client before its thread is created
+ *
+ * @return the new node, NULL if memory ran out
+ */
+client_thread_t *client_registry_add(int client_fd);
+
+/**
+ * @brief Unregister and free a client whose thread could not be created
+ */
+void client_registry_remove(client_thread_t *client);
+
+/**
+ * @brief Hand a finished client to the reaper, the last call of the client thread
+ */
+void client_registry_complete(client_thread_t *client);
+
+/**
+ * @brief Shut the sockets of the live clients down so their threads leave recv(),
+ *        wait for all of them to be reaped and stop the reaper
+ */
+void client_registry_shutdown(void);
+
+void client_registry_get_stats(client_registry_stats_t *stats);
+
+#endif /*CLIENT_REGISTRY_H*/
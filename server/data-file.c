@@ -0,0 +1,1263 @@
+/**
+ * @file data-file.c
+ * @brief Lock-free appends to the data file (file backend)
+ *
+ * Publication protocol: a writer that finished its pwrite() waits until the
+ * watermark reaches the start of its range, which means every earlier range is
+ * on disk, mirrors its bytes into the append log and stores the end of its
+ * range with release semantics. The wait is only as long as the slowest earlier
+ * pwrite(), never a lock held across another writer's I/O, and it serializes
+ * the append log updates without a mutex. A writer spins briefly, then sleeps
+ * on publish_cond until a publication wakes it. A staged packet may take long
+ * to copy, its mirror and index entries are built during the copy so its turn
+ * only links them in.
+ *
+ * A range whose write failed is never published: it would expose bytes that were
+ * never written, and the append log would lose sync with the file. The store
+ * stops there, the writers of later ranges give up waiting for it and every
+ * further append is refused, readers keep the data published before it.
+ *
+ * Segments: the reservation takes segment_lock to pick the segment of the
+ * range, rolling to a new one before the range would pass the segment size,
+ * so a range never straddles two segments. Only a range longer than the
+ * segment size overshoots it, alone in its segment. The index holds 32 bit
+ * positions, a range that would end past them, when the segment could not roll,
+ * is refused. The index entries are written at publication, in offset order, which
+ * is also where the line numbering is known. Retention runs under the same
+ * lock: a retired segment is unlinked at once and closed by its last reader.
+ * The reservations apply it, and with a retention age a timer thread also does
+ * every SEGMENT_RETENTION_INTERVAL_MS, so an idle server still retires the
+ * expired segments.
+ */
+/*--------------------------------- Private includes ---------------------------------*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <syslog.h>
+#include "aesdsocket.h"
+#include "append-log.h"
+#include "data-file.h"
+#include "framing.h"
+#include "metrics.h"
+#include "log-ring.h"
+/*--------------------------------- Private definitions ---------------------------------  */
+#define DATA_FILE_SPINS                         64
+#define DATA_FILE_SCAN_CHUNK                    (16 * 1024)
+#define SEGMENT_INDEX_BATCH                     256
+#define SEGMENT_INDEX_SUFFIX                    ".idx"
+#define SEGMENT_BASE_DIGITS                     20
+/* Bytes a segment can grow to with 32 bit index positions */
+#define SEGMENT_MAX_BYTES                       ((off_t) UINT32_MAX)
+#define SEGMENT_RETENTION_INTERVAL_MS           1000
+
+/**
+ * @brief Mirror and index entries of a range, built before its turn to be published
+ */
+typedef struct prepared_range {
+    append_log_batch_t mirror;  /* with -m */
+    uint32_t *entries;          /* lines starting behind a newline inside the range */
+    unsigned int count;
+    unsigned int cap;
+    off_t position;             /* segment position of the next byte fed */
+    int ends_newline;
+    int failed;                 /* out of memory for the entries */
+} prepared_range_t;
+
+typedef struct data_segment {
+    off_t base;                 /* logical offset of the first byte */
+    int fd;
+    int index_fd;               /* sidecar index, the u32 position of every line starting here */
+    uint64_t first_record;      /* number of the first line indexed here, set by the first publication */
+    int numbered;
+    atomic_uint records;        /* entries written to the index */
+    time_t last_append;
+    atomic_int refs;            /* the segment list and every pinned slice */
+} data_segment_t;
+/*---------------------------------- Private Variables ----------------------------------  */
+static int data_fd = UNINIT_VALUE;
+static atomic_llong reserved_tail;
+static atomic_llong committed_tail;
+/* Start of the first range that could not be written, LLONG_MAX while the store is sound */
+static atomic_llong failed_offset = LLONG_MAX;
+/* Writers sleeping in publish_wait() */
+static pthread_mutex_t publish_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t publish_cond = PTHREAD_COND_INITIALIZER;
+static atomic_uint publish_sleepers;
+/* Segments, oldest first, the last one is active. segment_lock guards the list */
+static int segmented;
+static const char *segment_path;
+static pthread_mutex_t segment_lock = PTHREAD_MUTEX_INITIALIZER;
+static data_segment_t **segments;
+static unsigned int segment_count;
+static unsigned int segment_cap;
+static atomic_llong start_offset;
+/* Timer thread of the age based retention */
+static pthread_t retention_id;
+static int retention_timer_fd = UNINIT_VALUE;
+static int retention_stop_fd = UNINIT_VALUE;
+static int retention_running;
+/* Only touched by the publication, which runs in offset order */
+static uint64_t published_records;
+static int published_newline = 1;
+/*--------------------------------- Private Functions ---------------------------------  */
+/**
+ * @brief pwritev() that resumes after short writes, the iovec array is left untouched
+ */
+static int pwritev_all(int fd, const struct iovec *iov, int iov_count, off_t offset)
+{
+    struct iovec local[iov_count];
+    struct iovec *cur = local;
+
+    memcpy(local, iov, iov_count * sizeof(struct iovec));
+    while (iov_count > 0)
+    {
+        ssize_t written_octets = pwritev(fd, cur, iov_count, offset);
+        if (written_octets == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        offset += written_octets;
+        while (iov_count > 0 && (size_t) written_octets >= cur->iov_len)
+        {
+            written_octets -= cur->iov_len;
+            cur++;
+            iov_count--;
+        }
+        if (iov_count > 0)
+        {
+            cur->iov_base = (char *) cur->iov_base + written_octets;
+            cur->iov_len -= written_octets;
+        }
+    }
+    return 0;
+}
+
+static void segment_name(char *name, size_t size, off_t base, const char *suffix)
+{
+    snprintf(name, size, "%s.%0*lld%s", segment_path, SEGMENT_BASE_DIGITS, (long long) base, suffix);
+}
+
+/**
+ * @brief Open the data and index files of a segment, created if missing
+ *
+ * @return segment holding the reference of the list, NULL on failure
+ */
+static data_segment_t *segment_open(off_t base)
+{
+    char name[PATH_MAX];
+    data_segment_t *seg = calloc(1, sizeof(data_segment_t));
+    if (seg == NULL)
+    {
+        return NULL;
+    }
+    seg->base = base;
+    seg->last_append = time(NULL);
+    atomic_init(&seg->refs, 1);
+
+    segment_name(name, sizeof name, base, "");
+    seg->fd = open(name, O_CREAT | O_RDWR | O_CLOEXEC, S_IRWXU | S_IRWXG | S_IRWXO);
+    segment_name(name, sizeof name, base, SEGMENT_INDEX_SUFFIX);
+    seg->index_fd = open(name, O_CREAT | O_RDWR | O_APPEND | O_CLOEXEC, S_IRWXU | S_IRWXG | S_IRWXO);
+    if (seg->fd == -1 || seg->index_fd == -1)
+    {
+        aesd_log(LOG_ERR, "Can't open segment %s: %s\n", name, strerror(errno));
+        if (seg->fd != -1)
+        {
+            close(seg->fd);
+        }
+        if (seg->index_fd != -1)
+        {
+            close(seg->index_fd);
+        }
+        free(seg);
+        return NULL;
+    }
+    return seg;
+}
+
+static void segment_put(data_segment_t *seg)
+{
+    if (atomic_fetch_sub_explicit(&seg->refs, 1, memory_order_acq_rel) == 1)
+    {
+        close(seg->fd);
+        close(seg->index_fd);
+        free(seg);
+    }
+}
+
+static void segment_unlink(const data_segment_t *seg)
+{
+    char name[PATH_MAX];
+
+    segment_name(name, sizeof name, seg->base, "");
+    unlink(name);
+    segment_name(name, sizeof name, seg->base, SEGMENT_INDEX_SUFFIX);
+    unlink(name);
+}
+
+/**
+ * @brief Add a segment at the end of the list, segment_lock held
+ */
+static int segment_push(data_segment_t *seg)
+{
+    if (segment_count == segment_cap)
+    {
+        unsigned int cap = (segment_cap == 0) ? 16 : segment_cap * 2;
+        data_segment_t **grown = realloc(segments, cap * sizeof(data_segment_t *));
+        if (grown == NULL)
+        {
+            return -1;
+        }
+        segments = grown;
+        segment_cap = cap;
+    }
+    segments[segment_count++] = seg;
+    return 0;
+}
+
+/**
+ * @brief Retire the oldest segments the retention policy no longer keeps, segment_lock held.
+ *        The active segment is never retired
+ */
+static void segment_apply_retention(time_t now)
+{
+    while (segment_count > 1 &&
+           ((server_config.keep_segments > 0 && segment_count > server_config.keep_segments) ||
+            (server_config.keep_seconds > 0 && now - segments[0]->last_append >= (time_t) server_config.keep_seconds)))
+    {
+        data_segment_t *oldest = segments[0];
+        memmove(segments, segments + 1, (segment_count - 1) * sizeof(data_segment_t *));
+        segment_count--;
+        atomic_store_explicit(&start_offset, segments[0]->base, memory_order_release);
+        segment_unlink(oldest);
+        aesd_log(LOG_DEBUG, "Retired the segment at offset %lld\n", (long long) oldest->base);
+        segment_put(oldest);
+        metrics_add(METRIC_SEGMENTS_RETIRED, 1);
+    }
+}
+
+/**
+ * @brief Reserve a range in the active segment, rolling to a new segment first if the
+ *        range would pass the segment size
+ *
+ * @param len       [IN]  bytes to reserve
+ * @param start     [OUT] logical offset of the range
+ *
+ * @return pinned segment of the range, NULL if the range can't be indexed
+ */
+static data_segment_t *segment_reserve(size_t len, off_t *start)
+{
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&segment_lock);
+    data_segment_t *seg = segments[segment_count - 1];
+    *start = atomic_load_explicit(&reserved_tail, memory_order_relaxed);
+    off_t used = *start - seg->base;
+    if (used > 0 && used + (off_t) len > (off_t) server_config.segment_size)
+    {
+        data_segment_t *next = segment_open(*start);
+        if (next != NULL && segment_push(next) == 0)
+        {
+            seg = next;
+            metrics_add(METRIC_SEGMENTS_ROLLED, 1);
+        }
+        else if (next != NULL)
+        {
+            segment_unlink(next);
+            segment_put(next);
+        }
+        /* Without a new segment the active one keeps growing, up to SEGMENT_MAX_BYTES */
+    }
+    if (*start + (off_t) len - seg->base > SEGMENT_MAX_BYTES)
+    {
+        pthread_mutex_unlock(&segment_lock);
+        aesd_log(LOG_ERR, "A %zu byte append would end past the index range of its segment\n", len);
+        errno = EFBIG;
+        return NULL;
+    }
+    atomic_store_explicit(&reserved_tail, *start + len, memory_order_relaxed);
+    seg->last_append = now;
+    atomic_fetch_add_explicit(&seg->refs, 1, memory_order_relaxed);
+    segment_apply_retention(now);
+    pthread_mutex_unlock(&segment_lock);
+    return seg;
+}
+
+/**
+ * @brief Apply the retention policy every SEGMENT_RETENTION_INTERVAL_MS until stopped
+ */
+static void *retention_thread(void *arg)
+{
+    (void) arg;
+    struct pollfd fds[2] = {
+        { .fd = retention_timer_fd, .events = POLLIN },
+        { .fd = retention_stop_fd, .events = POLLIN },
+    };
+
+    while (1)
+    {
+        if (poll(fds, 2, -1) == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            aesd_log(LOG_ERR, "Segment retention poll failed: %s\n", strerror(errno));
+            break;
+        }
+        if (fds[1].revents != 0)
+        {
+            break;
+        }
+        uint64_t expirations;
+        if (read(retention_timer_fd, &expirations, sizeof expirations) != sizeof expirations)
+        {
+            continue;
+        }
+        pthread_mutex_lock(&segment_lock);
+        segment_apply_retention(time(NULL));
+        pthread_mutex_unlock(&segment_lock);
+    }
+    return NULL;
+}
+
+static void retention_close(void)
+{
+    if (retention_timer_fd != UNINIT_VALUE)
+    {
+        close(retention_timer_fd);
+    }
+    if (retention_stop_fd != UNINIT_VALUE)
+    {
+        close(retention_stop_fd);
+    }
+    retention_timer_fd = UNINIT_VALUE;
+    retention_stop_fd = UNINIT_VALUE;
+}
+
+/**
+ * @brief Start the retention timer thread, only needed to retire segments by age
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int retention_start(void)
+{
+    struct itimerspec its = {
+        .it_value    = { .tv_sec = SEGMENT_RETENTION_INTERVAL_MS / 1000,
+                         .tv_nsec = (SEGMENT_RETENTION_INTERVAL_MS % 1000) * 1000000L },
+        .it_interval = { .tv_sec = SEGMENT_RETENTION_INTERVAL_MS / 1000,
+                         .tv_nsec = (SEGMENT_RETENTION_INTERVAL_MS % 1000) * 1000000L },
+    };
+
+    if (server_config.keep_seconds == 0)
+    {
+        return 0;
+    }
+    retention_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    retention_stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (retention_timer_fd == -1 || retention_stop_fd == -1 ||
+        timerfd_settime(retention_timer_fd, 0, &its, NULL) == -1)
+    {
+        aesd_log(LOG_ERR, "Can't create the segment retention timer: %s\n", strerror(errno));
+        retention_close();
+        return -1;
+    }
+    if (pthread_create(&retention_id, NULL, retention_thread, NULL) != 0)
+    {
+        aesd_log(LOG_ERR, "Can't create the segment retention thread\n");
+        retention_close();
+        return -1;
+    }
+    retention_running = 1;
+    return 0;
+}
+
+static void retention_stop(void)
+{
+    if (!retention_running)
+    {
+        return;
+    }
+    uint64_t one = 1;
+    ssize_t ignored = write(retention_stop_fd, &one, sizeof one);
+    (void) ignored;
+    pthread_join(retention_id, NULL);
+    retention_running = 0;
+    retention_close();
+}
+
+/**
+ * @brief Write index entries and make them visible to the lookups
+ */
+static void segment_index_flush(data_segment_t *seg, const uint32_t *entries, unsigned int count)
+{
+    if (write(seg->index_fd, entries, count * sizeof(uint32_t)) != (ssize_t) (count * sizeof(uint32_t)))
+    {
+        aesd_log(LOG_ERR, "Can't write the segment index: %s\n", strerror(errno));
+    }
+    atomic_fetch_add_explicit(&seg->records, count, memory_order_release);
+    published_records += count;
+}
+
+/**
+ * @brief Number the lines of a segment from its first publication, called in offset order
+ */
+static void segment_number(data_segment_t *seg)
+{
+    if (!seg->numbered)
+    {
+        pthread_mutex_lock(&segment_lock);
+        seg->first_record = published_records;
+        seg->numbered = 1;
+        pthread_mutex_unlock(&segment_lock);
+    }
+}
+
+/**
+ * @brief Index the lines starting in a published range, called in offset order
+ */
+static void segment_index(data_segment_t *seg, const struct iovec *iov, int iov_count, off_t start)
+{
+    uint32_t entries[SEGMENT_INDEX_BATCH];
+    unsigned int count = 0;
+
+    segment_number(seg);
+    for (int i = 0; i < iov_count; i++)
+    {
+        const char *buf = iov[i].iov_base;
+        const char *scan = buf;
+        const char *buf_end = buf + iov[i].iov_len;
+        while (scan < buf_end)
+        {
+            /* A line starts behind every newline, the one behind the last byte is
+               indexed by the next range, possibly in the next segment */
+            if (published_newline)
+            {
+                entries[count++] = (uint32_t) (start + (scan - buf) - seg->base);
+                if (count == SEGMENT_INDEX_BATCH)
+                {
+                    segment_index_flush(seg, entries, count);
+                    count = 0;
+                }
+            }
+            const char *newline_pos = framing_find_newline(scan, buf_end - scan);
+            published_newline = (newline_pos != NULL);
+            scan = (newline_pos != NULL) ? newline_pos + 1 : buf_end;
+        }
+        start += iov[i].iov_len;
+    }
+    if (count > 0)
+    {
+        segment_index_flush(seg, entries, count);
+    }
+}
+
+/**
+ * @brief Stop the store at the range of a failed write, which is never published
+ */
+static void publish_fail(off_t start)
+{
+    long long failed = atomic_load(&failed_offset);
+
+    while (start < failed && !atomic_compare_exchange_weak(&failed_offset, &failed, start))
+    {
+    }
+    if (failed == LLONG_MAX)
+    {
+        aesd_log(LOG_ERR, "The data file could not be written at offset %lld, appends are refused from now on\n",
+                 (long long) start);
+    }
+    pthread_mutex_lock(&publish_lock);
+    pthread_cond_broadcast(&publish_cond);
+    pthread_mutex_unlock(&publish_lock);
+}
+
+/**
+ * @brief Advance the watermark over a published range and wake the sleeping writers
+ */
+static void publish_advance(off_t end)
+{
+    /* Sequentially consistent with the sleepers count of publish_wait(): either the
+       sleeper sees the new watermark or this sees the sleeper */
+    atomic_store(&committed_tail, end);
+    if (atomic_load(&publish_sleepers) > 0)
+    {
+        pthread_mutex_lock(&publish_lock);
+        pthread_cond_broadcast(&publish_cond);
+        pthread_mutex_unlock(&publish_lock);
+    }
+}
+
+/**
+ * @brief Wait until every range below start is published
+ *
+ * @return 0 when it is this range's turn, -1 if an earlier range failed and it never comes
+ */
+static int publish_wait(off_t start)
+{
+    unsigned int spins = 0;
+
+    while (atomic_load_explicit(&committed_tail, memory_order_acquire) != start)
+    {
+        if (atomic_load(&failed_offset) < start)
+        {
+            return -1;
+        }
+        if (++spins <= DATA_FILE_SPINS)
+        {
+            continue;
+        }
+        /* Earlier writers are still writing, possibly a large staged packet, sleep
+           instead of taking the CPU from them */
+        pthread_mutex_lock(&publish_lock);
+        atomic_fetch_add(&publish_sleepers, 1);
+        while (atomic_load(&committed_tail) != start && atomic_load(&failed_offset) >= start)
+        {
+            pthread_cond_wait(&publish_cond, &publish_lock);
+        }
+        atomic_fetch_sub(&publish_sleepers, 1);
+        pthread_mutex_unlock(&publish_lock);
+    }
+    return 0;
+}
+
+/**
+ * @brief Mirror and index the bytes of a range at start, its turn to be published
+ */
+static void publish_bytes(data_segment_t *seg, const struct iovec *iov, int iov_count, off_t start)
+{
+    if (server_config.use_log)
+    {
+        for (int i = 0; i < iov_count; i++)
+        {
+            append_log_append(iov[i].iov_base, iov[i].iov_len);
+        }
+    }
+    if (seg != NULL)
+    {
+        segment_index(seg, iov, iov_count, start);
+    }
+}
+
+/**
+ * @brief Wait for the earlier ranges and advance the watermark over this one
+ *
+ * @return 0 on success, -1 if an earlier range failed
+ */
+static int publish_range(data_segment_t *seg, const struct iovec *iov, int iov_count, off_t start, off_t end)
+{
+    if (publish_wait(start) == -1)
+    {
+        return -1;
+    }
+    publish_bytes(seg, iov, iov_count, start);
+    publish_advance(end);
+    return 0;
+}
+
+/**
+ * @brief Mirror and index the bytes of a range being written, ahead of its turn.
+ *        The line starts behind its newlines are known from the range alone, only
+ *        the one at its first byte waits for the publication
+ */
+static void prepare_bytes(prepared_range_t *prep, const char *buf, size_t len)
+{
+    const char *scan = buf;
+    const char *buf_end = buf + len;
+
+    if (server_config.use_log)
+    {
+        append_log_batch_add(&prep->mirror, buf, len);
+    }
+    while (segmented && scan < buf_end && !prep->failed)
+    {
+        const char *newline_pos = framing_find_newline(scan, buf_end - scan);
+        if (newline_pos == NULL)
+        {
+            prep->ends_newline = 0;
+            break;
+        }
+        prep->ends_newline = 1;
+        scan = newline_pos + 1;
+        if (scan == buf_end)
+        {
+            break;
+        }
+        if (prep->count == prep->cap)
+        {
+            unsigned int cap = (prep->cap > 0) ? prep->cap * 2 : SEGMENT_INDEX_BATCH;
+            uint32_t *entries = realloc(prep->entries, cap * sizeof(uint32_t));
+            if (entries == NULL)
+            {
+                prep->failed = 1;
+                break;
+            }
+            prep->entries = entries;
+            prep->cap = cap;
+        }
+        prep->entries[prep->count++] = (uint32_t) (prep->position + (scan - buf));
+    }
+    prep->position += len;
+}
+
+/**
+ * @brief Link in the mirror and the index entries of a prepared range, its turn to be published
+ */
+static void publish_prepared(data_segment_t *seg, prepared_range_t *prep, off_t start)
+{
+    if (server_config.use_log)
+    {
+        append_log_batch_publish(&prep->mirror);
+    }
+    if (seg != NULL)
+    {
+        segment_number(seg);
+        if (published_newline)
+        {
+            uint32_t entry = (uint32_t) (start - seg->base);
+            segment_index_flush(seg, &entry, 1);
+        }
+        if (prep->count > 0)
+        {
+            segment_index_flush(seg, prep->entries, prep->count);
+        }
+        published_newline = prep->ends_newline;
+    }
+}
+
+/**
+ * @brief Copy len bytes from the start of in_fd to out_fd at out_offset. In the kernel
+ *        when both files allow it and the bytes aren't needed in memory, otherwise
+ *        through a buffer that also feeds prep
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int copy_range(int in_fd, off_t len, int out_fd, off_t out_offset, prepared_range_t *prep)
+{
+    char chunk[DATA_FILE_SCAN_CHUNK];
+    off_t in_offset = 0;
+    int in_kernel = (prep == NULL);
+
+    while (in_offset < len)
+    {
+        ssize_t copied = -1;
+        if (in_kernel)
+        {
+            copied = copy_file_range(in_fd, &in_offset, out_fd, &out_offset, len - in_offset, 0);
+            if (copied == -1 && errno != EINTR)
+            {
+                /* Older kernels, or filesystems that can't copy between these files */
+                in_kernel = (errno != EXDEV && errno != ENOSYS && errno != EINVAL && errno != EOPNOTSUPP);
+                if (in_kernel)
+                {
+                    return -1;
+                }
+            }
+            if (copied == 0)
+            {
+                /* The staging file is shorter than it was told to be */
+                errno = EIO;
+                return -1;
+            }
+            continue;
+        }
+        size_t want = (len - in_offset < (off_t) sizeof(chunk)) ? (size_t) (len - in_offset) : sizeof(chunk);
+        copied = pread(in_fd, chunk, want, in_offset);
+        if (copied <= 0)
+        {
+            if (copied == -1 && errno == EINTR)
+            {
+                continue;
+            }
+            errno = (copied == 0) ? EIO : errno;
+            return -1;
+        }
+        struct iovec iov = { .iov_base = chunk, .iov_len = copied };
+        if (pwritev_all(out_fd, &iov, 1, out_offset) == -1)
+        {
+            return -1;
+        }
+        if (prep != NULL)
+        {
+            prepare_bytes(prep, chunk, copied);
+        }
+        in_offset += copied;
+        out_offset += copied;
+    }
+    return 0;
+}
+
+/**
+ * @brief Rebuild the index of a segment left by a previous run from its data
+ *
+ * @return segment length, -1 on a read error
+ */
+static off_t segment_recover(data_segment_t *seg)
+{
+    char chunk[DATA_FILE_SCAN_CHUNK];
+    off_t offset = 0;
+    ssize_t read_octets;
+
+    if (ftruncate(seg->index_fd, 0) == -1)
+    {
+        return -1;
+    }
+    while ((read_octets = pread(seg->fd, chunk, sizeof chunk, offset)) > 0)
+    {
+        struct iovec iov = { .iov_base = chunk, .iov_len = read_octets };
+        segment_index(seg, &iov, 1, seg->base + offset);
+        offset += read_octets;
+    }
+    return (read_octets == -1) ? -1 : offset;
+}
+
+static int compare_offsets(const void *a, const void *b)
+{
+    off_t lhs = *(const off_t *) a;
+    off_t rhs = *(const off_t *) b;
+    return (lhs > rhs) - (lhs < rhs);
+}
+
+/**
+ * @brief Base offsets of the segments found next to path, sorted
+ *
+ * @return number of segments, -1 if the directory can't be read
+ */
+static int segment_scan(const char *path, off_t **bases)
+{
+    char dir_buf[PATH_MAX];
+    char name_buf[PATH_MAX];
+    int count = 0;
+    int cap = 0;
+
+    *bases = NULL;
+    snprintf(dir_buf, sizeof dir_buf, "%s", path);
+    snprintf(name_buf, sizeof name_buf, "%s", path);
+    const char *prefix = basename(name_buf);
+    size_t prefix_len = strlen(prefix);
+    DIR *dir = opendir(dirname(dir_buf));
+    if (dir == NULL)
+    {
+        return -1;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        const char *name = entry->d_name;
+        if (strncmp(name, prefix, prefix_len) != 0 || name[prefix_len] != '.' ||
+            strlen(name + prefix_len + 1) != SEGMENT_BASE_DIGITS ||
+            strspn(name + prefix_len + 1, "0123456789") != SEGMENT_BASE_DIGITS)
+        {
+            continue;
+        }
+        if (count == cap)
+        {
+            cap = (cap == 0) ? 16 : cap * 2;
+            off_t *grown = realloc(*bases, cap * sizeof(off_t));
+            if (grown == NULL)
+            {
+                break;
+            }
+            *bases = grown;
+        }
+        (*bases)[count++] = (off_t) strtoll(name + prefix_len + 1, NULL, 10);
+    }
+    closedir(dir);
+    qsort(*bases, count, sizeof(off_t), compare_offsets);
+    return count;
+}
+
+/**
+ * @brief Find the segment of a logical offset, segment_lock held
+ */
+static unsigned int segment_find(off_t offset)
+{
+    unsigned int low = 0;
+    unsigned int high = segment_count;
+
+    while (high - low > 1)
+    {
+        unsigned int mid = low + (high - low) / 2;
+        if (segments[mid]->base <= offset)
+        {
+            low = mid;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+/**
+ * @brief Read the position of an indexed line
+ *
+ * @return 0 on success, -1 on a read error
+ */
+static int segment_record_offset(const data_segment_t *seg, unsigned int entry, off_t *offset)
+{
+    uint32_t position;
+    if (pread(seg->index_fd, &position, sizeof position, (off_t) entry * sizeof position) != sizeof position)
+    {
+        return -1;
+    }
+    *offset = seg->base + position;
+    return 0;
+}
+
+/**
+ * @brief data_file_record() through the segment indexes
+ */
+static int segment_record(uint32_t record, off_t *start, off_t *end)
+{
+    off_t committed = data_file_committed();
+    data_segment_t *seg = NULL;
+    data_segment_t *next_seg = NULL;
+    unsigned int entry = 0;
+    unsigned int next_entry = 0;
+
+    pthread_mutex_lock(&segment_lock);
+    if (segment_count > 0 && segments[0]->numbered)
+    {
+        uint64_t wanted = segments[0]->first_record + record;
+        for (unsigned int i = 0; i < segment_count && segments[i]->numbered; i++)
+        {
+            data_segment_t *cur = segments[i];
+            uint64_t records = atomic_load_explicit(&cur->records, memory_order_acquire);
+            if (seg == NULL && wanted < cur->first_record + records)
+            {
+                seg = cur;
+                entry = (unsigned int) (wanted - cur->first_record);
+            }
+            /* The next line ends this one */
+            if (seg != NULL && wanted + 1 < cur->first_record + records)
+            {
+                next_seg = cur;
+                next_entry = (unsigned int) (wanted + 1 - cur->first_record);
+                break;
+            }
+        }
+    }
+    if (seg != NULL)
+    {
+        atomic_fetch_add_explicit(&seg->refs, 1, memory_order_relaxed);
+    }
+    if (next_seg != NULL)
+    {
+        atomic_fetch_add_explicit(&next_seg->refs, 1, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&segment_lock);
+
+    int status = 1;
+    if (seg != NULL && segment_record_offset(seg, entry, start) == -1)
+    {
+        status = -1;
+    }
+    else if (seg != NULL && next_seg != NULL)
+    {
+        status = (segment_record_offset(next_seg, next_entry, end) == -1) ? -1 : 0;
+    }
+    else if (seg != NULL && committed > *start)
+    {
+        /* The last line is complete only if the data ends with its newline */
+        char last;
+        off_t last_offset = committed - 1;
+        if (data_file_pread(&last, 1, &last_offset) != 1)
+        {
+            status = -1;
+        }
+        else if (last == '\n')
+        {
+            *end = committed;
+            status = 0;
+        }
+    }
+    if (status == 0 && *end > committed)
+    {
+        status = 1;
+    }
+    if (seg != NULL)
+    {
+        segment_put(seg);
+    }
+    if (next_seg != NULL)
+    {
+        segment_put(next_seg);
+    }
+    return status;
+}
+
+/**
+ * @brief data_file_record() of a single data file, scans it for newlines
+ */
+static int scan_record(uint32_t record, off_t *start, off_t *end)
+{
+    char chunk[DATA_FILE_SCAN_CHUNK];
+    off_t committed = data_file_committed();
+    off_t offset = 0;
+    off_t entry_start = 0;
+    uint32_t entry = 0;
+
+    while (offset < committed)
+    {
+        size_t want = (committed - offset < (off_t) sizeof(chunk)) ? (size_t) (committed - offset) : sizeof(chunk);
+        ssize_t read_octets = pread(data_fd, chunk, want, offset);
+        if (read_octets <= 0)
+        {
+            return -1;
+        }
+        const char *scan = chunk;
+        const char *newline_pos;
+        while ((newline_pos = framing_find_newline(scan, chunk + read_octets - scan)) != NULL)
+        {
+            off_t entry_end = offset + (newline_pos - chunk) + 1;
+            if (entry == record)
+            {
+                *start = entry_start;
+                *end = entry_end;
+                return 0;
+            }
+            entry++;
+            entry_start = entry_end;
+            scan = newline_pos + 1;
+        }
+        offset += read_octets;
+    }
+    return 1;
+}
+/*--------------------------------- Public Functions ---------------------------------  */
+int data_file_init(int fd)
+{
+    struct stat file_stat;
+
+    if (fstat(fd, &file_stat) == -1)
+    {
+        aesd_log(LOG_ERR, "Can't read the size of %s: %s\n", DATA_FILE_PATH, strerror(errno));
+        return -1;
+    }
+    data_fd = fd;
+    atomic_store(&reserved_tail, file_stat.st_size);
+    atomic_store(&committed_tail, file_stat.st_size);
+    return 0;
+}
+
+int data_file_init_segments(const char *path)
+{
+    off_t *bases;
+    off_t tail = 0;
+
+    segment_path = path;
+    int found = segment_scan(path, &bases);
+    for (int i = 0; i < found; i++)
+    {
+        data_segment_t *seg = segment_open(bases[i]);
+        off_t len = (seg != NULL) ? segment_recover(seg) : -1;
+        if (len == -1 || segment_push(seg) == -1)
+        {
+            aesd_log(LOG_ERR, "Can't recover the segment at offset %lld\n", (long long) bases[i]);
+            if (seg != NULL)
+            {
+                segment_put(seg);
+            }
+            free(bases);
+            goto func_error;
+        }
+        tail = bases[i] + len;
+    }
+    free(bases);
+    if (segment_count == 0)
+    {
+        data_segment_t *seg = segment_open(0);
+        if (seg == NULL || segment_push(seg) == -1)
+        {
+            if (seg != NULL)
+            {
+                segment_put(seg);
+            }
+            goto func_error;
+        }
+    }
+    else
+    {
+        aesd_log(LOG_INFO, "Recovered %u segments, %lld bytes\n", segment_count, (long long) (tail - segments[0]->base));
+    }
+    atomic_store(&start_offset, segments[0]->base);
+    atomic_store(&reserved_tail, tail);
+    atomic_store(&committed_tail, tail);
+    segmented = 1;
+    if (retention_start() == -1)
+    {
+        goto func_error;
+    }
+    return 0;
+
+func_error:
+    data_file_remove_segments();
+    return -1;
+}
+
+void data_file_remove_segments(void)
+{
+    retention_stop();
+    for (unsigned int i = 0; i < segment_count; i++)
+    {
+        segment_unlink(segments[i]);
+        segment_put(segments[i]);
+    }
+    free(segments);
+    segments = NULL;
+    segment_count = segment_cap = 0;
+    segmented = 0;
+}
+
+off_t data_file_append(const char *buf, size_t len)
+{
+    struct iovec iov = { .iov_base = (void *) buf, .iov_len = len };
+    return data_file_appendv(&iov, 1);
+}
+
+off_t data_file_appendv(const struct iovec *iov, int iov_count)
+{
+    size_t len = 0;
+    int status = 0;
+    data_segment_t *seg = NULL;
+    off_t start;
+
+    for (int i = 0; i < iov_count; i++)
+    {
+        len += iov[i].iov_len;
+    }
+    if (atomic_load(&failed_offset) != LLONG_MAX)
+    {
+        errno = EIO;
+        return -1;
+    }
+    if (segmented)
+    {
+        seg = segment_reserve(len, &start);
+        if (seg == NULL)
+        {
+            return -1;
+        }
+    }
+    else
+    {
+        start = atomic_fetch_add(&reserved_tail, len);
+    }
+    off_t end = start + len;
+
+    if (len > 0 && pwritev_all((seg != NULL) ? seg->fd : data_fd, iov, iov_count,
+                               (seg != NULL) ? start - seg->base : start) == -1)
+    {
+        aesd_log(LOG_ERR, "Error Writing in the file: %s\n", strerror(errno));
+        publish_fail(start);
+        status = -1;
+    }
+    else if (publish_range(seg, iov, iov_count, start, end) == -1)
+    {
+        status = -1;
+    }
+    if (seg != NULL)
+    {
+        segment_put(seg);
+    }
+    return (status == 0) ? end : -1;
+}
+
+off_t data_file_append_staged(int stage_fd, off_t stage_len, const char *tail, size_t tail_len)
+{
+    size_t len = stage_len + tail_len;
+    int status = 0;
+    data_segment_t *seg = NULL;
+    off_t start;
+
+    if (atomic_load(&failed_offset) != LLONG_MAX)
+    {
+        errno = EIO;
+        return -1;
+    }
+    if (segmented)
+    {
+        seg = segment_reserve(len, &start);
+        if (seg == NULL)
+        {
+            return -1;
+        }
+    }
+    else
+    {
+        start = atomic_fetch_add(&reserved_tail, len);
+    }
+    off_t end = start + len;
+    int out_fd = (seg != NULL) ? seg->fd : data_fd;
+    off_t out_offset = (seg != NULL) ? start - seg->base : start;
+    struct iovec iov = { .iov_base = (void *) tail, .iov_len = tail_len };
+    /* The mirror and the index need the bytes in memory, they are built from the
+       copy buffer so the turn of this range doesn't read the packet again */
+    prepared_range_t prepared = { .position = out_offset };
+    prepared_range_t *prep = (server_config.use_log || seg != NULL) ? &prepared : NULL;
+
+    append_log_batch_init(&prepared.mirror, start);
+    status = copy_range(stage_fd, stage_len, out_fd, out_offset, prep);
+    if (status == 0)
+    {
+        if (prep != NULL)
+        {
+            prepare_bytes(prep, tail, tail_len);
+        }
+        status = pwritev_all(out_fd, &iov, 1, out_offset + stage_len);
+    }
+    if (status == -1)
+    {
+        aesd_log(LOG_ERR, "Error Writing in the file: %s\n", strerror(errno));
+        publish_fail(start);
+        goto func_exit;
+    }
+    if (prepared.failed)
+    {
+        aesd_log(LOG_ERR, "Out of memory indexing the staged packet\n");
+        publish_fail(start);
+        status = -1;
+        goto func_exit;
+    }
+    if (publish_wait(start) == -1)
+    {
+        /* An earlier range failed, this one is never published */
+        status = -1;
+        goto func_exit;
+    }
+    publish_prepared(seg, &prepared, start);
+    publish_advance(end);
+
+func_exit:
+    append_log_batch_discard(&prepared.mirror);
+    free(prepared.entries);
+    if (seg != NULL)
+    {
+        segment_put(seg);
+    }
+    return (status == 0) ? end : -1;
+}
+
+off_t data_file_committed(void)
+{
+    return atomic_load_explicit(&committed_tail, memory_order_acquire);
+}
+
+off_t data_file_start(void)
+{
+    return atomic_load_explicit(&start_offset, memory_order_acquire);
+}
+
+int data_file_slice(off_t *offset, off_t end, data_file_slice_t *slice)
+{
+    if (!segmented)
+    {
+        slice->fd = data_fd;
+        slice->file_offset = *offset;
+        slice->len = (end > *offset) ? end - *offset : 0;
+        slice->segment = NULL;
+        return 0;
+    }
+
+    pthread_mutex_lock(&segment_lock);
+    if (*offset < segments[0]->base)
+    {
+        *offset = segments[0]->base;
+    }
+    unsigned int index = segment_find(*offset);
+    data_segment_t *seg = segments[index];
+    off_t slice_end = (index + 1 < segment_count && segments[index + 1]->base < end) ? segments[index + 1]->base : end;
+    atomic_fetch_add_explicit(&seg->refs, 1, memory_order_relaxed);
+    pthread_mutex_unlock(&segment_lock);
+
+    slice->fd = seg->fd;
+    slice->file_offset = *offset - seg->base;
+    slice->len = (slice_end > *offset) ? slice_end - *offset : 0;
+    slice->segment = seg;
+    return 0;
+}
+
+void data_file_slice_release(data_file_slice_t *slice)
+{
+    if (slice->segment != NULL)
+    {
+        segment_put(slice->segment);
+        slice->segment = NULL;
+    }
+}
+
+ssize_t data_file_pread(void *buf, size_t len, off_t *offset)
+{
+    data_file_slice_t slice;
+
+    if (data_file_slice(offset, data_file_committed(), &slice) == -1)
+    {
+        return -1;
+    }
+    if ((off_t) len > slice.len)
+    {
+        len = slice.len;
+    }
+    ssize_t read_octets = (len > 0) ? pread(slice.fd, buf, len, slice.file_offset) : 0;
+    data_file_slice_release(&slice);
+    if (read_octets > 0)
+    {
+        *offset += read_octets;
+    }
+    return read_octets;
+}
+
+int data_file_send(int sock_fd, off_t *offset, off_t end)
+{
+    if (end < 0)
+    {
+        end = data_file_committed();
+    }
+    while (*offset < end)
+    {
+        data_file_slice_t slice;
+        if (data_file_slice(offset, end, &slice) == -1)
+        {
+            return -1;
+        }
+        off_t file_offset = slice.file_offset;
+        int status = readback_sendfile(sock_fd, slice.fd, &file_offset, slice.file_offset + slice.len);
+        data_file_slice_release(&slice);
+        *offset += file_offset - slice.file_offset;
+        if (status != READBACK_DONE)
+        {
+            return status;
+        }
+        if (file_offset == slice.file_offset)
+        {
+            /* Nothing left below end, the file is shorter than its reservations */
+            break;
+        }
+    }
+    return READBACK_DONE;
+}
+
+int data_file_record(uint32_t record, off_t *start, off_t *end)
+{
+    return segmented ? segment_record(record, start, end) : scan_record(record, start, end);
+}
@@ -0,0 +1,141 @@
+/**
+ * @file data-file.h
+ * @brief Lock-free appends to the data file (file backend)
+ *
+ * An append reserves its byte range with an atomic fetch-add on the logical
+ * tail and writes it with pwrite(), so appends from different threads reach
+ * the file in parallel. A range is published by advancing the committed
+ * watermark, in reservation order. Readers only look below the watermark and
+ * never see a range that is reserved but not written yet.
+ *
+ * With -r the data is split into segment files DATA_FILE_PATH.<base offset>, each
+ * with a sidecar index DATA_FILE_PATH.<base offset>.idx holding the position of
+ * every line that starts in the segment. Offsets stay logical, they keep
+ * growing across segments, and the oldest segments are retired by count or
+ * age. Readers never see a file descriptor of their own: they pin the slice
+ * of the segment an offset falls in, so a retired segment stays readable until
+ * its last reader lets go.
+ */
+#ifndef DATA_FILE_H
+#define DATA_FILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+struct data_segment;
+
+/**
+ * @brief Part of the data one descriptor can serve, pinned until data_file_slice_release()
+ */
+typedef struct data_file_slice {
+    int fd;                     /* descriptor to read from */
+    off_t file_offset;          /* position of the requested logical offset in fd */
+    off_t len;                  /* bytes readable from file_offset before the end or the next segment */
+    struct data_segment *segment; /* NULL with a single data file */
+} data_file_slice_t;
+
+/**
+ * @brief Start appending to fd, opened without O_APPEND (pwrite ignores the offset
+ *        of O_APPEND descriptors). The current file size becomes the watermark
+ *
+ * @return 0 on success, -1 if the file size can't be read
+ */
+int data_file_init(int fd);
+
+/**
+ * @brief Start appending to segment files named after path, picking up the segments
+ *        a previous run left behind. Their indexes are rebuilt, the index of a crashed
+ *        run may miss the last records
+ *
+ * @param path      [IN]  prefix of the segment files
+ *
+ * @return 0 on success, -1 if no segment can be created
+ */
+int data_file_init_segments(const char *path);
+
+/**
+ * @brief Close and delete every segment and its index, nothing may append or read anymore
+ */
+void data_file_remove_segments(void);
+
+/**
+ * @brief Append and publish bytes, also mirrored into the append log with -m
+ *
+ * @return data file length once the append is published, i.e. the readback bound
+ *         of this append, -1 if the write failed. After a failed write nothing more
+ *         is published and every append returns -1
+ */
+off_t data_file_append(const char *buf, size_t len);
+
+/**
+ * @brief data_file_append() of a gather list, written with one pwritev()
+ */
+off_t data_file_appendv(const struct iovec *iov, int iov_count);
+
+/**
+ * @brief Append a packet whose head was staged in a file, the staged bytes are copied
+ *        in the kernel and the whole packet is published at once, like one append
+ *
+ * @param stage_fd  [IN]  file holding the first stage_len bytes of the packet
+ * @param stage_len [IN]  number of staged bytes
+ * @param tail      [IN]  rest of the packet, up to its newline
+ * @param tail_len  [IN]  length of tail
+ *
+ * @return data_file_append() result
+ */
+off_t data_file_append_staged(int stage_fd, off_t stage_len, const char *tail, size_t tail_len);
+
+/**
+ * @brief Length of the data file every reader may send
+ */
+off_t data_file_committed(void);
+
+/**
+ * @brief Lowest offset still stored, 0 unless segments were retired
+ */
+off_t data_file_start(void);
+
+/**
+ * @brief Pin the data at a logical offset
+ *
+ * @param offset    [IN/OUT] offset to read from, moved up to data_file_start() if it was retired
+ * @param end       [IN]  offset the read stops at
+ * @param slice     [OUT] descriptor and range to read, release it once read
+ *
+ * @return 0 on success, -1 if the data can't be reached
+ */
+int data_file_slice(off_t *offset, off_t end, data_file_slice_t *slice);
+
+void data_file_slice_release(data_file_slice_t *slice);
+
+/**
+ * @brief pread() of the committed data at a logical offset, stops at the end of a segment
+ *
+ * @param offset    [IN/OUT] advanced by the bytes read, moved up if it was retired
+ *
+ * @return bytes read, 0 at the committed end, -1 on error
+ */
+ssize_t data_file_pread(void *buf, size_t len, off_t *offset);
+
+/**
+ * @brief readback_sendfile() of the range [*offset, end), segment after segment
+ *
+ * @return readback_sendfile() result, *offset is advanced by the bytes sent
+ */
+int data_file_send(int sock_fd, off_t *offset, off_t end);
+
+/**
+ * @brief Locate a newline terminated line of the stored data, through the segment
+ *        indexes with -r, by scanning the data file otherwise
+ *
+ * @param record    [IN]  line number, 0 is the first line still stored
+ * @param start     [OUT] offset of the first byte of the line
+ * @param end       [OUT] offset just past its newline
+ *
+ * @return 0 if found, 1 if there is no such complete line, -1 on a read error
+ */
+int data_file_record(uint32_t record, off_t *start, off_t *end);
+
+#endif /*DATA_FILE_H*/
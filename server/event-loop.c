@@ -0,0 +1,1071 @@
+/**
+ * @file event-loop.c
+ * @brief epoll based connection engine for aesdsocket
+ *
+ * Every connection is a small state machine that lives in a preallocated slot:
+ *   CONN_RECEIVING: bytes are appended to the receive buffer until a newline
+ *                   frames a packet, which is then appended to the storage backend
+ *   CONN_READBACK:  the whole data file is streamed back to the client, the
+ *                   connection waits for EPOLLOUT whenever the socket is full
+ *   CONN_DISPATCHED: with a worker pool the append and the first readback pass
+ *                   run as a job on a worker, or the packet waits for its group
+ *                   commit batch. The connection is out of epoll until the
+ *                   worker or the writer hands it back through the loop wake fd
+ *   CONN_REPLYING:  binary protocol replies (see binproto.h) wait for EPOLLOUT,
+ *                   nothing more is received until they drain below the -q low
+ *                   watermark
+ * A connection waiting for EPOLLOUT is a paused consumer: it is not read until
+ * its output drains, so it only ever holds one readback chunk or one high
+ * watermark of replies. With a -S drop or disconnect policy the loop wakes every
+ * quarter of the stall timeout and applies the policy to the connections whose
+ * socket took nothing for the whole timeout.
+ * Idle connections hold no buffers so the memory footprint is bounded by the
+ * connection table plus the buffers of clients that are actively transferring.
+ */
+/*--------------------------------- Private includes ---------------------------------*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <pthread.h>
+#include "aesdsocket.h"
+#include "event-loop.h"
+#include "work-pool.h"
+#include "append-log.h"
+#include "framing.h"
+#include "group-commit.h"
+#include "data-file.h"
+#include "rx-buffer.h"
+#include "metrics.h"
+#include "binproto.h"
+#include "log-ring.h"
+#include "storage.h"
+#include "readback-cache.h"
+#include "zerocopy.h"
+#include "probes.h"
+/*--------------------------------- Private definitions ---------------------------------  */
+#define EVENT_MAX_EVENTS                        256
+#define EVENT_TX_CHUNK                          (16 * MAXDATASIZE)
+#define EVENT_SPARE_FDS                         64
+/* job_status of a connection handed back by the group commit writer */
+#define CONN_JOB_COMMITTED                      2
+
+typedef enum {
+    CONN_FREE = 0,
+    CONN_RECEIVING,
+    CONN_READBACK,
+    CONN_DISPATCHED,
+    CONN_REPLYING,
+} conn_state_t;
+
+struct event_loop;
+
+/**
+ * @brief Connection slot, owned by exactly one loop
+ */
+typedef struct connection {
+    int fd;
+    conn_state_t state;
+    uint32_t events;            /* interest currently registered in epoll, 0 if not registered */
+    struct event_loop *loop;
+    rx_buffer_t rx;             /* received bytes not yet consumed, pooled, empty when idle */
+    size_t rx_scanned;          /* unconsumed bytes already known to hold no newline */
+    size_t packet_len;          /* length of the packet being processed including '\n' */
+    storage_stage_t stage;      /* head of a packet longer than -B, written out as it arrived */
+    storage_handle_t store;     /* storage of the connection, opened by the first packet */
+    off_t rb_offset;
+    off_t rb_end;               /* offset the readback stops at, -1 for the end of the data */
+    int rb_from_log;            /* the readback sends rb_cursor instead of the stored data */
+    append_log_cursor_t rb_cursor;
+    struct readback_snapshot *rb_snapshot;  /* shared snapshot the readback sends, NULL reads the storage */
+    zerocopy_t zc;              /* buffers pinned by the MSG_ZEROCOPY readbacks (-Z) */
+    char *tx_pending;           /* part of a readback chunk the socket did not accept */
+    size_t tx_len;
+    size_t tx_sent;
+    unsigned long rb_sent;      /* bytes the readback of the current packet sent so far */
+    uint64_t first_byte_ns;     /* metrics_now() when the current packet started arriving */
+    uint64_t recv_ns;           /* metrics_now() of the last receive */
+    int job_status;             /* conn_readback() result of the pool job, or CONN_JOB_COMMITTED */
+    group_commit_request_t commit;
+    binproto_session_t bin;     /* protocol of the connection, binary replies not sent yet */
+    uint64_t tx_progress_ns;    /* loop_clock_ns() of the last send progress while EPOLLOUT is awaited */
+    struct connection *nxt_free;
+    struct connection *nxt_done;
+} connection_t;
+
+/**
+ * @brief Per thread loop context
+ */
+typedef struct event_loop {
+    pthread_t thread_id;
+    int epoll_fd;
+    int listen_fd;
+    int wake_fd;                /* signalled by workers returning connections */
+    pthread_mutex_t done_lock;
+    connection_t *done_list;
+    connection_t *free_list;
+    unsigned int active;
+    connection_t *slots;        /* connection slots owned by the loop, scanned for stalled clients */
+    unsigned int slot_count;
+    char tx_scratch[EVENT_TX_CHUNK];
+} event_loop_t;
+/*---------------------------------- Private Variables ----------------------------------  */
+static int stop_event_fd = UNINIT_VALUE;
+/* Addresses used as epoll tags for the non connection descriptors */
+static char listen_tag;
+static char stop_tag;
+static int pool_enabled;
+/*--------------------------------- Private Functions ---------------------------------  */
+/**
+ * @brief Monotonic clock of the stall timeouts, metrics_now() reads 0 when metrics are off
+ */
+static uint64_t loop_clock_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/**
+ * @brief Update the epoll interest of a connection if it changed
+ */
+static int conn_set_interest(event_loop_t *loop, connection_t *conn, uint32_t events)
+{
+    if (conn->events == events)
+    {
+        return 0;
+    }
+    struct epoll_event ev = { .events = events | EPOLLRDHUP, .data.ptr = conn };
+    int op = (conn->events == 0) ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+    if (epoll_ctl(loop->epoll_fd, op, conn->fd, &ev) == -1)
+    {
+        aesd_log(LOG_ERR, "epoll_ctl failed: %s\n", strerror(errno));
+        return -1;
+    }
+    conn->events = events;
+    return 0;
+}
+
+/**
+ * @brief Release the descriptors and buffers held by a connection slot
+ */
+static void conn_release(connection_t *conn)
+{
+    zerocopy_release(&conn->zc, 0);
+    close(conn->fd);
+    storage_close(&conn->store);
+    storage_stage_discard(&conn->stage);
+    append_log_release(&conn->rb_cursor);
+    readback_cache_put(conn->rb_snapshot);
+    rx_buffer_release(&conn->rx);
+    binproto_session_release(&conn->bin);
+    free(conn->tx_pending);
+    memset(conn, 0, sizeof(*conn));
+    conn->state = CONN_FREE;
+}
+
+static void conn_close(event_loop_t *loop, connection_t *conn)
+{
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    conn_release(conn);
+    conn->nxt_free = loop->free_list;
+    loop->free_list = conn;
+    loop->active--;
+    metrics_add(METRIC_CLOSED, 1);
+    aesd_log(LOG_INFO, "Closed connection from client\n");
+}
+
+/**
+ * @brief Give a parked connection back to its loop, called from workers and the writer
+ */
+static void conn_hand_back(connection_t *conn)
+{
+    event_loop_t *loop = conn->loop;
+
+    pthread_mutex_lock(&loop->done_lock);
+    conn->nxt_done = loop->done_list;
+    loop->done_list = conn;
+    pthread_mutex_unlock(&loop->done_lock);
+
+    uint64_t one = 1;
+    ssize_t ignored = write(loop->wake_fd, &one, sizeof one);
+    (void) ignored;
+}
+
+/**
+ * @brief Take the connection out of epoll while a worker or the writer owns it
+ */
+static void conn_park(event_loop_t *loop, connection_t *conn)
+{
+    if (conn->events != 0)
+    {
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+        conn->events = 0;
+    }
+    conn->state = CONN_DISPATCHED;
+}
+
+/**
+ * @brief Pin the append log or the shared snapshot for the readback, bounded by the
+ *        committed length
+ */
+static void conn_prepare_readback(connection_t *conn)
+{
+    conn->rb_offset = conn->store.position;
+    AESD_PROBE3(readback_start, conn->fd, conn->rb_offset, conn->rb_end);
+    conn->rb_from_log = server_config.use_log && append_log_snapshot(&conn->rb_cursor) == 0;
+    if (conn->rb_from_log && conn->rb_end >= 0 && conn->rb_cursor.remaining > (size_t) conn->rb_end)
+    {
+        conn->rb_cursor.remaining = conn->rb_end;
+    }
+    if (!conn->rb_from_log && server_config.readback_cache_size > 0)
+    {
+        conn->rb_snapshot = readback_cache_get(&conn->store, conn->rb_offset, conn->rb_end);
+    }
+}
+
+static void conn_commit_done(group_commit_request_t *req)
+{
+    connection_t *conn = (connection_t *) req->arg;
+    conn->rb_end = req->committed_len;
+    conn->job_status = (req->status == 0) ? CONN_JOB_COMMITTED : -1;
+    AESD_PROBE3(append_done, conn->fd, conn->packet_len, conn->rb_end);
+    conn_hand_back(conn);
+}
+
+/**
+ * @brief Append the framed packet to the storage, or apply it as a seek command,
+ *        and position the readback
+ *
+ * @param conn          [IN]  connection holding a framed packet
+ * @param may_block     [IN]  wait for the group commit batch (pool workers) instead of
+ *                            queueing the packet and handing the connection back later
+ *
+ * @return 0 when the readback can start, 1 if the packet was queued on the group
+ *         commit writer, -1 on error
+ */
+static int conn_commit_packet(connection_t *conn, int may_block)
+{
+    /* The device is opened by the first packet and kept until the connection closes */
+    if (storage_open(&conn->store) == -1)
+    {
+        return -1;
+    }
+    conn->rb_end = -1;
+    if (conn->stage.len > 0)
+    {
+        /* The newline of a staged packet, committed on its own outside the group commit */
+        off_t staged_len = conn->stage.len;
+        if (storage_stage_commit(&conn->store, &conn->stage, rx_buffer_head(&conn->rx), conn->packet_len,
+                                 &conn->rb_end) == -1)
+        {
+            return -1;
+        }
+        AESD_PROBE3(append_done, conn->fd, staged_len + conn->packet_len, conn->rb_end);
+        conn_prepare_readback(conn);
+        return 0;
+    }
+    if ((storage->flags & STORAGE_SEEK_COMMANDS) &&
+        Check_seekCmd(rx_buffer_head(&conn->rx), &conn->store) == EXIT_SUCCESS)
+    {
+        conn_prepare_readback(conn);
+        return 0;
+    }
+    if (server_config.group_commit)
+    {
+        /* Only the data file has a writer, its readbacks start at the oldest segment */
+        conn->store.position = data_file_start();
+        if (!may_block)
+        {
+            conn->commit.buf = rx_buffer_head(&conn->rx);
+            conn->commit.len = conn->packet_len;
+            conn->commit.on_commit = conn_commit_done;
+            conn->commit.arg = conn;
+            return (group_commit_submit(&conn->commit) == 0) ? 1 : -1;
+        }
+        if (group_commit_append(rx_buffer_head(&conn->rx), conn->packet_len, &conn->rb_end) == -1)
+        {
+            return -1;
+        }
+    }
+    else if (storage->append(&conn->store, rx_buffer_head(&conn->rx), conn->packet_len, &conn->rb_end) == -1)
+    {
+        return -1;
+    }
+    AESD_PROBE3(append_done, conn->fd, conn->packet_len, conn->rb_end);
+    conn_prepare_readback(conn);
+    return 0;
+}
+
+/**
+ * @brief Pull the next readback chunk and advance rb_offset, the shared data file is
+ *        only accessed through pread so loops never race on its offset
+ */
+static ssize_t conn_readback_fill(connection_t *conn, char *buf, size_t len)
+{
+    if (conn->rb_end >= 0 && conn->rb_end - conn->rb_offset < (off_t) len)
+    {
+        len = (conn->rb_end > conn->rb_offset) ? conn->rb_end - conn->rb_offset : 0;
+    }
+    return (len > 0) ? storage->read(&conn->store, buf, len, &conn->rb_offset) : 0;
+}
+
+/**
+ * @brief Stream the data file to the client without blocking, with sendfile() when the
+ *        file can be spliced and through the scratch buffer otherwise
+ *
+ * @return 1 when the readback is complete, 0 if the socket is full, -1 on error
+ */
+static int conn_readback_stream(connection_t *conn, char *scratch, size_t scratch_len)
+{
+    if (conn->rb_from_log)
+    {
+        int status = append_log_send(conn->fd, &conn->rb_cursor, &conn->zc);
+        return (status == READBACK_DONE) ? 1 : (status == READBACK_WOULD_BLOCK) ? 0 : -1;
+    }
+    if (conn->rb_snapshot != NULL)
+    {
+        int status = readback_cache_send(conn->fd, conn->rb_snapshot, &conn->rb_offset, conn->rb_end, &conn->zc);
+        return (status == READBACK_DONE) ? 1 : (status == READBACK_WOULD_BLOCK) ? 0 : -1;
+    }
+    if (conn->tx_len == 0 && storage->send != NULL)
+    {
+        int status = storage->send(&conn->store, conn->fd, &conn->rb_offset, conn->rb_end);
+        if (status == READBACK_DONE)
+        {
+            return 1;
+        }
+        if (status == READBACK_WOULD_BLOCK)
+        {
+            return 0;
+        }
+        if (status == -1)
+        {
+            return -1;
+        }
+    }
+
+    for (;;)
+    {
+        if (conn->tx_sent < conn->tx_len)
+        {
+            ssize_t sent = send(conn->fd, conn->tx_pending + conn->tx_sent, conn->tx_len - conn->tx_sent, MSG_NOSIGNAL);
+            if (sent == -1)
+            {
+                return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+            }
+            metrics_add(METRIC_BYTES_OUT, sent);
+            conn->tx_sent += sent;
+            if (conn->tx_sent < conn->tx_len)
+            {
+                return 0;
+            }
+            free(conn->tx_pending);
+            conn->tx_pending = NULL;
+            conn->tx_len = conn->tx_sent = 0;
+        }
+
+        ssize_t read_octets = conn_readback_fill(conn, scratch, scratch_len);
+        if (read_octets == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (read_octets <= 0)
+        {
+            return 1;
+        }
+
+        ssize_t sent = send(conn->fd, scratch, read_octets, MSG_NOSIGNAL);
+        if (sent == -1)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            {
+                return -1;
+            }
+            sent = 0;
+        }
+        metrics_add(METRIC_BYTES_OUT, sent);
+        if (sent < read_octets)
+        {
+            /* Keep only the unsent tail, the scratch buffer belongs to the thread */
+            conn->tx_len = read_octets - sent;
+            conn->tx_sent = 0;
+            conn->tx_pending = malloc(conn->tx_len);
+            if (conn->tx_pending == NULL)
+            {
+                aesd_log(LOG_ERR, "malloc failed\n");
+                return -1;
+            }
+            memcpy(conn->tx_pending, scratch + sent, conn->tx_len);
+            return 0;
+        }
+    }
+}
+
+/**
+ * @brief conn_readback_stream() accounting what it sent to the packet, the readback of
+ *        a packet may be continued by another thread than the one that started it
+ */
+static int conn_readback(connection_t *conn, char *scratch, size_t scratch_len)
+{
+    unsigned long sent_before = metrics_thread_value(METRIC_BYTES_OUT);
+    int status = conn_readback_stream(conn, scratch, scratch_len);
+    conn->rb_sent += metrics_thread_value(METRIC_BYTES_OUT) - sent_before;
+    return status;
+}
+
+static void conn_finish_packet(connection_t *conn)
+{
+    AESD_PROBE2(readback_done, conn->fd, conn->rb_sent);
+    metrics_packet_done(conn->first_byte_ns, conn->rb_sent);
+    conn->rb_sent = 0;
+    /* Bytes left in the buffer arrived with the last receive at the latest */
+    conn->first_byte_ns = conn->recv_ns;
+    append_log_release(&conn->rb_cursor);
+    conn->rb_from_log = 0;
+    readback_cache_put(conn->rb_snapshot);
+    conn->rb_snapshot = NULL;
+    rx_buffer_consume(&conn->rx, conn->packet_len, 1);
+    conn->rx_scanned = 0;
+    conn->packet_len = 0;
+    conn->state = CONN_RECEIVING;
+}
+
+/**
+ * @brief Worker side of a dispatched packet: append it and start the readback
+ */
+static void conn_packet_job(void *arg)
+{
+    static __thread char worker_scratch[EVENT_TX_CHUNK];
+    connection_t *conn = (connection_t *) arg;
+
+    conn->job_status = -1;
+    if (conn_commit_packet(conn, 1) == 0)
+    {
+        conn->state = CONN_READBACK;
+        conn->job_status = conn_readback(conn, worker_scratch, sizeof(worker_scratch));
+    }
+    conn_hand_back(conn);
+}
+
+/**
+ * @brief Hand the framed packet to the worker pool
+ *
+ * @return 0 if a worker owns the connection now, -1 if the pool is saturated and
+ *         the loop has to process the packet itself
+ */
+static int conn_dispatch(event_loop_t *loop, connection_t *conn)
+{
+    conn_park(loop, conn);
+    if (work_pool_submit(conn_packet_job, conn) == 0)
+    {
+        return 0;
+    }
+    conn->state = CONN_RECEIVING;
+    return -1;
+}
+
+static int conn_process(event_loop_t *loop, connection_t *conn);
+
+/**
+ * @brief conn_process() of the binary protocol, also settles the protocol of a new
+ *        connection. The commands run on the loop itself: neither the worker pool nor
+ *        the asynchronous group commit is used, an append waits for its batch
+ */
+static int conn_process_binary(event_loop_t *loop, connection_t *conn)
+{
+    if (conn->bin.mode == BINPROTO_MODE_UNKNOWN)
+    {
+        ssize_t hello_len = binproto_negotiate(&conn->bin, rx_buffer_head(&conn->rx), rx_buffer_pending(&conn->rx));
+        if (hello_len == BINPROTO_HELLO_INCOMPLETE)
+        {
+            return conn_set_interest(loop, conn, EPOLLIN);
+        }
+        if (hello_len == -1)
+        {
+            return -1;
+        }
+        if (hello_len == 0)
+        {
+            return conn_process(loop, conn);
+        }
+        rx_buffer_consume(&conn->rx, hello_len, 0);
+    }
+    for (;;)
+    {
+        int status = binproto_flush(&conn->bin, conn->fd);
+        if (status == -1)
+        {
+            return -1;
+        }
+        /* Between the watermarks the commands keep running while the replies drain */
+        if (status == 0 && binproto_pending(&conn->bin) > server_config.tx_low_water)
+        {
+            conn->state = CONN_REPLYING;
+            return conn_set_interest(loop, conn, EPOLLOUT);
+        }
+        conn->state = CONN_RECEIVING;
+
+        size_t commands;
+        ssize_t consumed = (storage_open(&conn->store) == -1) ? -1 :
+                           binproto_process(&conn->bin, &conn->store, rx_buffer_head(&conn->rx), rx_buffer_pending(&conn->rx), &commands);
+        if (consumed == -1)
+        {
+            return -1;
+        }
+        if (consumed == 0)
+        {
+            break;
+        }
+        rx_buffer_consume(&conn->rx, consumed, commands);
+    }
+    if (rx_buffer_pending(&conn->rx) == 0)
+    {
+        rx_buffer_release(&conn->rx);
+    }
+    return conn_set_interest(loop, conn, EPOLLIN | ((binproto_pending(&conn->bin) > 0) ? EPOLLOUT : 0));
+}
+
+/**
+ * @brief Run the connection state machine as far as it goes without blocking.
+ *        Every complete packet in the receive buffer is committed in order.
+ */
+static int conn_process(event_loop_t *loop, connection_t *conn)
+{
+    if (conn->bin.mode != BINPROTO_MODE_TEXT)
+    {
+        return conn_process_binary(loop, conn);
+    }
+    for (;;)
+    {
+        if (conn->state == CONN_READBACK)
+        {
+            int status = conn_readback(conn, loop->tx_scratch, sizeof(loop->tx_scratch));
+            if (status == 0)
+            {
+                return conn_set_interest(loop, conn, EPOLLOUT);
+            }
+            if (status == -1)
+            {
+                return -1;
+            }
+            conn_finish_packet(conn);
+        }
+
+        char *head = rx_buffer_head(&conn->rx);
+        size_t pending = rx_buffer_pending(&conn->rx);
+        const char *newline_pos = framing_find_newline(head + conn->rx_scanned, pending - conn->rx_scanned);
+        if (newline_pos == NULL)
+        {
+            conn->rx_scanned = pending;
+            if (server_config.packet_buffer_limit > 0 && pending >= server_config.packet_buffer_limit)
+            {
+                /* No newline in sight, stream the packet out instead of growing the buffer */
+                if (storage_stage_write(&conn->stage, head, pending) == -1)
+                {
+                    return -1;
+                }
+                rx_buffer_consume(&conn->rx, pending, 0);
+                conn->rx_scanned = 0;
+            }
+            break;
+        }
+        conn->packet_len = newline_pos - head + 1;
+        AESD_PROBE3(packet_framed, conn->fd, 1, conn->packet_len);
+        if (pool_enabled && conn_dispatch(loop, conn) == 0)
+        {
+            return 0;
+        }
+        int status = conn_commit_packet(conn, 0);
+        if (status == -1)
+        {
+            return -1;
+        }
+        if (status == 1)
+        {
+            /* The writer hands the connection back to this loop once its batch is on disk */
+            conn_park(loop, conn);
+            return 0;
+        }
+        conn->state = CONN_READBACK;
+    }
+
+    if (rx_buffer_pending(&conn->rx) == 0)
+    {
+        /* Idle connections give their buffer back to the pool */
+        rx_buffer_release(&conn->rx);
+    }
+    return conn_set_interest(loop, conn, EPOLLIN);
+}
+
+static int conn_on_readable(event_loop_t *loop, connection_t *conn)
+{
+    if (rx_buffer_reserve(&conn->rx, RX_BUFFER_MIN_FREE) == -1)
+    {
+        return -1;
+    }
+
+    ssize_t recv_octets = recv(conn->fd, conn->rx.data + conn->rx.len, conn->rx.cap - conn->rx.len - 1, 0);
+    if (recv_octets == 0)
+    {
+        return -1;
+    }
+    if (recv_octets == -1)
+    {
+        return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+    }
+    conn->recv_ns = metrics_now();
+    if (rx_buffer_pending(&conn->rx) == 0 && conn->stage.len == 0)
+    {
+        conn->first_byte_ns = conn->recv_ns;
+    }
+    metrics_add(METRIC_BYTES_IN, recv_octets);
+    conn->rx.len += recv_octets;
+    conn->rx.data[conn->rx.len] = '\0';
+    return conn_process(loop, conn);
+}
+
+/**
+ * @brief Restart the stall clock of a connection that just started waiting for EPOLLOUT
+ *        or whose socket took some bytes since the last event
+ *
+ * @param conn          [IN]  connection after it was processed
+ * @param was_waiting   [IN]  EPOLLOUT was awaited before the processing
+ * @param sent_before   [IN]  metrics_thread_value(METRIC_BYTES_OUT) before the processing
+ */
+static void conn_track_stall(connection_t *conn, int was_waiting, unsigned long sent_before)
+{
+    if (server_config.slow_policy == SLOW_CONSUMER_PAUSE || conn->state == CONN_FREE || !(conn->events & EPOLLOUT))
+    {
+        return;
+    }
+    if (!was_waiting || metrics_thread_value(METRIC_BYTES_OUT) != sent_before)
+    {
+        conn->tx_progress_ns = loop_clock_ns();
+    }
+}
+
+static void conn_on_event(event_loop_t *loop, connection_t *conn, uint32_t events)
+{
+    int status = 0;
+    int was_waiting = (conn->events & EPOLLOUT) != 0;
+    unsigned long sent_before = metrics_thread_value(METRIC_BYTES_OUT);
+
+    if (conn->state == CONN_DISPATCHED)
+    {
+        /* Stale event reported in the same batch the connection was dispatched */
+        return;
+    }
+    if ((events & EPOLLERR) && zerocopy_reap(&conn->zc) <= 0)
+    {
+        /* Zerocopy completions are queued as socket errors, anything else is fatal */
+        status = -1;
+    }
+    else if (conn->state == CONN_READBACK || conn->state == CONN_REPLYING)
+    {
+        if (events & (EPOLLOUT | EPOLLHUP))
+        {
+            status = conn_process(loop, conn);
+        }
+    }
+    else if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP))
+    {
+        status = conn_on_readable(loop, conn);
+    }
+    else if (events & EPOLLOUT)
+    {
+        /* Binary replies drained while commands may still run */
+        status = conn_process(loop, conn);
+    }
+
+    if (status == -1)
+    {
+        conn_close(loop, conn);
+        return;
+    }
+    conn_track_stall(conn, was_waiting, sent_before);
+}
+
+/**
+ * @brief Apply the slow consumer policy to the connections whose socket took nothing
+ *        for the stall timeout
+ */
+static void loop_scan_stalled(event_loop_t *loop, uint64_t now_ns)
+{
+    uint64_t timeout_ns = (uint64_t) server_config.stall_timeout_ms * 1000000ULL;
+
+    for (unsigned int slot = 0; slot < loop->slot_count; slot++)
+    {
+        connection_t *conn = &loop->slots[slot];
+        if (conn->state == CONN_FREE || conn->state == CONN_DISPATCHED || !(conn->events & EPOLLOUT) ||
+            now_ns - conn->tx_progress_ns < timeout_ns)
+        {
+            continue;
+        }
+        /* Only a text readback can be abandoned, binary replies are part of the framing */
+        int droppable = (conn->state == CONN_READBACK);
+        int status = slow_consumer_stalled(conn->fd, droppable);
+        if (status == 0)
+        {
+            free(conn->tx_pending);
+            conn->tx_pending = NULL;
+            conn->tx_len = conn->tx_sent = 0;
+            conn_finish_packet(conn);
+            status = conn_process(loop, conn);
+            conn->tx_progress_ns = now_ns;
+        }
+        if (status == -1)
+        {
+            conn_close(loop, conn);
+        }
+    }
+}
+
+/**
+ * @brief Take back the connections whose pool job finished
+ */
+static void loop_collect_done(event_loop_t *loop)
+{
+    uint64_t count;
+    ssize_t ignored = read(loop->wake_fd, &count, sizeof count);
+    (void) ignored;
+
+    pthread_mutex_lock(&loop->done_lock);
+    connection_t *conn = loop->done_list;
+    loop->done_list = NULL;
+    pthread_mutex_unlock(&loop->done_lock);
+
+    while (conn != NULL)
+    {
+        connection_t *nxt_done = conn->nxt_done;
+        int status = -1;
+
+        conn->nxt_done = NULL;
+        if (conn->job_status == CONN_JOB_COMMITTED)
+        {
+            conn_prepare_readback(conn);
+            conn->state = CONN_READBACK;
+            status = conn_process(loop, conn);
+        }
+        else if (conn->job_status == 1)
+        {
+            conn_finish_packet(conn);
+            status = conn_process(loop, conn);
+        }
+        else if (conn->job_status == 0)
+        {
+            status = conn_set_interest(loop, conn, EPOLLOUT);
+        }
+        if (status == -1)
+        {
+            conn_close(loop, conn);
+        }
+        else
+        {
+            /* Parked connections are out of epoll, their wait starts now */
+            conn_track_stall(conn, 0, 0);
+        }
+        conn = nxt_done;
+    }
+}
+
+static void loop_accept(event_loop_t *loop)
+{
+    for (;;)
+    {
+        char s[INET6_ADDRSTRLEN];
+        struct sockaddr_storage client_addr;
+        socklen_t sin_size = sizeof client_addr;
+        int client_fd = accept4(loop->listen_fd, (struct sockaddr *)&client_addr, &sin_size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EMFILE || errno == ENFILE)
+            {
+                aesd_log(LOG_ERR, "accept failed: %s\n", strerror(errno));
+            }
+            return;
+        }
+
+        connection_t *conn = loop->free_list;
+        if (conn == NULL)
+        {
+            aesd_log(LOG_ERR, "Connection table full, dropping client\n");
+            close(client_fd);
+            continue;
+        }
+        AESD_PROBE1(accept, client_fd);
+        loop->free_list = conn->nxt_free;
+        memset(conn, 0, sizeof(*conn));
+        conn->fd = client_fd;
+        conn->store.fd = UNINIT_VALUE;
+        conn->stage.fd = UNINIT_VALUE;
+        conn->state = CONN_RECEIVING;
+        conn->loop = loop;
+        configure_client_socket(client_fd, 0);
+        zerocopy_init(&conn->zc, client_fd);
+
+        if (conn_set_interest(loop, conn, EPOLLIN) == -1)
+        {
+            close(client_fd);
+            conn->state = CONN_FREE;
+            conn->nxt_free = loop->free_list;
+            loop->free_list = conn;
+            continue;
+        }
+        loop->active++;
+        metrics_add(METRIC_ACCEPTED, 1);
+        inet_ntop(client_addr.ss_family, get_in_addr((struct sockaddr *)&client_addr), s, sizeof s);
+        aesd_log(LOG_INFO, "Accepted connection from %s\n", s);
+    }
+}
+
+static void *event_loop_thread(void *arg)
+{
+    event_loop_t *loop = (event_loop_t *) arg;
+    struct epoll_event events[EVENT_MAX_EVENTS];
+    /* The pause policy never times a client out, nothing to wake up for */
+    int scan_ms = (server_config.slow_policy == SLOW_CONSUMER_PAUSE) ? -1 :
+                  (int) ((server_config.stall_timeout_ms + 3) / 4);
+    uint64_t next_scan_ns = (scan_ms == -1) ? UINT64_MAX : loop_clock_ns() + (uint64_t) scan_ms * 1000000ULL;
+
+    while (!shutdown_requested)
+    {
+        int num_events = epoll_wait(loop->epoll_fd, events, EVENT_MAX_EVENTS, scan_ms);
+        if (num_events == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            aesd_log(LOG_ERR, "epoll_wait failed: %s\n", strerror(errno));
+            break;
+        }
+        for (int i = 0; i < num_events; i++)
+        {
+            void *tag = events[i].data.ptr;
+            if (tag == &stop_tag)
+            {
+                goto loop_exit;
+            }
+            if (tag == &listen_tag)
+            {
+                loop_accept(loop);
+                continue;
+            }
+            if (tag == &loop->wake_fd)
+            {
+                loop_collect_done(loop);
+                continue;
+            }
+            conn_on_event(loop, (connection_t *) tag, events[i].events);
+        }
+        if (next_scan_ns != UINT64_MAX)
+        {
+            uint64_t now_ns = loop_clock_ns();
+            if (now_ns >= next_scan_ns)
+            {
+                loop_scan_stalled(loop, now_ns);
+                next_scan_ns = now_ns + (uint64_t) scan_ms * 1000000ULL;
+            }
+        }
+    }
+loop_exit:
+    return NULL;
+}
+
+/**
+ * @brief Make sure the process may hold one descriptor per connection slot
+ */
+static void raise_fd_limit(rlim_t wanted)
+{
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == -1 || limit.rlim_cur >= wanted)
+    {
+        return;
+    }
+    limit.rlim_cur = (wanted < limit.rlim_max) ? wanted : limit.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &limit) == -1)
+    {
+        aesd_log(LOG_ERR, "setrlimit failed: %s\n", strerror(errno));
+    }
+}
+/*--------------------------------- Public Functions ---------------------------------  */
+void event_loop_request_stop(void)
+{
+    if (stop_event_fd != UNINIT_VALUE)
+    {
+        uint64_t one = 1;
+        ssize_t ignored = write(stop_event_fd, &one, sizeof one);
+        (void) ignored;
+    }
+}
+
+int event_loop_run(const int *listen_fds, unsigned int num_listeners, unsigned int num_loops, unsigned int max_connections, unsigned int pool_workers)
+{
+    int retval = -1;
+    unsigned int started = 0;
+    event_loop_t *loops = NULL;
+    connection_t *conns = NULL;
+
+    if (num_loops == 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        num_loops = (cpus > 0) ? (unsigned int) cpus : 1;
+    }
+    /* A listener without a loop would strand the connections the kernel hashes to it */
+    if (num_loops < num_listeners)
+    {
+        num_loops = num_listeners;
+    }
+    if (max_connections < num_loops)
+    {
+        max_connections = num_loops;
+    }
+    raise_fd_limit(max_connections + EVENT_SPARE_FDS);
+
+    /* The backlog used by server_init() is sized for one accept per thread spawn */
+    for (unsigned int i = 0; i < num_listeners; i++)
+    {
+        listen(listen_fds[i], SOMAXCONN);
+        fcntl(listen_fds[i], F_SETFL, fcntl(listen_fds[i], F_GETFL) | O_NONBLOCK);
+    }
+
+    if (pool_workers > 0)
+    {
+        if (work_pool_init(pool_workers) == -1)
+        {
+            return -1;
+        }
+        pool_enabled = 1;
+    }
+
+    stop_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    loops = calloc(num_loops, sizeof(event_loop_t));
+    conns = calloc(max_connections, sizeof(connection_t));
+    if (stop_event_fd == -1 || loops == NULL || conns == NULL)
+    {
+        aesd_log(LOG_ERR, "Can't allocate the event loops\n");
+        goto func_exit;
+    }
+
+    for (unsigned int i = 0; i < num_loops; i++)
+    {
+        event_loop_t *loop = &loops[i];
+        unsigned int first = (unsigned int) (((unsigned long) max_connections * i) / num_loops);
+        unsigned int last = (unsigned int) (((unsigned long) max_connections * (i + 1)) / num_loops);
+
+        loop->listen_fd = listen_fds[i % num_listeners];
+        loop->slots = &conns[first];
+        loop->slot_count = last - first;
+        pthread_mutex_init(&loop->done_lock, NULL);
+        for (unsigned int slot = last; slot > first; slot--)
+        {
+            conns[slot - 1].nxt_free = loop->free_list;
+            loop->free_list = &conns[slot - 1];
+        }
+        loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (loop->epoll_fd == -1 || loop->wake_fd == -1)
+        {
+            aesd_log(LOG_ERR, "Can't create the loop descriptors: %s\n", strerror(errno));
+            goto func_exit;
+        }
+        /* EPOLLEXCLUSIVE wakes a single loop per incoming connection when loops share a listener */
+        struct epoll_event listen_ev = { .events = EPOLLIN | EPOLLEXCLUSIVE, .data.ptr = &listen_tag };
+        struct epoll_event stop_ev = { .events = EPOLLIN, .data.ptr = &stop_tag };
+        struct epoll_event wake_ev = { .events = EPOLLIN, .data.ptr = &loop->wake_fd };
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->listen_fd, &listen_ev) == -1 ||
+            epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, stop_event_fd, &stop_ev) == -1 ||
+            epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wake_fd, &wake_ev) == -1)
+        {
+            aesd_log(LOG_ERR, "epoll_ctl ADD failed: %s\n", strerror(errno));
+            goto func_exit;
+        }
+    }
+
+    if (shutdown_requested)
+    {
+        retval = 0;
+        goto func_exit;
+    }
+    for (started = 0; started < num_loops; started++)
+    {
+        if (pthread_create(&loops[started].thread_id, NULL, event_loop_thread, &loops[started]) != 0)
+        {
+            aesd_log(LOG_ERR, "Can't create event loop thread\n");
+            event_loop_request_stop();
+            break;
+        }
+        if (server_config.pin_cpus)
+        {
+            pin_thread_to_cpu(loops[started].thread_id, started);
+        }
+    }
+    aesd_log(LOG_INFO, "Started %u event loops for %u connections\n", started, max_connections);
+    retval = (started == num_loops) ? 0 : -1;
+
+func_exit:
+    for (unsigned int i = 0; i < started; i++)
+    {
+        pthread_join(loops[i].thread_id, NULL);
+    }
+    /* Workers and the writer may still own connections, let them finish before the slots are released */
+    if (pool_enabled)
+    {
+        work_pool_shutdown();
+        pool_enabled = 0;
+    }
+    group_commit_flush();
+    if (conns != NULL)
+    {
+        for (unsigned int slot = 0; slot < max_connections; slot++)
+        {
+            if (conns[slot].state != CONN_FREE)
+            {
+                conn_release(&conns[slot]);
+            }
+        }
+    }
+    if (loops != NULL)
+    {
+        for (unsigned int i = 0; i < num_loops; i++)
+        {
+            if (loops[i].epoll_fd > 0)
+            {
+                close(loops[i].epoll_fd);
+            }
+            if (loops[i].wake_fd > 0)
+            {
+                close(loops[i].wake_fd);
+            }
+            pthread_mutex_destroy(&loops[i].done_lock);
+        }
+    }
+    if (stop_event_fd != -1)
+    {
+        int fd = stop_event_fd;
+        stop_event_fd = UNINIT_VALUE;
+        close(fd);
+    }
+    free(conns);
+    free(loops);
+    return retval;
+}
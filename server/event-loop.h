@@ -0,0 +1,32 @@
+/**
+ * @file event-loop.h
+ * @brief epoll based connection engine for aesdsocket
+ *
+ * Each loop owns an epoll instance, a fixed slice of the connection table and
+ * the non-blocking sockets it accepted, so no connection state is ever shared
+ * between loops.
+ */
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+/**
+ * @brief Run the event loops until event_loop_request_stop() is called
+ *
+ * @param listen_fds        [IN]  listening sockets, switched to non-blocking mode. Loop i
+ *                                accepts from listen_fds[i % num_listeners]
+ * @param num_listeners     [IN]  number of listening sockets
+ * @param num_loops         [IN]  number of epoll threads, 0 uses one per online CPU
+ * @param max_connections   [IN]  total number of connection slots across all loops
+ * @param pool_workers      [IN]  size of the worker pool running the append and readback
+ *                                of complete packets, 0 keeps them on the loops
+ *
+ * @return 0 on a clean shutdown, -1 if the loops could not be started
+ */
+int event_loop_run(const int *listen_fds, unsigned int num_listeners, unsigned int num_loops, unsigned int max_connections, unsigned int pool_workers);
+
+/**
+ * @brief Wake every loop and make event_loop_run() return, async-signal-safe
+ */
+void event_loop_request_stop(void);
+
+#endif /*EVENT_LOOP_H*/
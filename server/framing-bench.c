@@ -0,0 +1,117 @@
+/**
+ * @file framing-bench.c
+ * @brief Microbenchmark of the newline scanners in framing.c
+ *
+ * A buffer of newline terminated packets is framed with every scanner the CPU
+ * supports, one framing_scan() pass per receive-sized chunk like the thread
+ * handler does. "scalar" is the memchr() loop.
+ *
+ * Usage: framing-bench [-s buffer_size_in_bytes] [-r receive_size_in_bytes]
+ */
+/*--------------------------------- Private includes ---------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include "framing.h"
+/*--------------------------------- Private definitions ---------------------------------  */
+#define DEFAULT_BUFFER_SIZE                     (64 * 1024 * 1024)
+#define DEFAULT_RECEIVE_SIZE                    (64 * 1024)
+#define PASSES                                  5
+/*--------------------------------- Private Functions ---------------------------------  */
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fill_packets(char *buf, size_t len, size_t packet_size)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        buf[i] = ((i + 1) % packet_size == 0) ? '\n' : (char) ('a' + i % 26);
+    }
+}
+
+static size_t bench_scan(const char *buf, size_t len, size_t receive_size, double *seconds)
+{
+    size_t packets = 0;
+    double start = now_seconds();
+    for (int pass = 0; pass < PASSES; pass++)
+    {
+        packets = 0;
+        for (size_t offset = 0; offset < len; offset += receive_size)
+        {
+            size_t frame_len = 0;
+            size_t chunk = (len - offset < receive_size) ? len - offset : receive_size;
+            packets += framing_scan(buf + offset, chunk, &frame_len);
+        }
+    }
+    *seconds = (now_seconds() - start) / PASSES;
+    return packets;
+}
+
+/*--------------------------------- Public Functions ---------------------------------  */
+int main(int argc, char **argv)
+{
+    static const char *impls[] = { "scalar", "sse2", "avx2" };
+    static const size_t packet_sizes[] = { 16, 64, 256, 1024, 16384 };
+    size_t buffer_size = DEFAULT_BUFFER_SIZE;
+    size_t receive_size = DEFAULT_RECEIVE_SIZE;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:r:")) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            buffer_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            receive_size = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-s buffer_size_in_bytes] [-r receive_size_in_bytes]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (buffer_size == 0 || receive_size == 0)
+    {
+        fprintf(stderr, "Sizes must be positive\n");
+        return EXIT_FAILURE;
+    }
+
+    char *buf = malloc(buffer_size);
+    if (buf == NULL)
+    {
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+
+    printf("impl,packet_size,scan_gb_s,mpackets_s\n");
+    for (size_t p = 0; p < sizeof(packet_sizes) / sizeof(packet_sizes[0]); p++)
+    {
+        fill_packets(buf, buffer_size, packet_sizes[p]);
+        size_t expected = buffer_size / packet_sizes[p];
+        for (size_t i = 0; i < sizeof(impls) / sizeof(impls[0]); i++)
+        {
+            double scan_time;
+            if (framing_select(impls[i]) == -1)
+            {
+                continue;
+            }
+            size_t scanned = bench_scan(buf, buffer_size, receive_size, &scan_time);
+            if (scanned != expected)
+            {
+                fprintf(stderr, "%s miscounted: %zu packets, expected %zu\n", impls[i], scanned, expected);
+                return EXIT_FAILURE;
+            }
+            printf("%s,%zu,%.2f,%.1f\n", impls[i], packet_sizes[p], buffer_size / scan_time / 1e9,
+                   scanned / scan_time / 1e6);
+        }
+    }
+    free(buf);
+    return EXIT_SUCCESS;
+}
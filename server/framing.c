@@ -0,0 +1,171 @@
+/**
+ * @file framing.c
+ * @brief Newline packet framing for the aesdsocket receive path
+ *
+ * Each vector scanner compares a whole register against '\n', turns the
+ * result into a bit mask and uses popcount/clz on it, so dense and sparse
+ * packets cost the same per byte, where a memchr() loop pays one call per
+ * packet. The tail shorter than a register falls back to the scalar code.
+ */
+/*--------------------------------- Private includes ---------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "framing.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FRAMING_HAVE_X86                        1
+#else
+#define FRAMING_HAVE_X86                        0
+#endif
+/*--------------------------------- Private definitions ---------------------------------  */
+typedef struct framing_impl {
+    const char *name;
+    size_t (*scan)(const char *buf, size_t len, size_t *frame_len);
+} framing_impl_t;
+/*--------------------------------- Private Functions ---------------------------------  */
+static size_t scan_scalar(const char *buf, size_t len, size_t *frame_len)
+{
+    size_t count = 0;
+    const char *pos = buf;
+    const char *end = buf + len;
+
+    while ((pos = memchr(pos, '\n', end - pos)) != NULL)
+    {
+        count++;
+        pos++;
+        *frame_len = pos - buf;
+    }
+    return count;
+}
+
+#if FRAMING_HAVE_X86
+__attribute__((target("sse2")))
+static size_t scan_sse2(const char *buf, size_t len, size_t *frame_len)
+{
+    const __m128i newline = _mm_set1_epi8('\n');
+    size_t count = 0;
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i chunk = _mm_loadu_si128((const __m128i *) (buf + i));
+        unsigned int mask = (unsigned int) _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline));
+        if (mask != 0)
+        {
+            count += __builtin_popcount(mask);
+            *frame_len = i + (31 - __builtin_clz(mask)) + 1;
+        }
+    }
+    size_t tail_len = 0;
+    size_t tail_count = scan_scalar(buf + i, len - i, &tail_len);
+    if (tail_count > 0)
+    {
+        *frame_len = i + tail_len;
+    }
+    return count + tail_count;
+}
+
+__attribute__((target("avx2")))
+static size_t scan_avx2(const char *buf, size_t len, size_t *frame_len)
+{
+    const __m256i newline = _mm256_set1_epi8('\n');
+    size_t count = 0;
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32)
+    {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *) (buf + i));
+        unsigned int mask = (unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, newline));
+        if (mask != 0)
+        {
+            count += __builtin_popcount(mask);
+            *frame_len = i + (31 - __builtin_clz(mask)) + 1;
+        }
+    }
+    size_t tail_len = 0;
+    size_t tail_count = scan_sse2(buf + i, len - i, &tail_len);
+    if (tail_count > 0)
+    {
+        *frame_len = i + tail_len;
+    }
+    return count + tail_count;
+}
+
+#endif /*FRAMING_HAVE_X86*/
+/*---------------------------------- Private Variables ----------------------------------  */
+static const framing_impl_t framing_impls[] = {
+    { "scalar", scan_scalar },
+#if FRAMING_HAVE_X86
+    { "sse2",   scan_sse2 },
+    { "avx2",   scan_avx2 },
+#endif
+};
+static const framing_impl_t *framing_active;
+/*--------------------------------- Private Functions ---------------------------------  */
+static int impl_supported(const framing_impl_t *impl)
+{
+#if FRAMING_HAVE_X86
+    __builtin_cpu_init();
+    if (strcmp(impl->name, "sse2") == 0)
+    {
+        return __builtin_cpu_supports("sse2");
+    }
+    if (strcmp(impl->name, "avx2") == 0)
+    {
+        return __builtin_cpu_supports("avx2");
+    }
+#endif
+    return strcmp(impl->name, "scalar") == 0;
+}
+
+/**
+ * @brief Pick the widest scanner the CPU supports, the result is the same whichever
+ *        thread wins the race on the first call
+ */
+static const framing_impl_t *framing_impl(void)
+{
+    const framing_impl_t *impl = framing_active;
+    if (impl == NULL)
+    {
+        impl = &framing_impls[0];
+        for (size_t i = 0; i < sizeof(framing_impls) / sizeof(framing_impls[0]); i++)
+        {
+            if (impl_supported(&framing_impls[i]))
+            {
+                impl = &framing_impls[i];
+            }
+        }
+        framing_active = impl;
+    }
+    return impl;
+}
+/*--------------------------------- Public Functions ---------------------------------  */
+const char *framing_find_newline(const char *buf, size_t len)
+{
+    /* glibc already dispatches memchr to its widest vector variant */
+    return memchr(buf, '\n', len);
+}
+
+size_t framing_scan(const char *buf, size_t len, size_t *frame_len)
+{
+    return framing_impl()->scan(buf, len, frame_len);
+}
+
+int framing_select(const char *name)
+{
+    for (size_t i = 0; i < sizeof(framing_impls) / sizeof(framing_impls[0]); i++)
+    {
+        if (strcmp(framing_impls[i].name, name) == 0 && impl_supported(&framing_impls[i]))
+        {
+            framing_active = &framing_impls[i];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+const char *framing_impl_name(void)
+{
+    return framing_impl()->name;
+}
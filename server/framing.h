@@ -0,0 +1,46 @@
+/**
+ * @file framing.h
+ * @brief Newline packet framing for the aesdsocket receive path
+ *
+ * framing_scan() uses SSE2 or AVX2 on x86 (selected at runtime from the CPU
+ * features) and memchr() everywhere else.
+ */
+#ifndef FRAMING_H
+#define FRAMING_H
+
+#include <stddef.h>
+
+/**
+ * @brief Find the first newline
+ *
+ * @return pointer to the first '\n' of buf[0..len), NULL if there is none
+ */
+const char *framing_find_newline(const char *buf, size_t len);
+
+/**
+ * @brief Count the complete packets of a receive buffer
+ *
+ * @param buf           [IN]  received bytes
+ * @param len           [IN]  number of bytes in buf
+ * @param frame_len     [OUT] length of the complete packets, up to and including the
+ *                            last newline. Untouched when no newline is found
+ *
+ * @return number of newlines, i.e. complete packets, in buf
+ */
+size_t framing_scan(const char *buf, size_t len, size_t *frame_len);
+
+/**
+ * @brief Force a scanner implementation, used by the benchmark
+ *
+ * @param name  [IN]  "scalar", "sse2" or "avx2"
+ *
+ * @return 0 on success, -1 if the implementation is not available on this CPU
+ */
+int framing_select(const char *name);
+
+/**
+ * @brief Name of the scanner in use
+ */
+const char *framing_impl_name(void);
+
+#endif /*FRAMING_H*/
@@ -0,0 +1,349 @@
+/**
+ * @file group-commit.c
+ * @brief Group commit stage appending the packets of all clients to the data file
+ *
+ * The queue is a Treiber stack: producers push with a CAS and the writer takes
+ * the whole stack with one exchange, then reverses it to restore arrival order.
+ * A producer that pushes on an empty stack signals the writer eventfd, so the
+ * writer only sleeps when nothing is queued and is never woken per packet.
+ *
+ * A batch is appended with data_file_appendv(), one reservation and one
+ * pwritev() for all of its packets.
+ */
+/*--------------------------------- Private includes ---------------------------------*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+#include <poll.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <syslog.h>
+#include <pthread.h>
+#include "aesdsocket.h"
+#include "data-file.h"
+#include "group-commit.h"
+#include "log-ring.h"
+/*--------------------------------- Private definitions ---------------------------------  */
+typedef struct group_commit {
+    pthread_t thread_id;
+    int wake_fd;
+    unsigned int max_batch;
+    unsigned int max_latency_us;
+    atomic_int running;
+    atomic_int stopping;
+    _Atomic(group_commit_request_t *) queue;
+    group_commit_request_t *pending;        /* writer side, arrival order */
+    group_commit_request_t *pending_tail;
+    unsigned int pending_count;
+    struct iovec *iov;
+    pthread_mutex_t stats_lock;
+    group_commit_stats_t stats;
+} group_commit_t;
+
+/**
+ * @brief Request used by group_commit_append() to wait on its own batch
+ */
+typedef struct sync_request {
+    group_commit_request_t req;
+    sem_t done;
+} sync_request_t;
+/*---------------------------------- Private Variables ----------------------------------  */
+static group_commit_t writer = {
+    .wake_fd = UNINIT_VALUE,
+    .stats_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+/*--------------------------------- Private Functions ---------------------------------  */
+/**
+ * @brief Move everything pushed so far to the end of the pending list
+ */
+static void writer_take_queue(void)
+{
+    group_commit_request_t *stack = atomic_exchange(&writer.queue, NULL);
+    group_commit_request_t *reversed = NULL;
+    group_commit_request_t *last = stack;
+
+    while (stack != NULL)
+    {
+        group_commit_request_t *next = stack->next;
+        stack->next = reversed;
+        reversed = stack;
+        stack = next;
+        writer.pending_count++;
+    }
+    if (reversed == NULL)
+    {
+        return;
+    }
+    if (writer.pending_tail != NULL)
+    {
+        writer.pending_tail->next = reversed;
+    }
+    else
+    {
+        writer.pending = reversed;
+    }
+    writer.pending_tail = last;
+}
+
+/**
+ * @brief Wait for a producer to signal the eventfd
+ *
+ * @param timeout_us    [IN]  -1 waits forever
+ */
+static void writer_wait(long timeout_us)
+{
+    struct pollfd pfd = { .fd = writer.wake_fd, .events = POLLIN };
+    struct timespec timeout = { .tv_sec = timeout_us / 1000000, .tv_nsec = (timeout_us % 1000000) * 1000 };
+    uint64_t count;
+
+    if (ppoll(&pfd, 1, (timeout_us < 0) ? NULL : &timeout, NULL) > 0)
+    {
+        ssize_t ignored = read(writer.wake_fd, &count, sizeof count);
+        (void) ignored;
+    }
+}
+
+static long elapsed_us(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000L + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+static unsigned int histogram_bucket(unsigned int batch)
+{
+    unsigned int bucket = 0;
+    while (bucket < GROUP_COMMIT_HISTOGRAM_BUCKETS - 1 && (1u << bucket) < batch)
+    {
+        bucket++;
+    }
+    return bucket;
+}
+
+/**
+ * @brief Append the first max_batch pending requests with one pwritev() and complete them
+ */
+static void writer_commit_batch(void)
+{
+    group_commit_request_t *batch = writer.pending;
+    group_commit_request_t *req = batch;
+    unsigned int count = 0;
+    size_t bytes = 0;
+
+    while (req != NULL && count < writer.max_batch)
+    {
+        writer.iov[count].iov_base = (void *) req->buf;
+        writer.iov[count].iov_len = req->len;
+        bytes += req->len;
+        count++;
+        req = req->next;
+    }
+    writer.pending = req;
+    if (req == NULL)
+    {
+        writer.pending_tail = NULL;
+    }
+    writer.pending_count -= count;
+
+    off_t committed_len = data_file_appendv(writer.iov, count);
+
+    pthread_mutex_lock(&writer.stats_lock);
+    writer.stats.batches++;
+    writer.stats.packets += count;
+    writer.stats.bytes += bytes;
+    writer.stats.histogram[histogram_bucket(count)]++;
+    if (count > writer.stats.max_batch)
+    {
+        writer.stats.max_batch = count;
+    }
+    pthread_mutex_unlock(&writer.stats_lock);
+
+    /* The batch is one contiguous range, each request ends where its own bytes do */
+    off_t request_end = committed_len - (off_t) bytes;
+    req = batch;
+    while (count-- > 0)
+    {
+        /* The callback may reuse the request, read the link first */
+        group_commit_request_t *next = req->next;
+        request_end += req->len;
+        req->status = (committed_len == -1) ? -1 : 0;
+        req->committed_len = (committed_len == -1) ? -1 : request_end;
+        req->on_commit(req);
+        req = next;
+    }
+}
+
+static void *writer_thread(void *arg)
+{
+    (void) arg;
+
+    for (;;)
+    {
+        writer_take_queue();
+        if (writer.pending == NULL)
+        {
+            if (atomic_load(&writer.stopping))
+            {
+                break;
+            }
+            writer_wait(-1);
+            continue;
+        }
+        if (writer.max_latency_us > 0 && writer.pending_count < writer.max_batch)
+        {
+            /* Give the other clients a chance to join the batch */
+            struct timespec start;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            long waited;
+            while (writer.pending_count < writer.max_batch &&
+                   (waited = elapsed_us(&start)) < (long) writer.max_latency_us)
+            {
+                writer_wait(writer.max_latency_us - waited);
+                writer_take_queue();
+            }
+        }
+        writer_commit_batch();
+    }
+    return NULL;
+}
+
+static void sync_request_done(group_commit_request_t *req)
+{
+    sem_post(&((sync_request_t *) req->arg)->done);
+}
+/*--------------------------------- Public Functions ---------------------------------  */
+int group_commit_start(unsigned int max_batch, unsigned int max_latency_us)
+{
+    if (max_batch == 0)
+    {
+        max_batch = 1;
+    }
+    if (max_batch > IOV_MAX)
+    {
+        max_batch = IOV_MAX;
+    }
+    writer.max_batch = max_batch;
+    writer.max_latency_us = max_latency_us;
+    writer.pending = writer.pending_tail = NULL;
+    writer.pending_count = 0;
+    atomic_store(&writer.queue, NULL);
+    atomic_store(&writer.stopping, 0);
+    memset(&writer.stats, 0, sizeof(writer.stats));
+
+    writer.iov = calloc(max_batch, sizeof(struct iovec));
+    writer.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (writer.iov == NULL || writer.wake_fd == -1)
+    {
+        aesd_log(LOG_ERR, "Can't allocate the group commit writer\n");
+        goto func_error;
+    }
+    if (pthread_create(&writer.thread_id, NULL, writer_thread, NULL) != 0)
+    {
+        aesd_log(LOG_ERR, "Can't create the group commit writer thread\n");
+        goto func_error;
+    }
+    atomic_store(&writer.running, 1);
+    aesd_log(LOG_INFO, "Group commit writer started, %u packets per batch, %u us latency\n", max_batch, max_latency_us);
+    return 0;
+
+func_error:
+    if (writer.wake_fd != -1)
+    {
+        close(writer.wake_fd);
+    }
+    writer.wake_fd = UNINIT_VALUE;
+    free(writer.iov);
+    writer.iov = NULL;
+    return -1;
+}
+
+void group_commit_stop(void)
+{
+    group_commit_stats_t stats;
+    char histogram[GROUP_COMMIT_HISTOGRAM_BUCKETS * 24];
+    size_t used = 0;
+
+    if (!atomic_exchange(&writer.running, 0))
+    {
+        return;
+    }
+    atomic_store(&writer.stopping, 1);
+    uint64_t one = 1;
+    ssize_t ignored = write(writer.wake_fd, &one, sizeof one);
+    (void) ignored;
+    pthread_join(writer.thread_id, NULL);
+    close(writer.wake_fd);
+    writer.wake_fd = UNINIT_VALUE;
+    free(writer.iov);
+    writer.iov = NULL;
+
+    group_commit_get_stats(&stats);
+    histogram[0] = '\0';
+    for (unsigned int i = 0; i < GROUP_COMMIT_HISTOGRAM_BUCKETS && used < sizeof(histogram); i++)
+    {
+        used += snprintf(histogram + used, sizeof(histogram) - used, " <=%u:%lu", 1u << i, stats.histogram[i]);
+    }
+    aesd_log(LOG_INFO, "Group commit: %lu packets (%lu bytes) in %lu batches, largest %lu, batch sizes%s\n",
+           stats.packets, stats.bytes, stats.batches, stats.max_batch, histogram);
+}
+
+int group_commit_submit(group_commit_request_t *req)
+{
+    if (!atomic_load(&writer.running))
+    {
+        return -1;
+    }
+    group_commit_request_t *head = atomic_load(&writer.queue);
+    do
+    {
+        req->next = head;
+    } while (!atomic_compare_exchange_weak(&writer.queue, &head, req));
+
+    if (head == NULL)
+    {
+        uint64_t one = 1;
+        ssize_t ignored = write(writer.wake_fd, &one, sizeof one);
+        (void) ignored;
+    }
+    return 0;
+}
+
+int group_commit_append(const char *buf, size_t len, off_t *committed_len)
+{
+    sync_request_t sync = {
+        .req = { .buf = buf, .len = len, .on_commit = sync_request_done, .arg = &sync },
+    };
+
+    sem_init(&sync.done, 0, 0);
+    if (group_commit_submit(&sync.req) == -1)
+    {
+        sem_destroy(&sync.done);
+        return -1;
+    }
+    while (sem_wait(&sync.done) == -1 && errno == EINTR)
+    {
+    }
+    sem_destroy(&sync.done);
+    *committed_len = sync.req.committed_len;
+    return sync.req.status;
+}
+
+void group_commit_flush(void)
+{
+    off_t committed_len;
+    /* Batches complete in queue order, an empty append is a barrier */
+    group_commit_append(NULL, 0, &committed_len);
+}
+
+void group_commit_get_stats(group_commit_stats_t *stats)
+{
+    pthread_mutex_lock(&writer.stats_lock);
+    *stats = writer.stats;
+    pthread_mutex_unlock(&writer.stats_lock);
+}
@@ -0,0 +1,85 @@
+/**
+ * @file group-commit.h
+ * @brief Group commit stage appending the packets of all clients to the data file
+ *
+ * Clients push append requests on a lock-free multi producer queue. A single
+ * writer thread drains it and appends a whole batch with one pwritev(), then
+ * completes every request of the batch with the file length after the commit,
+ * which bounds the readback of that client.
+ */
+#ifndef GROUP_COMMIT_H
+#define GROUP_COMMIT_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define GROUP_COMMIT_HISTOGRAM_BUCKETS          11      /* 1, 2, 3-4, 5-8, ... 513-1024 packets */
+
+/**
+ * @brief One append, owned by the caller until on_commit runs
+ */
+typedef struct group_commit_request {
+    struct group_commit_request *next;  /* queue link, owned by the writer */
+    const char *buf;
+    size_t len;
+    off_t committed_len;                /* [OUT] data file offset at the end of this request's bytes */
+    int status;                         /* [OUT] 0 on success, -1 if the write failed */
+    void (*on_commit)(struct group_commit_request *req);   /* runs on the writer thread */
+    void *arg;
+} group_commit_request_t;
+
+/**
+ * @brief Snapshot of the writer counters
+ */
+typedef struct group_commit_stats {
+    unsigned long batches;
+    unsigned long packets;
+    unsigned long bytes;
+    unsigned long max_batch;            /* largest batch committed, in packets */
+    unsigned long histogram[GROUP_COMMIT_HISTOGRAM_BUCKETS];  /* batches per power of two size */
+} group_commit_stats_t;
+
+/**
+ * @brief Start the writer thread
+ *
+ * @param max_batch         [IN]  maximum packets per pwritev(), capped to IOV_MAX
+ * @param max_latency_us    [IN]  how long the writer waits for a batch to fill once
+ *                                it holds a request, 0 commits whatever is queued
+ *
+ * @return 0 on success, -1 on failure
+ */
+int group_commit_start(unsigned int max_batch, unsigned int max_latency_us);
+
+/**
+ * @brief Commit the queued requests and join the writer, logs the batch statistics
+ */
+void group_commit_stop(void);
+
+/**
+ * @brief Queue a request, never blocks. on_commit is called from the writer thread
+ *
+ * @return 0 if the request was queued, -1 if the writer is not running
+ */
+int group_commit_submit(group_commit_request_t *req);
+
+/**
+ * @brief Queue an append and wait for its batch to be committed
+ *
+ * @param buf               [IN]  bytes to append
+ * @param len               [IN]  number of bytes
+ * @param committed_len     [OUT] data file offset at the end of these bytes, later
+ *                                requests of the batch may follow them
+ *
+ * @return 0 on success, -1 if the write failed or the writer is not running
+ */
+int group_commit_append(const char *buf, size_t len, off_t *committed_len);
+
+/**
+ * @brief Wait until every request queued before the call has completed, returns
+ *        at once if the writer is not running
+ */
+void group_commit_flush(void);
+
+void group_commit_get_stats(group_commit_stats_t *stats);
+
+#endif /*GROUP_COMMIT_H*/
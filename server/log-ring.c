@@ -0,0 +1,287 @@
+/**
+ * @file log-ring.c
+ * @brief Asynchronous logging through per-thread lock-free rings
+ *
+ * Every logging thread claims a ring the first time it logs and gives it back
+ * when it exits, so the number of rings follows the number of threads logging
+ * at the same time, not the number of connections served. Each ring has a
+ * single producer, its owner, and a single consumer, the drainer.
+ *
+ * While messages keep coming the drainer wakes up every LOG_RING_BATCH_US and
+ * the producers never make a system call. Only once a pass finds every ring
+ * empty does the drainer block on an eventfd, and the first message after that
+ * wakes it up.
+ */
+/*--------------------------------- Private includes ---------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include "aesdsocket.h"
+#include "log-ring.h"
+/*--------------------------------- Private definitions ---------------------------------  */
+#define LOG_RING_SLOTS                          64      /* power of two */
+#define LOG_RING_MSG_SIZE                       192     /* longer messages are truncated */
+#define LOG_RING_BATCH_US                       1000
+
+typedef struct log_entry {
+    int level;
+    char msg[LOG_RING_MSG_SIZE];
+} log_entry_t;
+
+typedef struct log_ring {
+    atomic_uint head;                   /* next slot the owner fills */
+    atomic_uint tail;                   /* next slot the drainer reads */
+    atomic_int owned;                   /* a live thread produces into the ring */
+    atomic_ulong dropped;
+    struct log_ring *next;              /* list of all rings, set before publication */
+    log_entry_t slots[LOG_RING_SLOTS];
+} log_ring_t;
+/*---------------------------------- Private Variables ----------------------------------  */
+atomic_int log_ring_level = LOG_RING_DEFAULT_LEVEL;
+
+static _Atomic(log_ring_t *) ring_list;
+static __thread log_ring_t *thread_ring;
+static pthread_key_t ring_key;
+static pthread_t drainer_id;
+static int wake_fd = UNINIT_VALUE;
+static atomic_int running;
+static atomic_int stopping;
+static atomic_int drainer_idle;
+static atomic_ulong stat_written;
+static atomic_ulong stat_dropped;
+static atomic_ulong stat_rings;
+/*--------------------------------- Private Functions ---------------------------------  */
+/**
+ * @brief pthread key destructor, the ring of an exiting thread goes back to the free rings
+ */
+static void release_ring(void *arg)
+{
+    log_ring_t *ring = arg;
+    /* Release: the next owner sees the head this thread left */
+    atomic_store_explicit(&ring->owned, 0, memory_order_release);
+}
+
+/**
+ * @brief Ring of the calling thread, claims a free one or allocates one on first use
+ */
+static log_ring_t *claim_ring(void)
+{
+    log_ring_t *ring;
+
+    for (ring = atomic_load_explicit(&ring_list, memory_order_acquire); ring != NULL; ring = ring->next)
+    {
+        int expected = 0;
+        if (atomic_compare_exchange_strong_explicit(&ring->owned, &expected, 1,
+                                                    memory_order_acquire, memory_order_relaxed))
+        {
+            break;
+        }
+    }
+    if (ring == NULL)
+    {
+        ring = calloc(1, sizeof(log_ring_t));
+        if (ring == NULL)
+        {
+            return NULL;
+        }
+        atomic_store_explicit(&ring->owned, 1, memory_order_relaxed);
+        ring->next = atomic_load_explicit(&ring_list, memory_order_relaxed);
+        while (!atomic_compare_exchange_weak_explicit(&ring_list, &ring->next, ring,
+                                                      memory_order_release, memory_order_relaxed))
+        {
+        }
+        atomic_fetch_add_explicit(&stat_rings, 1, memory_order_relaxed);
+    }
+    pthread_setspecific(ring_key, ring);
+    thread_ring = ring;
+    return ring;
+}
+
+/**
+ * @brief Hand everything queued in the rings to syslog()
+ *
+ * @return number of messages drained
+ */
+static unsigned long drain_rings(void)
+{
+    unsigned long drained = 0;
+
+    for (log_ring_t *ring = atomic_load_explicit(&ring_list, memory_order_acquire); ring != NULL; ring = ring->next)
+    {
+        unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        unsigned int head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+        while (tail != head)
+        {
+            log_entry_t *entry = &ring->slots[tail & (LOG_RING_SLOTS - 1)];
+            syslog(entry->level, "%s", entry->msg);
+            tail++;
+            drained++;
+        }
+        /* Release: the slots are free for the producer only once they are read */
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+        unsigned long dropped = atomic_exchange_explicit(&ring->dropped, 0, memory_order_relaxed);
+        if (dropped > 0)
+        {
+            syslog(LOG_WARNING, "Log ring full, %lu messages dropped\n", dropped);
+        }
+    }
+    atomic_fetch_add_explicit(&stat_written, drained, memory_order_relaxed);
+    return drained;
+}
+
+static void *drainer_thread(void *arg)
+{
+    (void) arg;
+    const struct timespec batch = { .tv_sec = 0, .tv_nsec = LOG_RING_BATCH_US * 1000L };
+
+    while (1)
+    {
+        if (drain_rings() > 0)
+        {
+            /* Busy period, let the rings fill up instead of waking per message */
+            nanosleep(&batch, NULL);
+            continue;
+        }
+        if (atomic_load(&stopping))
+        {
+            break;
+        }
+
+        /* Announce the sleep, then look again: a producer that stored its head before
+         * seeing drainer_idle set has its message picked up by this pass */
+        atomic_store(&drainer_idle, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (drain_rings() > 0)
+        {
+            atomic_store(&drainer_idle, 0);
+            continue;
+        }
+        uint64_t count;
+        if (read(wake_fd, &count, sizeof count) == -1 && errno != EINTR)
+        {
+            break;
+        }
+        atomic_store(&drainer_idle, 0);
+    }
+    return NULL;
+}
+/*--------------------------------- Public Functions ---------------------------------  */
+void log_ring_write(int level, const char *fmt, ...)
+{
+    va_list args;
+    log_ring_t *ring = thread_ring;
+
+    va_start(args, fmt);
+    if (!atomic_load_explicit(&running, memory_order_acquire) ||
+        (ring == NULL && (ring = claim_ring()) == NULL))
+    {
+        vsyslog(level, fmt, args);
+        va_end(args);
+        return;
+    }
+
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail >= LOG_RING_SLOTS)
+    {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&stat_dropped, 1, memory_order_relaxed);
+        va_end(args);
+        return;
+    }
+    log_entry_t *entry = &ring->slots[head & (LOG_RING_SLOTS - 1)];
+    entry->level = level;
+    vsnprintf(entry->msg, sizeof(entry->msg), fmt, args);
+    va_end(args);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+
+    /* Pairs with the fence of the drainer before its last look at the rings */
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&drainer_idle, memory_order_relaxed) && atomic_exchange(&drainer_idle, 0))
+    {
+        uint64_t one = 1;
+        ssize_t ignored = write(wake_fd, &one, sizeof one);
+        (void) ignored;
+    }
+}
+
+int log_ring_start(void)
+{
+    if (pthread_key_create(&ring_key, release_ring) != 0)
+    {
+        syslog(LOG_ERR, "Can't create the log ring key\n");
+        return -1;
+    }
+    wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (wake_fd == -1)
+    {
+        syslog(LOG_ERR, "Can't create the log drainer eventfd: %s\n", strerror(errno));
+        pthread_key_delete(ring_key);
+        return -1;
+    }
+    if (pthread_create(&drainer_id, NULL, drainer_thread, NULL) != 0)
+    {
+        syslog(LOG_ERR, "Can't create the log drainer thread\n");
+        close(wake_fd);
+        wake_fd = UNINIT_VALUE;
+        pthread_key_delete(ring_key);
+        return -1;
+    }
+    atomic_store_explicit(&running, 1, memory_order_release);
+    return 0;
+}
+
+void log_ring_stop(void)
+{
+    if (!atomic_load(&running))
+    {
+        return;
+    }
+    /* Later messages go straight to syslog(), the drainer empties what is queued */
+    atomic_store(&running, 0);
+    atomic_store(&stopping, 1);
+    uint64_t one = 1;
+    ssize_t ignored = write(wake_fd, &one, sizeof one);
+    (void) ignored;
+    pthread_join(drainer_id, NULL);
+    close(wake_fd);
+    wake_fd = UNINIT_VALUE;
+
+    if (atomic_load(&stat_dropped) > 0)
+    {
+        syslog(LOG_WARNING, "Logging: %lu messages written, %lu dropped\n",
+               atomic_load(&stat_written), atomic_load(&stat_dropped));
+    }
+
+    /* Every other thread is joined by now */
+    pthread_key_delete(ring_key);
+    thread_ring = NULL;
+    log_ring_t *ring = atomic_exchange(&ring_list, NULL);
+    while (ring != NULL)
+    {
+        log_ring_t *next = ring->next;
+        free(ring);
+        ring = next;
+    }
+}
+
+void log_ring_set_level(int level)
+{
+    atomic_store_explicit(&log_ring_level, level, memory_order_relaxed);
+}
+
+void log_ring_get_stats(log_ring_stats_t *stats)
+{
+    stats->written = atomic_load(&stat_written);
+    stats->dropped = atomic_load(&stat_dropped);
+    stats->rings = atomic_load(&stat_rings);
+}
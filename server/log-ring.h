@@ -0,0 +1,75 @@
+/**
+ * @file log-ring.h
+ * @brief Asynchronous logging through per-thread lock-free rings
+ *
+ * syslog() is a blocking write to /dev/log, so a slow syslogd stalls whichever
+ * thread logs. aesd_log() formats the message into a single producer ring owned
+ * by the calling thread and returns; a drainer thread hands the messages to
+ * syslog() in the background. A full ring drops the message and counts it, the
+ * caller never waits.
+ *
+ * Levels above LOG_RING_COMPILE_LEVEL are removed by the compiler, the others
+ * are filtered against the runtime level with one relaxed load before anything
+ * is formatted.
+ */
+#ifndef LOG_RING_H
+#define LOG_RING_H
+
+#include <syslog.h>
+#include <stdatomic.h>
+
+#ifndef LOG_RING_COMPILE_LEVEL
+#define LOG_RING_COMPILE_LEVEL                  LOG_DEBUG
+#endif /*LOG_RING_COMPILE_LEVEL*/
+
+#define LOG_RING_DEFAULT_LEVEL                  LOG_INFO
+
+/**
+ * @brief Snapshot of the logging counters
+ */
+typedef struct log_ring_stats {
+    unsigned long written;          /* messages handed to syslog() by the drainer */
+    unsigned long dropped;          /* messages lost to a full ring */
+    unsigned long rings;            /* rings allocated, one per concurrently logging thread */
+} log_ring_stats_t;
+
+extern atomic_int log_ring_level;
+
+/**
+ * @brief Log a message at a syslog level, same arguments as syslog()
+ */
+#define aesd_log(level, ...)                                                                    \
+    do {                                                                                        \
+        if ((level) <= LOG_RING_COMPILE_LEVEL &&                                                \
+            (level) <= atomic_load_explicit(&log_ring_level, memory_order_relaxed))             \
+        {                                                                                       \
+            log_ring_write((level), __VA_ARGS__);                                               \
+        }                                                                                       \
+    } while (0)
+
+/**
+ * @brief Format a message into the ring of the calling thread, straight to syslog()
+ *        while the drainer isn't running. Use aesd_log() which filters the level first
+ */
+void log_ring_write(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+/**
+ * @brief Start the drainer thread, call it after daemon() since threads don't survive fork()
+ *
+ * @return 0 on success, -1 on failure, messages then keep going straight to syslog()
+ */
+int log_ring_start(void);
+
+/**
+ * @brief Flush every ring to syslog() and stop the drainer
+ */
+void log_ring_stop(void);
+
+/**
+ * @brief Change the runtime level, messages with a higher level are discarded
+ */
+void log_ring_set_level(int level);
+
+void log_ring_get_stats(log_ring_stats_t *stats);
+
+#endif /*LOG_RING_H*/
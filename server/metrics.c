@@ -0,0 +1,644 @@
+/**
+ * @file metrics.c
+ * @brief Per-thread counters and latency histograms served in Prometheus text format
+ *
+ * A thread claims a counter block the first time it counts and gives it back
+ * when it exits. A block keeps its values when it changes owner, so the sums
+ * over all blocks stay monotonic whatever the threads do. Each block has a
+ * single writer at a time, its counters are updated with a relaxed load and
+ * store instead of a locked read-modify-write.
+ *
+ * The listener serves one scrape at a time from its own thread, a scrape only
+ * reads the blocks.
+ */
+/*--------------------------------- Private includes ---------------------------------*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include "aesdsocket.h"
+#include "work-pool.h"
+#include "group-commit.h"
+#include "rx-buffer.h"
+#include "client-registry.h"
+#include "metrics.h"
+#include "log-ring.h"
+#include "storage.h"
+#include "readback-cache.h"
+#include "probes.h"
+/*--------------------------------- Private definitions ---------------------------------  */
+#define METRICS_SUB_BITS                        3
+#define METRICS_SUB_BUCKETS                     (1 << METRICS_SUB_BITS)
+#define METRICS_MAX_EXPONENT                    36      /* 2^36 ns, about 68 s, larger values share the last bucket */
+#define METRICS_LATENCY_BUCKETS                 ((METRICS_MAX_EXPONENT - METRICS_SUB_BITS + 1) * METRICS_SUB_BUCKETS)
+#define METRICS_EXPORT_MIN_EXPONENT             10      /* first exported bucket: le 1.024us */
+#define METRICS_REQUEST_SIZE                    1024
+#define METRICS_IO_TIMEOUT_S                    1
+
+typedef struct metrics_block {
+    atomic_ulong counters[METRIC_COUNTERS];
+    atomic_ulong packets;
+    atomic_ulong readback_bytes;
+    atomic_ulong latency_sum_ns;
+    atomic_ulong latency[METRICS_LATENCY_BUCKETS];
+    atomic_int owned;
+    struct metrics_block *next;         /* list of all blocks, set before publication */
+} metrics_block_t;
+
+/**
+ * @brief Sum of all the blocks at scrape time
+ */
+typedef struct metrics_totals {
+    unsigned long counters[METRIC_COUNTERS];
+    unsigned long packets;
+    unsigned long readback_bytes;
+    unsigned long latency_sum_ns;
+    unsigned long latency[METRICS_LATENCY_BUCKETS];
+} metrics_totals_t;
+/*---------------------------------- Private Variables ----------------------------------  */
+static _Atomic(metrics_block_t *) block_list;
+static __thread metrics_block_t *thread_block;
+static pthread_key_t block_key;
+static pthread_once_t block_key_once = PTHREAD_ONCE_INIT;
+static atomic_int metrics_enabled;
+static pthread_t listener_id;
+static int listen_fd = UNINIT_VALUE;
+static int stop_fd = UNINIT_VALUE;
+static char unix_path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+/*--------------------------------- Private Functions ---------------------------------  */
+static void release_block(void *arg)
+{
+    metrics_block_t *block = arg;
+    atomic_store_explicit(&block->owned, 0, memory_order_release);
+}
+
+static void create_block_key(void)
+{
+    pthread_key_create(&block_key, release_block);
+}
+
+/**
+ * @brief Counter block of the calling thread, NULL if memory ran out
+ */
+static metrics_block_t *get_block(void)
+{
+    metrics_block_t *block = thread_block;
+
+    if (block != NULL)
+    {
+        return block;
+    }
+    pthread_once(&block_key_once, create_block_key);
+    for (block = atomic_load_explicit(&block_list, memory_order_acquire); block != NULL; block = block->next)
+    {
+        int expected = 0;
+        if (atomic_compare_exchange_strong_explicit(&block->owned, &expected, 1,
+                                                    memory_order_acquire, memory_order_relaxed))
+        {
+            break;
+        }
+    }
+    if (block == NULL)
+    {
+        block = calloc(1, sizeof(metrics_block_t));
+        if (block == NULL)
+        {
+            return NULL;
+        }
+        atomic_store_explicit(&block->owned, 1, memory_order_relaxed);
+        block->next = atomic_load_explicit(&block_list, memory_order_relaxed);
+        while (!atomic_compare_exchange_weak_explicit(&block_list, &block->next, block,
+                                                      memory_order_release, memory_order_relaxed))
+        {
+        }
+    }
+    pthread_setspecific(block_key, block);
+    thread_block = block;
+    return block;
+}
+
+/**
+ * @brief Single writer increment, no locked instruction
+ */
+static inline void block_add(atomic_ulong *counter, unsigned long value)
+{
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + value, memory_order_relaxed);
+}
+
+static unsigned int latency_bucket(uint64_t ns)
+{
+    if (ns < METRICS_SUB_BUCKETS)
+    {
+        return ns;
+    }
+    unsigned int exponent = 63 - __builtin_clzll(ns);
+    if (exponent >= METRICS_MAX_EXPONENT)
+    {
+        return METRICS_LATENCY_BUCKETS - 1;
+    }
+    return (exponent - METRICS_SUB_BITS + 1) * METRICS_SUB_BUCKETS +
+           ((ns >> (exponent - METRICS_SUB_BITS)) & (METRICS_SUB_BUCKETS - 1));
+}
+
+/**
+ * @brief First value above a histogram bucket
+ */
+static uint64_t latency_bucket_limit(unsigned int index)
+{
+    if (index < METRICS_SUB_BUCKETS)
+    {
+        return index + 1;
+    }
+    unsigned int exponent = index / METRICS_SUB_BUCKETS + METRICS_SUB_BITS - 1;
+    uint64_t sub_bucket = index % METRICS_SUB_BUCKETS;
+    return (METRICS_SUB_BUCKETS + sub_bucket + 1) << (exponent - METRICS_SUB_BITS);
+}
+
+static void collect_totals(metrics_totals_t *totals)
+{
+    memset(totals, 0, sizeof(*totals));
+    for (metrics_block_t *block = atomic_load_explicit(&block_list, memory_order_acquire); block != NULL; block = block->next)
+    {
+        for (int i = 0; i < METRIC_COUNTERS; i++)
+        {
+            totals->counters[i] += atomic_load_explicit(&block->counters[i], memory_order_relaxed);
+        }
+        totals->packets += atomic_load_explicit(&block->packets, memory_order_relaxed);
+        totals->readback_bytes += atomic_load_explicit(&block->readback_bytes, memory_order_relaxed);
+        totals->latency_sum_ns += atomic_load_explicit(&block->latency_sum_ns, memory_order_relaxed);
+        for (int i = 0; i < METRICS_LATENCY_BUCKETS; i++)
+        {
+            totals->latency[i] += atomic_load_explicit(&block->latency[i], memory_order_relaxed);
+        }
+    }
+}
+
+/**
+ * @brief Upper limit of the bucket holding the quantile, in seconds
+ */
+static double latency_quantile(const metrics_totals_t *totals, unsigned long count, double quantile)
+{
+    unsigned long rank = (unsigned long) (quantile * count + 0.5);
+    unsigned long cumulative = 0;
+
+    if (count == 0)
+    {
+        return 0.0;
+    }
+    if (rank == 0)
+    {
+        rank = 1;
+    }
+    for (unsigned int i = 0; i < METRICS_LATENCY_BUCKETS; i++)
+    {
+        cumulative += totals->latency[i];
+        if (cumulative >= rank)
+        {
+            return latency_bucket_limit(i) / 1e9;
+        }
+    }
+    return latency_bucket_limit(METRICS_LATENCY_BUCKETS - 1) / 1e9;
+}
+
+static void print_metric(FILE *out, const char *name, const char *type, const char *help, unsigned long value)
+{
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n%s %lu\n", name, help, name, type, name, value);
+}
+
+static void print_seconds(FILE *out, const char *name, const char *type, const char *help, double value)
+{
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n%s %.9g\n", name, help, name, type, name, value);
+}
+
+/**
+ * @brief Render every metric in the Prometheus text exposition format
+ *
+ * @return malloc()ed text, NULL if memory ran out
+ */
+static char *render_metrics(size_t *len)
+{
+    metrics_totals_t totals;
+    work_pool_stats_t pool_stats;
+    group_commit_stats_t commit_stats;
+    readback_cache_stats_t cache_stats;
+    rx_pool_stats_t rx_stats;
+    client_registry_stats_t registry_stats;
+    log_ring_stats_t log_stats;
+    char *text = NULL;
+    FILE *out = open_memstream(&text, len);
+
+    if (out == NULL)
+    {
+        return NULL;
+    }
+    collect_totals(&totals);
+    const unsigned long *counters = totals.counters;
+
+    print_metric(out, "aesdsocket_connections_accepted_total", "counter", "Client connections accepted.",
+                 counters[METRIC_ACCEPTED]);
+    /* The blocks aren't read at one instant, a close may be seen without its accept */
+    unsigned long active = (counters[METRIC_ACCEPTED] > counters[METRIC_CLOSED]) ?
+                           counters[METRIC_ACCEPTED] - counters[METRIC_CLOSED] : 0;
+    print_metric(out, "aesdsocket_connections_active", "gauge", "Client connections open.", active);
+    print_metric(out, "aesdsocket_packets_total", "counter", "Packets whose readback completed.", totals.packets);
+    print_metric(out, "aesdsocket_received_bytes_total", "counter", "Bytes received from the clients.",
+                 counters[METRIC_BYTES_IN]);
+    print_metric(out, "aesdsocket_sent_bytes_total", "counter", "Bytes sent to the clients.",
+                 counters[METRIC_BYTES_OUT]);
+    print_metric(out, "aesdsocket_readback_bytes_total", "counter", "Bytes sent by completed readbacks.",
+                 totals.readback_bytes);
+    print_metric(out, "aesdsocket_file_mutex_contended_total", "counter", "file_mutex acquisitions that waited.",
+                 counters[METRIC_FILE_MUTEX_CONTENDED]);
+    print_seconds(out, "aesdsocket_file_mutex_wait_seconds_total", "counter", "Time spent waiting for file_mutex.",
+                 counters[METRIC_FILE_MUTEX_WAIT_NS] / 1e9);
+    print_metric(out, "aesdsocket_binary_commands_total", "counter", "Commands of binary protocol connections.",
+                 counters[METRIC_BINARY_COMMANDS]);
+    print_metric(out, "aesdsocket_device_opens_total", "counter", "Device descriptors opened, one per connection.",
+                 counters[METRIC_DEVICE_OPENS]);
+    print_metric(out, "aesdsocket_slow_consumer_drops_total", "counter", "Readbacks abandoned because the client stopped reading.",
+                 counters[METRIC_SLOW_CONSUMER_DROPS]);
+    print_metric(out, "aesdsocket_slow_consumer_disconnects_total", "counter", "Connections closed because the client stopped reading.",
+                 counters[METRIC_SLOW_CONSUMER_DISCONNECTS]);
+    print_metric(out, "aesdsocket_segments_rolled_total", "counter", "Data segments started once the previous one was full.",
+                 counters[METRIC_SEGMENTS_ROLLED]);
+    print_metric(out, "aesdsocket_segments_retired_total", "counter", "Data segments deleted by the retention policy.",
+                 counters[METRIC_SEGMENTS_RETIRED]);
+    print_metric(out, "aesdsocket_staged_packets_total", "counter", "Packets longer than -B staged in a file until their newline.",
+                 counters[METRIC_PACKETS_STAGED]);
+    print_metric(out, "aesdsocket_staged_bytes_total", "counter", "Bytes written to the staging files.",
+                 counters[METRIC_BYTES_STAGED]);
+    print_metric(out, "aesdsocket_zerocopy_sends_total", "counter", "Readback sends made with MSG_ZEROCOPY.",
+                 counters[METRIC_ZEROCOPY_SENDS]);
+    print_metric(out, "aesdsocket_zerocopy_bytes_total", "counter", "Bytes sent with MSG_ZEROCOPY.",
+                 counters[METRIC_ZEROCOPY_BYTES]);
+    print_metric(out, "aesdsocket_zerocopy_copied_total", "counter", "MSG_ZEROCOPY sends the kernel completed with a copy.",
+                 counters[METRIC_ZEROCOPY_COPIED]);
+
+    /* Exported at the powers of two, they are bucket boundaries of the histogram */
+    unsigned long cumulative = 0;
+    unsigned int index = 0;
+    fprintf(out, "# HELP aesdsocket_packet_latency_seconds First byte received to readback completed.\n"
+                 "# TYPE aesdsocket_packet_latency_seconds histogram\n");
+    for (unsigned int exponent = METRICS_EXPORT_MIN_EXPONENT; exponent <= METRICS_MAX_EXPONENT; exponent++)
+    {
+        while (index < METRICS_LATENCY_BUCKETS && latency_bucket_limit(index) <= (1ULL << exponent))
+        {
+            cumulative += totals.latency[index++];
+        }
+        fprintf(out, "aesdsocket_packet_latency_seconds_bucket{le=\"%.12g\"} %lu\n", (double) (1ULL << exponent) / 1e9, cumulative);
+    }
+    unsigned long latency_count = 0;
+    for (unsigned int i = 0; i < METRICS_LATENCY_BUCKETS; i++)
+    {
+        latency_count += totals.latency[i];
+    }
+    fprintf(out, "aesdsocket_packet_latency_seconds_bucket{le=\"+Inf\"} %lu\n", latency_count);
+    fprintf(out, "aesdsocket_packet_latency_seconds_sum %.9g\n", totals.latency_sum_ns / 1e9);
+    fprintf(out, "aesdsocket_packet_latency_seconds_count %lu\n", latency_count);
+
+    fprintf(out, "# HELP aesdsocket_packet_latency_quantile_seconds Packet latency quantiles from the full resolution histogram.\n"
+                 "# TYPE aesdsocket_packet_latency_quantile_seconds gauge\n");
+    static const char *const quantile_names[] = { "0.5", "0.9", "0.99", "0.999" };
+    static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    for (unsigned int i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++)
+    {
+        fprintf(out, "aesdsocket_packet_latency_quantile_seconds{quantile=\"%s\"} %.9g\n",
+                quantile_names[i], latency_quantile(&totals, latency_count, quantiles[i]));
+    }
+
+    work_pool_get_stats(&pool_stats);
+    print_metric(out, "aesdsocket_pool_jobs_total", "counter", "Packet jobs run by the worker pool.", pool_stats.executed);
+    print_metric(out, "aesdsocket_pool_steals_total", "counter", "Jobs stolen from another worker.", pool_stats.steals);
+    print_metric(out, "aesdsocket_pool_rejected_total", "counter", "Jobs refused by a saturated pool.", pool_stats.rejected);
+    print_metric(out, "aesdsocket_pool_queue_depth", "gauge", "Jobs queued and not started.", pool_stats.queue_depth);
+    group_commit_get_stats(&commit_stats);
+    print_metric(out, "aesdsocket_group_commit_batches_total", "counter", "Group commit batches written.", commit_stats.batches);
+    print_metric(out, "aesdsocket_group_commit_packets_total", "counter", "Packets written by the group commit writer.",
+                 commit_stats.packets);
+    readback_cache_get_stats(&cache_stats);
+    print_metric(out, "aesdsocket_readback_cache_hits_total", "counter", "Readbacks sent from an existing snapshot.",
+                 cache_stats.hits);
+    print_metric(out, "aesdsocket_readback_cache_misses_total", "counter", "Readbacks that built a new snapshot.",
+                 cache_stats.misses);
+    print_metric(out, "aesdsocket_readback_cache_bypasses_total", "counter", "Readbacks of data the cache can't hold.",
+                 cache_stats.bypasses);
+    print_metric(out, "aesdsocket_readback_cache_saved_bytes_total", "counter", "Readback bytes not read from the storage.",
+                 cache_stats.bytes_saved);
+    print_metric(out, "aesdsocket_readback_cache_read_bytes_total", "counter", "Bytes read from the storage into snapshots.",
+                 cache_stats.bytes_read);
+    print_metric(out, "aesdsocket_storage_bytes", "gauge", "End of the stored data, 0 for chardev.",
+                 (unsigned long) storage->length());
+    rx_pool_get_stats(&rx_stats);
+    print_metric(out, "aesdsocket_rx_buffer_mallocs_total", "counter", "Receive buffers allocated.", rx_stats.mallocs);
+    print_metric(out, "aesdsocket_rx_buffer_pool_hits_total", "counter", "Receive buffers served from the pool.",
+                 rx_stats.pool_hits);
+    client_registry_get_stats(&registry_stats);
+    print_seconds(out, "aesdsocket_client_oldest_age_seconds", "gauge", "Age of the oldest client thread.",
+                 registry_stats.oldest_age_ms / 1e3);
+    log_ring_get_stats(&log_stats);
+    print_metric(out, "aesdsocket_log_dropped_total", "counter", "Log messages lost to a full ring.", log_stats.dropped);
+
+    if (fclose(out) != 0)
+    {
+        free(text);
+        return NULL;
+    }
+    return text;
+}
+
+static int send_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t sent = send(fd, buf, len, MSG_NOSIGNAL);
+        if (sent == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        buf += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+/**
+ * @brief Answer one scrape, whatever the request path is
+ */
+static void serve_scrape(int fd)
+{
+    char request[METRICS_REQUEST_SIZE];
+    char header[256];
+    size_t len;
+    struct timeval timeout = { .tv_sec = METRICS_IO_TIMEOUT_S, .tv_usec = 0 };
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    if (recv(fd, request, sizeof(request), 0) <= 0)
+    {
+        return;
+    }
+    char *text = render_metrics(&len);
+    if (text == NULL)
+    {
+        aesd_log(LOG_ERR, "Can't render the metrics\n");
+        return;
+    }
+    int header_len = snprintf(header, sizeof(header),
+                              "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                              "Content-Length: %zu\r\nConnection: close\r\n\r\n", len);
+    if (send_all(fd, header, header_len) == 0)
+    {
+        send_all(fd, text, len);
+    }
+    free(text);
+}
+
+static void *listener_thread(void *arg)
+{
+    (void) arg;
+    struct pollfd fds[2] = {
+        { .fd = listen_fd, .events = POLLIN },
+        { .fd = stop_fd, .events = POLLIN },
+    };
+
+    for (;;)
+    {
+        if (poll(fds, 2, -1) == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            aesd_log(LOG_ERR, "Stats listener poll failed: %s\n", strerror(errno));
+            break;
+        }
+        if (fds[1].revents != 0)
+        {
+            break;
+        }
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd != -1)
+        {
+            serve_scrape(fd);
+            close(fd);
+        }
+    }
+    return NULL;
+}
+
+static int listen_tcp(const char *port)
+{
+    struct addrinfo hints, *servinfo, *res;
+    int fd = UNINIT_VALUE;
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    if (getaddrinfo(NULL, port, &hints, &servinfo) != 0)
+    {
+        return -1;
+    }
+    for (res = servinfo; res != NULL; res = res->ai_next)
+    {
+        fd = socket(res->ai_family, res->ai_socktype | SOCK_CLOEXEC, res->ai_protocol);
+        if (fd == -1)
+        {
+            continue;
+        }
+        int yes = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
+        if (bind(fd, res->ai_addr, res->ai_addrlen) == 0)
+        {
+            break;
+        }
+        close(fd);
+        fd = UNINIT_VALUE;
+    }
+    freeaddrinfo(servinfo);
+    return fd;
+}
+
+static int listen_unix(const char *path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+    {
+        return -1;
+    }
+    /* A socket left by a previous run would make bind() fail, anything else at the
+       path is not ours to delete */
+    struct stat path_stat;
+    if (lstat(path, &path_stat) == 0)
+    {
+        if (!S_ISSOCK(path_stat.st_mode))
+        {
+            aesd_log(LOG_ERR, "%s exists and is not a socket\n", path);
+            close(fd);
+            errno = EEXIST;
+            return -1;
+        }
+        unlink(path);
+    }
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    strcpy(unix_path, path);
+    return fd;
+}
+/*--------------------------------- Public Functions ---------------------------------  */
+void metrics_add(metric_counter_t counter, unsigned long value)
+{
+    metrics_block_t *block = get_block();
+
+    if (block != NULL)
+    {
+        block_add(&block->counters[counter], value);
+    }
+}
+
+unsigned long metrics_thread_value(metric_counter_t counter)
+{
+    metrics_block_t *block = get_block();
+    return (block != NULL) ? atomic_load_explicit(&block->counters[counter], memory_order_relaxed) : 0;
+}
+
+unsigned long metrics_total(metric_counter_t counter)
+{
+    unsigned long total = 0;
+    for (metrics_block_t *block = atomic_load_explicit(&block_list, memory_order_acquire); block != NULL; block = block->next)
+    {
+        total += atomic_load_explicit(&block->counters[counter], memory_order_relaxed);
+    }
+    return total;
+}
+
+uint64_t metrics_now(void)
+{
+    struct timespec now;
+
+    if (!atomic_load_explicit(&metrics_enabled, memory_order_relaxed))
+    {
+        return 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+void metrics_packet_done(uint64_t first_byte_ns, unsigned long readback_bytes)
+{
+    metrics_block_t *block = get_block();
+
+    if (block == NULL)
+    {
+        return;
+    }
+    block_add(&block->packets, 1);
+    block_add(&block->readback_bytes, readback_bytes);
+    uint64_t now_ns = (first_byte_ns != 0) ? metrics_now() : 0;
+    if (now_ns > first_byte_ns)
+    {
+        block_add(&block->latency[latency_bucket(now_ns - first_byte_ns)], 1);
+        block_add(&block->latency_sum_ns, now_ns - first_byte_ns);
+    }
+}
+
+void metrics_mutex_lock(pthread_mutex_t *mutex)
+{
+    /* The clock is only read when the mutex is contended */
+    if (pthread_mutex_trylock(mutex) == 0)
+    {
+        AESD_PROBE2(lock_acquired, mutex, 0);
+        return;
+    }
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_mutex_lock(mutex);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    unsigned long wait_ns = (end.tv_sec - start.tv_sec) * 1000000000UL + end.tv_nsec - start.tv_nsec;
+    AESD_PROBE2(lock_acquired, mutex, wait_ns);
+    metrics_add(METRIC_FILE_MUTEX_CONTENDED, 1);
+    metrics_add(METRIC_FILE_MUTEX_WAIT_NS, wait_ns);
+}
+
+int metrics_start(const char *endpoint)
+{
+    listen_fd = (strchr(endpoint, '/') != NULL) ? listen_unix(endpoint) : listen_tcp(endpoint);
+    if (listen_fd == -1 || listen(listen_fd, BACKLOG) == -1)
+    {
+        aesd_log(LOG_ERR, "Can't listen for stats on %s: %s\n", endpoint, strerror(errno));
+        goto start_fail;
+    }
+    stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (stop_fd == -1)
+    {
+        aesd_log(LOG_ERR, "Can't create the stats listener eventfd: %s\n", strerror(errno));
+        goto start_fail;
+    }
+    if (pthread_create(&listener_id, NULL, listener_thread, NULL) != 0)
+    {
+        aesd_log(LOG_ERR, "Can't create the stats listener thread\n");
+        goto start_fail;
+    }
+    atomic_store(&metrics_enabled, 1);
+    aesd_log(LOG_INFO, "Serving metrics on %s\n", endpoint);
+    return 0;
+
+start_fail:
+    if (stop_fd != UNINIT_VALUE)
+    {
+        close(stop_fd);
+        stop_fd = UNINIT_VALUE;
+    }
+    if (listen_fd != UNINIT_VALUE)
+    {
+        close(listen_fd);
+        listen_fd = UNINIT_VALUE;
+    }
+    return -1;
+}
+
+void metrics_stop(void)
+{
+    if (!atomic_load(&metrics_enabled))
+    {
+        return;
+    }
+    atomic_store(&metrics_enabled, 0);
+    uint64_t one = 1;
+    ssize_t ignored = write(stop_fd, &one, sizeof one);
+    (void) ignored;
+    pthread_join(listener_id, NULL);
+    close(stop_fd);
+    close(listen_fd);
+    stop_fd = listen_fd = UNINIT_VALUE;
+    if (unix_path[0] != '\0')
+    {
+        unlink(unix_path);
+        unix_path[0] = '\0';
+    }
+}
@@ -0,0 +1,83 @@
+/**
+ * @file metrics.h
+ * @brief Per-thread counters and latency histograms served in Prometheus text format
+ *
+ * Every thread updates its own block of counters with plain relaxed stores, the
+ * blocks are only summed when the stats listener is scraped, so counting never
+ * shares a cache line between threads. The packet latency, from the first byte
+ * received to the end of its readback, goes into a log-linear histogram with 8
+ * sub-buckets per power of two (HDR style, 12.5% worst case error).
+ */
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+typedef enum {
+    METRIC_ACCEPTED = 0,
+    METRIC_CLOSED,
+    METRIC_BYTES_IN,
+    METRIC_BYTES_OUT,
+    METRIC_FILE_MUTEX_CONTENDED,        /* file_mutex acquisitions that had to wait */
+    METRIC_FILE_MUTEX_WAIT_NS,
+    METRIC_DEVICE_OPENS,                /* /dev/aesdchar descriptors opened (chardev backend) */
+    METRIC_BINARY_COMMANDS,             /* commands of binary protocol connections */
+    METRIC_SLOW_CONSUMER_DROPS,         /* readbacks abandoned by the drop policy */
+    METRIC_SLOW_CONSUMER_DISCONNECTS,   /* connections closed for not reading their output */
+    METRIC_SEGMENTS_ROLLED,             /* data segments started after the first one (-r) */
+    METRIC_SEGMENTS_RETIRED,            /* data segments deleted by the retention policy */
+    METRIC_PACKETS_STAGED,              /* packets longer than -B, staged in a file */
+    METRIC_BYTES_STAGED,
+    METRIC_ZEROCOPY_SENDS,              /* readback sends with MSG_ZEROCOPY (-Z) */
+    METRIC_ZEROCOPY_BYTES,
+    METRIC_ZEROCOPY_COPIED,             /* zerocopy sends the kernel completed with a copy */
+    METRIC_COUNTERS
+} metric_counter_t;
+
+/**
+ * @brief Add to a counter of the calling thread
+ */
+void metrics_add(metric_counter_t counter, unsigned long value);
+
+/**
+ * @brief Value of a counter of the calling thread only, to measure what a call added
+ */
+unsigned long metrics_thread_value(metric_counter_t counter);
+
+/**
+ * @brief Sum of a counter over every thread
+ */
+unsigned long metrics_total(metric_counter_t counter);
+
+/**
+ * @brief CLOCK_MONOTONIC in nanoseconds, 0 while the stats listener is off so the
+ *        packet path doesn't read the clock for nothing
+ */
+uint64_t metrics_now(void);
+
+/**
+ * @brief Account a packet whose readback completed
+ *
+ * @param first_byte_ns     [IN]  metrics_now() when its first byte was received, 0 if unknown
+ * @param readback_bytes    [IN]  bytes its readback sent
+ */
+void metrics_packet_done(uint64_t first_byte_ns, unsigned long readback_bytes);
+
+/**
+ * @brief pthread_mutex_lock() that accounts the time spent waiting for the mutex
+ */
+void metrics_mutex_lock(pthread_mutex_t *mutex);
+
+/**
+ * @brief Start the stats listener thread
+ *
+ * @param endpoint  [IN]  TCP port, or path of a UNIX socket if it contains a '/'
+ *
+ * @return 0 on success, -1 on failure
+ */
+int metrics_start(const char *endpoint);
+
+void metrics_stop(void);
+
+#endif /*METRICS_H*/
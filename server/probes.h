@@ -0,0 +1,41 @@
+/**
+ * @file probes.h
+ * @brief USDT probes along the path of a packet, provider "aesdsocket"
+ *
+ *   accept         (fd)                        a client connection was accepted
+ *   packet_framed  (fd, packets, len)          a receive completed packets, len bytes
+ *   lock_acquired  (mutex, wait_ns)            file_mutex is held, wait_ns is 0 uncontended
+ *   append_done    (fd, len, end)              the packets are stored, the readback stops at end
+ *   readback_start (fd, offset, end)           the readback of a packet starts
+ *   readback_done  (fd, bytes)                 the readback of a packet is sent or abandoned
+ *
+ * With <sys/sdt.h> (systemtap-sdt-dev) a probe is a single nop and an ELF note,
+ * patched into a trap only while a tracer is attached, the arguments are values
+ * the caller already holds. Without the header, or built with USE_AESD_PROBES=0,
+ * the macros compile to nothing. aesdsocket-latency.bt turns the probes into a per
+ * stage latency breakdown.
+ */
+#ifndef PROBES_H
+#define PROBES_H
+
+#ifndef USE_AESD_PROBES
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define USE_AESD_PROBES                         1
+#endif
+#endif
+#endif /*USE_AESD_PROBES*/
+
+#if defined(USE_AESD_PROBES) && USE_AESD_PROBES
+#include <sys/sdt.h>
+#define AESD_PROBE1(name, a1)                   DTRACE_PROBE1(aesdsocket, name, a1)
+#define AESD_PROBE2(name, a1, a2)               DTRACE_PROBE2(aesdsocket, name, a1, a2)
+#define AESD_PROBE3(name, a1, a2, a3)           DTRACE_PROBE3(aesdsocket, name, a1, a2, a3)
+#else
+/* sizeof keeps the arguments referenced without evaluating them */
+#define AESD_PROBE1(name, a1)                   do { (void) sizeof(a1); } while (0)
+#define AESD_PROBE2(name, a1, a2)               do { (void) sizeof(a1); (void) sizeof(a2); } while (0)
+#define AESD_PROBE3(name, a1, a2, a3)           do { (void) sizeof(a1); (void) sizeof(a2); (void) sizeof(a3); } while (0)
+#endif /*USE_AESD_PROBES*/
+
+#endif /*PROBES_H*/
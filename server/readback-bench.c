@@ -0,0 +1,196 @@
+/**
+ * @file readback-bench.c
+ * @brief Readback throughput against data file size: read()/send() copy loop versus sendfile()
+ *
+ * A data file of each size is streamed repeatedly to a loopback TCP connection
+ * whose peer only drains the socket, the way aesdsocket streams DATA_FILE_PATH back
+ * after every packet. The copy loop uses the same 1023 octet chunks as the
+ * server's synchronous path.
+ *
+ * Usage: readback-bench [-d directory] [-m max_size_in_bytes]
+ */
+/*--------------------------------- Private includes ---------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <pthread.h>
+/*--------------------------------- Private definitions ---------------------------------  */
+#define MAXDATASIZE                             1024
+#define MIN_FILE_SIZE                           (4 * 1024)
+#define DEFAULT_MAX_FILE_SIZE                   (64 * 1024 * 1024)
+#define BYTES_PER_MEASUREMENT                   (256L * 1024 * 1024)
+#define MIN_ITERATIONS                          3
+/*--------------------------------- Private Functions ---------------------------------  */
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *drain_thread(void *arg)
+{
+    int fd = *(int *) arg;
+    static char sink[256 * 1024];
+    while (recv(fd, sink, sizeof(sink), 0) > 0)
+    {
+    }
+    return NULL;
+}
+
+/**
+ * @brief Connect a loopback TCP pair, the accepted end is drained by a thread
+ */
+static int open_loopback(pthread_t *drainer, int *peer_fd)
+{
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    int client_fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (listen_fd == -1 || client_fd == -1 ||
+        bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+        listen(listen_fd, 1) == -1 ||
+        getsockname(listen_fd, (struct sockaddr *) &addr, &addr_len) == -1 ||
+        connect(client_fd, (struct sockaddr *) &addr, sizeof(addr)) == -1)
+    {
+        perror("loopback setup");
+        exit(EXIT_FAILURE);
+    }
+    *peer_fd = accept(listen_fd, NULL, NULL);
+    close(listen_fd);
+    if (*peer_fd == -1 || pthread_create(drainer, NULL, drain_thread, peer_fd) != 0)
+    {
+        perror("loopback accept");
+        exit(EXIT_FAILURE);
+    }
+    return client_fd;
+}
+
+static void readback_copy(int sock_fd, int file_fd)
+{
+    char file_buf[MAXDATASIZE];
+    ssize_t read_octets;
+    lseek(file_fd, 0, SEEK_SET);
+    while ((read_octets = read(file_fd, file_buf, MAXDATASIZE - 1)) > 0)
+    {
+        send(sock_fd, file_buf, read_octets, 0);
+    }
+}
+
+static void readback_sendfile(int sock_fd, int file_fd, size_t file_size)
+{
+    off_t offset = 0;
+    while ((size_t) offset < file_size)
+    {
+        if (sendfile(sock_fd, file_fd, &offset, file_size - offset) <= 0)
+        {
+            perror("sendfile");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+static int make_data_file(const char *dir, size_t size, char *path, size_t path_len)
+{
+    char line[MAXDATASIZE];
+    snprintf(path, path_len, "%s/readback-bench-XXXXXX", dir);
+    int fd = mkstemp(path);
+    if (fd == -1)
+    {
+        perror("mkstemp");
+        exit(EXIT_FAILURE);
+    }
+    /* Newline framed records like the ones aesdsocket appends */
+    memset(line, 'a', sizeof(line));
+    line[sizeof(line) - 1] = '\n';
+    for (size_t written = 0; written < size;)
+    {
+        size_t chunk = (size - written < sizeof(line)) ? size - written : sizeof(line);
+        if (write(fd, line, chunk) != (ssize_t) chunk)
+        {
+            perror("write");
+            exit(EXIT_FAILURE);
+        }
+        written += chunk;
+    }
+    return fd;
+}
+/*--------------------------------- Public Functions ---------------------------------  */
+int main(int argc, char **argv)
+{
+    const char *dir = "/var/tmp";
+    size_t max_size = DEFAULT_MAX_FILE_SIZE;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:m:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'd':
+            dir = optarg;
+            break;
+        case 'm':
+            max_size = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-d directory] [-m max_size_in_bytes]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    pthread_t drainer;
+    int peer_fd;
+    int sock_fd = open_loopback(&drainer, &peer_fd);
+
+    printf("file_size,iterations,copy_mb_s,sendfile_mb_s,speedup\n");
+    for (size_t size = MIN_FILE_SIZE; size <= max_size; size *= 4)
+    {
+        char path[256];
+        int file_fd = make_data_file(dir, size, path, sizeof(path));
+        long iterations = BYTES_PER_MEASUREMENT / (long) size;
+        if (iterations < MIN_ITERATIONS)
+        {
+            iterations = MIN_ITERATIONS;
+        }
+
+        double start = now_seconds();
+        for (long i = 0; i < iterations; i++)
+        {
+            readback_copy(sock_fd, file_fd);
+        }
+        double copy_time = now_seconds() - start;
+
+        start = now_seconds();
+        for (long i = 0; i < iterations; i++)
+        {
+            readback_sendfile(sock_fd, file_fd, size);
+        }
+        double sendfile_time = now_seconds() - start;
+
+        double total_mb = (double) size * iterations / (1024.0 * 1024.0);
+        printf("%zu,%ld,%.1f,%.1f,%.2f\n", size, iterations, total_mb / copy_time, total_mb / sendfile_time,
+               copy_time / sendfile_time);
+        fflush(stdout);
+        close(file_fd);
+        unlink(path);
+    }
+
+    shutdown(sock_fd, SHUT_WR);
+    pthread_join(drainer, NULL);
+    close(sock_fd);
+    close(peer_fd);
+    return EXIT_SUCCESS;
+}
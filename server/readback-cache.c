@@ -0,0 +1,262 @@
+/**
+ * @file readback-cache.c
+ * @brief Readback snapshot shared by the connections that read back the same data
+ *
+ * cache_lock is held while a snapshot is built, so the readers that miss
+ * together wait for the first one's build and then hit, and only one of them
+ * reads the storage. A snapshot is immutable once published and freed by its
+ * last reference; the cache holds one on the current snapshot. A slow reader
+ * keeps the snapshot it started with, so the memory used is bounded by -C
+ * times the number of readers sending an older generation.
+ */
+/*--------------------------------- Private includes ---------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "aesdsocket.h"
+#include "readback-cache.h"
+#include "zerocopy.h"
+#include "metrics.h"
+#include "log-ring.h"
+/*--------------------------------- Private definitions ---------------------------------  */
+#define READBACK_CACHE_MIN_SIZE                 4096
+
+typedef struct readback_snapshot {
+    atomic_uint refs;
+    uint64_t generation;            /* storage->generation() the bytes were read at */
+    off_t first;                    /* offset of data[0] */
+    off_t end;
+    char data[];
+} readback_snapshot_t;
+/*---------------------------------- Private Variables ----------------------------------  */
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static readback_snapshot_t *cache_current;
+static size_t cache_max_bytes;
+static atomic_ulong stat_hits;
+static atomic_ulong stat_misses;
+static atomic_ulong stat_bypasses;
+static atomic_ulong stat_bytes_saved;
+static atomic_ulong stat_bytes_read;
+/*--------------------------------- Private Functions ---------------------------------  */
+/* Reference of a zerocopy send on the snapshot it reads from */
+static void snapshot_get_ref(void *snapshot)
+{
+    atomic_fetch_add(&((readback_snapshot_t *) snapshot)->refs, 1);
+}
+
+static void snapshot_put_ref(void *snapshot)
+{
+    readback_cache_put((readback_snapshot_t *) snapshot);
+}
+
+/**
+ * @brief Whether a snapshot holds the readback [start, end) of the data at generation
+ */
+static int snapshot_holds(const readback_snapshot_t *snapshot, uint64_t generation, off_t start, off_t end)
+{
+    if (snapshot == NULL || start < snapshot->first || start > snapshot->end)
+    {
+        return 0;
+    }
+    if ((storage->flags & STORAGE_APPEND_ONLY) && end >= 0)
+    {
+        /* Bytes below the end of an older snapshot are still the stored ones */
+        return end <= snapshot->end;
+    }
+    return snapshot->generation == generation && (end < 0 || end <= snapshot->end);
+}
+
+/**
+ * @brief Read the current data into a new snapshot, reusing the bytes of previous
+ *        that an append-only backend still stores
+ *
+ * @return snapshot with one reference, NULL if the data is larger than the cache,
+ *         changed while it was read or can't be read
+ */
+static readback_snapshot_t *snapshot_build(storage_handle_t *handle, const readback_snapshot_t *previous)
+{
+    int append_only = (storage->flags & STORAGE_APPEND_ONLY) != 0;
+    uint64_t generation = storage->generation();
+    off_t first = storage->first();
+    off_t end = storage->length();
+    /* A device doesn't tell its length, grow the snapshot until EOF */
+    int known_end = (end > first);
+    size_t cap = known_end ? (size_t) (end - first) : READBACK_CACHE_MIN_SIZE;
+
+    if (cap > cache_max_bytes)
+    {
+        return NULL;
+    }
+    readback_snapshot_t *snapshot = malloc(sizeof(readback_snapshot_t) + cap);
+    if (snapshot == NULL)
+    {
+        return NULL;
+    }
+    off_t offset = first;
+    if (append_only && previous != NULL && previous->first <= first && first <= previous->end)
+    {
+        memcpy(snapshot->data, previous->data + (first - previous->first), previous->end - first);
+        offset = previous->end;
+    }
+    for (;;)
+    {
+        size_t used = offset - first;
+        if (known_end && offset >= end)
+        {
+            break;
+        }
+        if (used == cap)
+        {
+            readback_snapshot_t *grown = NULL;
+            if (cap * 2 <= cache_max_bytes)
+            {
+                grown = realloc(snapshot, sizeof(readback_snapshot_t) + cap * 2);
+            }
+            if (grown == NULL)
+            {
+                goto func_error;
+            }
+            snapshot = grown;
+            cap *= 2;
+        }
+        off_t read_from = offset;
+        ssize_t read_octets = storage->read(handle, snapshot->data + used, cap - used, &offset);
+        if (read_octets == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (read_octets == -1)
+        {
+            goto func_error;
+        }
+        if (read_octets == 0)
+        {
+            break;
+        }
+        atomic_fetch_add(&stat_bytes_read, offset - read_from);
+    }
+    /* The bytes of a changing backend have to belong to a single generation */
+    if (!append_only && storage->generation() != generation)
+    {
+        goto func_error;
+    }
+    atomic_init(&snapshot->refs, 1);
+    snapshot->generation = generation;
+    snapshot->first = first;
+    snapshot->end = offset;
+    return snapshot;
+
+func_error:
+    free(snapshot);
+    return NULL;
+}
+/*--------------------------------- Public Functions ---------------------------------  */
+int readback_cache_init(size_t max_bytes)
+{
+    cache_max_bytes = (max_bytes > READBACK_CACHE_MIN_SIZE) ? max_bytes : READBACK_CACHE_MIN_SIZE;
+    cache_current = NULL;
+    return 0;
+}
+
+void readback_cache_destroy(void)
+{
+    readback_cache_stats_t stats;
+
+    pthread_mutex_lock(&cache_lock);
+    readback_cache_put(cache_current);
+    cache_current = NULL;
+    pthread_mutex_unlock(&cache_lock);
+
+    readback_cache_get_stats(&stats);
+    unsigned long lookups = stats.hits + stats.misses + stats.bypasses;
+    aesd_log(LOG_INFO, "Readback cache: %lu hits, %lu misses, %lu bypassed (%.1f%% hit rate), %lu bytes saved, %lu read\n",
+             stats.hits, stats.misses, stats.bypasses, (lookups > 0) ? 100.0 * stats.hits / lookups : 0.0,
+             stats.bytes_saved, stats.bytes_read);
+}
+
+readback_snapshot_t *readback_cache_get(storage_handle_t *handle, off_t start, off_t end)
+{
+    readback_snapshot_t *snapshot;
+
+    pthread_mutex_lock(&cache_lock);
+    if (snapshot_holds(cache_current, storage->generation(), start, end))
+    {
+        snapshot = cache_current;
+        off_t stop = (end >= 0 && end < snapshot->end) ? end : snapshot->end;
+        atomic_fetch_add(&stat_hits, 1);
+        atomic_fetch_add(&stat_bytes_saved, (stop > start) ? stop - start : 0);
+    }
+    else if ((snapshot = snapshot_build(handle, cache_current)) != NULL)
+    {
+        readback_cache_put(cache_current);
+        cache_current = snapshot;
+        atomic_fetch_add(&stat_misses, 1);
+    }
+    else
+    {
+        pthread_mutex_unlock(&cache_lock);
+        atomic_fetch_add(&stat_bypasses, 1);
+        return NULL;
+    }
+    atomic_fetch_add(&snapshot->refs, 1);
+    pthread_mutex_unlock(&cache_lock);
+    return snapshot;
+}
+
+int readback_cache_send(int sock_fd, readback_snapshot_t *snapshot, off_t *offset, off_t end, zerocopy_t *zc)
+{
+    zerocopy_ref_t ref = { .get = snapshot_get_ref, .put = snapshot_put_ref, .owner = snapshot };
+
+    if (end < 0 || end > snapshot->end)
+    {
+        end = snapshot->end;
+    }
+    if (*offset < snapshot->first)
+    {
+        /* Retired since the readback started, like data_file_send() does */
+        *offset = snapshot->first;
+    }
+    zc = zerocopy_for(zc, (end > *offset) ? end - *offset : 0);
+    while (*offset < end)
+    {
+        struct iovec iov = { .iov_base = snapshot->data + (*offset - snapshot->first), .iov_len = end - *offset };
+        struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+        ssize_t sent_octets = (zc != NULL) ? zerocopy_sendmsg(zc, &msg, &ref) : sendmsg(sock_fd, &msg, MSG_NOSIGNAL);
+        if (sent_octets == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? READBACK_WOULD_BLOCK : -1;
+        }
+        metrics_add(METRIC_BYTES_OUT, sent_octets);
+        *offset += sent_octets;
+    }
+    return READBACK_DONE;
+}
+
+void readback_cache_put(readback_snapshot_t *snapshot)
+{
+    if (snapshot != NULL && atomic_fetch_sub(&snapshot->refs, 1) == 1)
+    {
+        free(snapshot);
+    }
+}
+
+void readback_cache_get_stats(readback_cache_stats_t *stats)
+{
+    stats->hits = atomic_load(&stat_hits);
+    stats->misses = atomic_load(&stat_misses);
+    stats->bypasses = atomic_load(&stat_bypasses);
+    stats->bytes_saved = atomic_load(&stat_bytes_saved);
+    stats->bytes_read = atomic_load(&stat_bytes_read);
+}
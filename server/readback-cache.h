@@ -0,0 +1,81 @@
+/**
+ * @file readback-cache.h
+ * @brief Readback snapshot shared by the connections that read back the same data
+ *
+ * Every packet is answered with the whole stored data, so clients finishing a
+ * packet at about the same moment all read the same bytes. With -C the first
+ * of them materializes the data in memory, keyed by the storage generation, and
+ * the others send from that snapshot instead of reading the storage again.
+ * On an append-only backend an appended packet doesn't invalidate the
+ * snapshot: a readback that stops below its end is still served from it, and
+ * the next snapshot copies the bytes it shares with the previous one and only
+ * reads the appended tail. The other backends rebuild it whenever their
+ * generation moves.
+ */
+#ifndef READBACK_CACHE_H
+#define READBACK_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "storage.h"
+
+struct readback_snapshot;
+struct zerocopy;
+
+/**
+ * @brief Snapshot of the cache counters
+ */
+typedef struct readback_cache_stats {
+    unsigned long hits;                 /* readbacks served from an existing snapshot */
+    unsigned long misses;               /* readbacks that built the snapshot they are served from */
+    unsigned long bypasses;             /* readbacks of data larger than the cache, or changing under it */
+    unsigned long bytes_saved;          /* bytes the hits did not read from the storage */
+    unsigned long bytes_read;           /* bytes read from the storage to build snapshots */
+} readback_cache_stats_t;
+
+/**
+ * @brief Start caching readbacks of up to max_bytes
+ *
+ * @return 0 on success, -1 on failure
+ */
+int readback_cache_init(size_t max_bytes);
+
+/**
+ * @brief Drop the snapshot and log the counters, every snapshot must be released
+ */
+void readback_cache_destroy(void);
+
+/**
+ * @brief Pin a snapshot holding [start, end) of the current data, built from the
+ *        handle if the cached one doesn't hold it
+ *
+ * @param handle    [IN]  storage handle of the reader, used to build the snapshot
+ * @param start     [IN]  first offset of the readback
+ * @param end       [IN]  offset the readback stops at, -1 for the end of the data
+ *
+ * @return snapshot to pass to readback_cache_send(), NULL if the caller has to
+ *         read the storage itself
+ */
+struct readback_snapshot *readback_cache_get(storage_handle_t *handle, off_t start, off_t end);
+
+/**
+ * @brief Send [*offset, end) of a snapshot, *offset is advanced by the bytes sent
+ *
+ * @param zc        [IN]  zerocopy tracker of the connection, NULL copies the bytes. A rest
+ *                        of at least -Z is sent with MSG_ZEROCOPY and the snapshot stays
+ *                        referenced until the kernel completes it
+ *
+ * @return READBACK_DONE when everything is sent, READBACK_WOULD_BLOCK if the socket
+ *         is full, -1 on error
+ */
+int readback_cache_send(int sock_fd, struct readback_snapshot *snapshot, off_t *offset, off_t end, struct zerocopy *zc);
+
+/**
+ * @brief Drop the reference of readback_cache_get(), safe on NULL
+ */
+void readback_cache_put(struct readback_snapshot *snapshot);
+
+void readback_cache_get_stats(readback_cache_stats_t *stats);
+
+#endif /*READBACK_CACHE_H*/
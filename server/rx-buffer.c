@@ -0,0 +1,234 @@
+/**
+ * @file rx-buffer.c
+ * @brief Pooled per-connection receive buffers
+ *
+ * Every size class keeps a free list of released buffers behind its own mutex,
+ * bounded to RX_POOL_CLASS_BYTES per class so a burst of large packets doesn't
+ * pin memory forever. Buffers above RX_BUFFER_MAX_CACHED_SIZE are allocated
+ * and freed directly.
+ */
+/*--------------------------------- Private includes ---------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <syslog.h>
+#include <pthread.h>
+#include "rx-buffer.h"
+#include "log-ring.h"
+/*--------------------------------- Private definitions ---------------------------------  */
+#define RX_POOL_CLASSES                         9       /* 4KB .. 1MB */
+#define RX_POOL_CLASS_BYTES                     (4 * 1024 * 1024)
+#define RX_POOL_MIN_CACHED                      4
+
+typedef struct rx_free_buffer {
+    struct rx_free_buffer *next;
+} rx_free_buffer_t;
+
+typedef struct rx_pool_class {
+    pthread_mutex_t lock;
+    rx_free_buffer_t *free_list;
+    unsigned int count;
+} rx_pool_class_t;
+/*---------------------------------- Private Variables ----------------------------------  */
+static rx_pool_class_t pool_classes[RX_POOL_CLASSES] = {
+    [0 ... RX_POOL_CLASSES - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER },
+};
+static atomic_ulong stat_packets;
+static atomic_ulong stat_mallocs;
+static atomic_ulong stat_pool_hits;
+static atomic_ulong stat_grows;
+static atomic_ulong stat_compactions;
+/*--------------------------------- Private Functions ---------------------------------  */
+/**
+ * @brief Size class able to hold size bytes, RX_POOL_CLASSES if none is
+ */
+static unsigned int pool_class_of(size_t size)
+{
+    unsigned int index = 0;
+    size_t class_size = RX_BUFFER_MIN_SIZE;
+
+    while (index < RX_POOL_CLASSES && class_size < size)
+    {
+        class_size <<= 1;
+        index++;
+    }
+    return index;
+}
+
+static size_t pool_class_size(unsigned int index)
+{
+    return (size_t) RX_BUFFER_MIN_SIZE << index;
+}
+
+static unsigned int pool_class_limit(unsigned int index)
+{
+    unsigned int limit = RX_POOL_CLASS_BYTES / pool_class_size(index);
+    return (limit < RX_POOL_MIN_CACHED) ? RX_POOL_MIN_CACHED : limit;
+}
+
+/**
+ * @brief Get a buffer of at least size bytes
+ *
+ * @param cap   [OUT] real capacity of the buffer
+ */
+static char *pool_get(size_t size, size_t *cap)
+{
+    unsigned int index = pool_class_of(size);
+
+    if (index < RX_POOL_CLASSES)
+    {
+        rx_pool_class_t *pool_class = &pool_classes[index];
+        rx_free_buffer_t *buffer;
+
+        pthread_mutex_lock(&pool_class->lock);
+        buffer = pool_class->free_list;
+        if (buffer != NULL)
+        {
+            pool_class->free_list = buffer->next;
+            pool_class->count--;
+        }
+        pthread_mutex_unlock(&pool_class->lock);
+
+        *cap = pool_class_size(index);
+        if (buffer != NULL)
+        {
+            atomic_fetch_add_explicit(&stat_pool_hits, 1, memory_order_relaxed);
+            return (char *) buffer;
+        }
+        size = *cap;
+    }
+    else
+    {
+        *cap = size;
+    }
+    atomic_fetch_add_explicit(&stat_mallocs, 1, memory_order_relaxed);
+    return malloc(size);
+}
+
+static void pool_put(char *data, size_t cap)
+{
+    unsigned int index = pool_class_of(cap);
+
+    if (index < RX_POOL_CLASSES && pool_class_size(index) == cap)
+    {
+        rx_pool_class_t *pool_class = &pool_classes[index];
+        rx_free_buffer_t *buffer = (rx_free_buffer_t *) data;
+
+        pthread_mutex_lock(&pool_class->lock);
+        if (pool_class->count < pool_class_limit(index))
+        {
+            buffer->next = pool_class->free_list;
+            pool_class->free_list = buffer;
+            pool_class->count++;
+            data = NULL;
+        }
+        pthread_mutex_unlock(&pool_class->lock);
+    }
+    free(data);
+}
+/*--------------------------------- Public Functions ---------------------------------  */
+int rx_buffer_reserve(rx_buffer_t *rx, size_t min_free)
+{
+    size_t pending = rx->len - rx->start;
+    /* One spare byte keeps the received bytes NUL terminated for the string parsers */
+    size_t needed = pending + min_free + 1;
+
+    if (rx->data != NULL && rx->cap - rx->len >= min_free + 1)
+    {
+        return 0;
+    }
+    if (rx->data != NULL && rx->cap >= needed)
+    {
+        memmove(rx->data, rx->data + rx->start, pending);
+        rx->start = 0;
+        rx->len = pending;
+        atomic_fetch_add_explicit(&stat_compactions, 1, memory_order_relaxed);
+        return 0;
+    }
+
+    /* Grow geometrically so a large packet costs log2(size) grows */
+    if (rx->data != NULL && needed < rx->cap * 2)
+    {
+        needed = rx->cap * 2;
+    }
+    size_t cap;
+    char *data = pool_get(needed, &cap);
+    if (data == NULL)
+    {
+        aesd_log(LOG_ERR, "Can't allocate a receive buffer of %zu bytes\n", needed);
+        return -1;
+    }
+    if (rx->data != NULL)
+    {
+        memcpy(data, rx->data + rx->start, pending);
+        pool_put(rx->data, rx->cap);
+        atomic_fetch_add_explicit(&stat_grows, 1, memory_order_relaxed);
+    }
+    rx->data = data;
+    rx->cap = cap;
+    rx->start = 0;
+    rx->len = pending;
+    return 0;
+}
+
+void rx_buffer_consume(rx_buffer_t *rx, size_t len, size_t packets)
+{
+    rx->start += len;
+    if (rx->start == rx->len)
+    {
+        /* Empty again, the next recv starts at the front */
+        rx->start = rx->len = 0;
+    }
+    atomic_fetch_add_explicit(&stat_packets, packets, memory_order_relaxed);
+}
+
+void rx_buffer_release(rx_buffer_t *rx)
+{
+    if (rx->data != NULL)
+    {
+        pool_put(rx->data, rx->cap);
+    }
+    memset(rx, 0, sizeof(*rx));
+}
+
+void rx_pool_get_stats(rx_pool_stats_t *stats)
+{
+    stats->packets = atomic_load(&stat_packets);
+    stats->mallocs = atomic_load(&stat_mallocs);
+    stats->pool_hits = atomic_load(&stat_pool_hits);
+    stats->grows = atomic_load(&stat_grows);
+    stats->compactions = atomic_load(&stat_compactions);
+    stats->cached = 0;
+    for (unsigned int i = 0; i < RX_POOL_CLASSES; i++)
+    {
+        pthread_mutex_lock(&pool_classes[i].lock);
+        stats->cached += pool_classes[i].count;
+        pthread_mutex_unlock(&pool_classes[i].lock);
+    }
+}
+
+void rx_pool_destroy(void)
+{
+    rx_pool_stats_t stats;
+
+    rx_pool_get_stats(&stats);
+    aesd_log(LOG_INFO, "Receive buffers: %lu packets, %lu mallocs (%.4f per packet), %lu pool hits, %lu grows, %lu compactions\n",
+           stats.packets, stats.mallocs, stats.packets ? (double) stats.mallocs / stats.packets : 0.0,
+           stats.pool_hits, stats.grows, stats.compactions);
+
+    for (unsigned int i = 0; i < RX_POOL_CLASSES; i++)
+    {
+        pthread_mutex_lock(&pool_classes[i].lock);
+        rx_free_buffer_t *buffer = pool_classes[i].free_list;
+        pool_classes[i].free_list = NULL;
+        pool_classes[i].count = 0;
+        pthread_mutex_unlock(&pool_classes[i].lock);
+        while (buffer != NULL)
+        {
+            rx_free_buffer_t *next = buffer->next;
+            free(buffer);
+            buffer = next;
+        }
+    }
+}
@@ -0,0 +1,81 @@
+/**
+ * @file rx-buffer.h
+ * @brief Pooled per-connection receive buffers
+ *
+ * Sockets receive straight into the free tail of the buffer. Consumed packets
+ * only advance a start offset; the unconsumed bytes are moved to the front when
+ * the tail runs short, which is rare and never per packet. Buffers come from
+ * power of two size classes whose released buffers are cached, so steady state
+ * connections and reconnecting clients don't call malloc() at all, and a large
+ * packet costs a logarithmic number of grows instead of one realloc per recv.
+ */
+#ifndef RX_BUFFER_H
+#define RX_BUFFER_H
+
+#include <stddef.h>
+
+#define RX_BUFFER_MIN_SIZE                      (4 * 1024)
+#define RX_BUFFER_MAX_CACHED_SIZE               (1024 * 1024)   /* larger buffers go back to free() */
+#define RX_BUFFER_MIN_FREE                      1024            /* free tail guaranteed before a recv */
+
+typedef struct rx_buffer {
+    char *data;                 /* NULL while the connection is idle */
+    size_t cap;
+    size_t start;               /* first unconsumed byte */
+    size_t len;                 /* end of the received bytes */
+} rx_buffer_t;
+
+/**
+ * @brief Snapshot of the pool counters
+ */
+typedef struct rx_pool_stats {
+    unsigned long packets;          /* packets consumed from the buffers */
+    unsigned long mallocs;          /* buffers the pool had to allocate */
+    unsigned long pool_hits;        /* buffers served from the cache */
+    unsigned long grows;            /* moves to a bigger size class */
+    unsigned long compactions;      /* unconsumed bytes moved to the front */
+    unsigned long cached;           /* buffers currently in the cache */
+} rx_pool_stats_t;
+
+/**
+ * @brief Make room for at least min_free bytes after rx->len, plus a terminating NUL
+ *
+ * @return 0 on success, -1 if memory ran out, the buffer is left untouched
+ */
+int rx_buffer_reserve(rx_buffer_t *rx, size_t min_free);
+
+/**
+ * @brief Pointer to the first unconsumed byte and number of unconsumed bytes
+ */
+static inline char *rx_buffer_head(const rx_buffer_t *rx)
+{
+    return rx->data + rx->start;
+}
+
+static inline size_t rx_buffer_pending(const rx_buffer_t *rx)
+{
+    return rx->len - rx->start;
+}
+
+/**
+ * @brief Drop consumed bytes from the head of the buffer
+ *
+ * @param rx        [IN]  buffer
+ * @param len       [IN]  number of bytes consumed
+ * @param packets   [IN]  number of packets in those bytes, for the statistics
+ */
+void rx_buffer_consume(rx_buffer_t *rx, size_t len, size_t packets);
+
+/**
+ * @brief Give the memory back to the pool, safe on an idle buffer
+ */
+void rx_buffer_release(rx_buffer_t *rx);
+
+void rx_pool_get_stats(rx_pool_stats_t *stats);
+
+/**
+ * @brief Free the cached buffers and log the allocation statistics
+ */
+void rx_pool_destroy(void);
+
+#endif /*RX_BUFFER_H*/
@@ -0,0 +1,616 @@
+/**
+ * @file storage.c
+ * @brief Storage backends of the packets: the data file, /dev/aesdchar and an
+ *        in-process copy of the aesdchar circular buffer
+ *
+ * The memory backend runs the same circular buffer code as the driver under
+ * file_mutex, the mutex the device writes are serialized with. Like the driver
+ * it holds a write without a newline back until the newline arrives, and a
+ * read never blocks an append for longer than one copy.
+ *
+ * A staged packet reaches chardev and memory as a series of writes under
+ * file_mutex, the first ones without a newline, so the device and the ring
+ * build its entry out of them exactly like they do for a client writing a
+ * line in pieces, and no other packet can end up inside it.
+ */
+/*--------------------------------- Private includes ---------------------------------*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <syslog.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include "../aesd-char-driver/aesd_ioctl.h"
+#include "../aesd-char-driver/aesd-circular-buffer.h"
+#include "aesdsocket.h"
+#include "storage.h"
+#include "data-file.h"
+#include "group-commit.h"
+#include "metrics.h"
+#include "log-ring.h"
+/*--------------------------------- Private definitions ---------------------------------  */
+#define STORAGE_STAGE_CHUNK                     (64 * 1024)
+/*---------------------------------- Private Variables ----------------------------------  */
+static const char *storage_path;
+/* Entries added to the device or the ring, the device can't tell about other writers */
+static atomic_ulong entries_added;
+/* memory backend, guarded by file_mutex */
+static struct aesd_circular_buffer ring;
+static struct aesd_buffer_entry ring_pending;
+static size_t ring_len;
+/*--------------------------------- Private Functions ---------------------------------  */
+static int no_open(storage_handle_t *handle)
+{
+    handle->fd = UNINIT_VALUE;
+    return 0;
+}
+
+static void no_close(storage_handle_t *handle)
+{
+    (void) handle;
+}
+
+static off_t zero_offset(void)
+{
+    return 0;
+}
+
+static uint64_t entries_generation(void)
+{
+    return atomic_load(&entries_added);
+}
+
+/**
+ * @brief Write a staged packet with write_locked a chunk at a time, file_mutex held by
+ *        the caller for the whole packet
+ *
+ * @return 0 on success, -1 if the stage can't be read or a write failed
+ */
+static int write_staged(int (*write_locked)(storage_handle_t *, const char *, size_t), storage_handle_t *handle,
+                        int stage_fd, off_t stage_len, const char *tail, size_t tail_len)
+{
+    char chunk[STORAGE_STAGE_CHUNK];
+    off_t offset = 0;
+
+    while (offset < stage_len)
+    {
+        size_t want = (stage_len - offset < (off_t) sizeof(chunk)) ? (size_t) (stage_len - offset) : sizeof(chunk);
+        ssize_t read_octets = pread(stage_fd, chunk, want, offset);
+        if (read_octets == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (read_octets <= 0 || write_locked(handle, chunk, read_octets) == -1)
+        {
+            return -1;
+        }
+        offset += read_octets;
+    }
+    return write_locked(handle, tail, tail_len);
+}
+
+/* ------------------------------------ file ------------------------------------ */
+static int file_start(const char *path)
+{
+    storage_path = path;
+    if (server_config.segment_size > 0)
+    {
+        /* No single descriptor, every access goes through the data_file_*() calls */
+        if (data_file_init_segments(path) == -1)
+        {
+            aesd_log(LOG_ERR, "Error opening/creating the segments\n");
+            return -1;
+        }
+        return 0;
+    }
+    /* No O_APPEND: appends reserve their offset and use pwrite(), see data-file.c */
+    data_packet_fd = open(path, O_CREAT | O_RDWR, S_IRWXU | S_IRWXG | S_IRWXO);
+    if (data_packet_fd == -1 || data_file_init(data_packet_fd) == -1)
+    {
+        aesd_log(LOG_ERR, "Error opening/creating the file\n");
+        return -1;
+    }
+    return 0;
+}
+
+static void file_stop(void)
+{
+    if (server_config.segment_size > 0)
+    {
+        data_file_remove_segments();
+        return;
+    }
+    close(data_packet_fd);
+    data_packet_fd = UNINIT_VALUE;
+    unlink(storage_path);
+}
+
+static int file_append(storage_handle_t *handle, const char *buf, size_t len, off_t *end)
+{
+    if ((*end = append_packets(buf, len)) == -1)
+    {
+        return -1;
+    }
+    handle->position = data_file_start();
+    return 0;
+}
+
+static int file_append_staged(storage_handle_t *handle, int stage_fd, off_t stage_len, const char *tail, size_t tail_len,
+                              off_t *end)
+{
+    /* Not through the group commit writer, its batches are gathered in memory. Both
+       reserve their range the same way, so the order of the packets holds */
+    if ((*end = data_file_append_staged(stage_fd, stage_len, tail, tail_len)) == -1)
+    {
+        return -1;
+    }
+    handle->position = data_file_start();
+    return 0;
+}
+
+/**
+ * @brief File equivalent of AESDCHAR_IOCSEEKTO: every newline terminated line of the
+ *        stored data is one write command
+ */
+static int file_seekto(storage_handle_t *handle, uint32_t write_cmd, uint32_t cmd_offset)
+{
+    off_t entry_start;
+    off_t entry_end;
+
+    int found = data_file_record(write_cmd, &entry_start, &entry_end);
+    if (found != 0)
+    {
+        return found;
+    }
+    if ((off_t) cmd_offset >= entry_end - entry_start)
+    {
+        return 1;
+    }
+    handle->position = entry_start + cmd_offset;
+    return 0;
+}
+
+static ssize_t file_read(storage_handle_t *handle, void *buf, size_t len, off_t *offset)
+{
+    (void) handle;
+    return data_file_pread(buf, len, offset);
+}
+
+static int file_send(storage_handle_t *handle, int sock_fd, off_t *offset, off_t end)
+{
+    (void) handle;
+    return data_file_send(sock_fd, offset, end);
+}
+
+/**
+ * @brief The data file only grows, its published length tells every version apart
+ */
+static uint64_t file_generation(void)
+{
+    return (uint64_t) data_file_committed();
+}
+
+/* ----------------------------------- chardev ----------------------------------- */
+static int chardev_start(const char *path)
+{
+    /* Nothing to open, every connection gets its own descriptor */
+    storage_path = path;
+    return 0;
+}
+
+static void chardev_stop(void)
+{
+}
+
+static int chardev_open(storage_handle_t *handle)
+{
+    handle->fd = open(storage_path, O_RDWR | O_APPEND, S_IRWXU | S_IRWXG | S_IRWXO);
+    if (handle->fd == -1)
+    {
+        aesd_log(LOG_ERR, "Error opening the device file %s: %s\n", storage_path, strerror(errno));
+        return -1;
+    }
+    metrics_add(METRIC_DEVICE_OPENS, 1);
+    return 0;
+}
+
+static void chardev_close(storage_handle_t *handle)
+{
+    close(handle->fd);
+    handle->fd = UNINIT_VALUE;
+}
+
+/**
+ * @brief One write() to the device, file_mutex held
+ */
+static int chardev_write(storage_handle_t *handle, const char *buf, size_t len)
+{
+    return (write(handle->fd, buf, len) == -1) ? -1 : 0;
+}
+
+/**
+ * @brief Position the handle after the append of a packet
+ */
+static int chardev_appended(storage_handle_t *handle, int status, off_t *end)
+{
+    if (status == -1)
+    {
+        aesd_log(LOG_ERR, "Error Writing in the file\n");
+        return -1;
+    }
+    /* The readback of an appended packet starts from the oldest entry, the driver
+       knows where the data ends */
+    lseek(handle->fd, 0, SEEK_SET);
+    handle->position = 0;
+    *end = -1;
+    atomic_fetch_add(&entries_added, 1);
+    return 0;
+}
+
+static int chardev_append(storage_handle_t *handle, const char *buf, size_t len, off_t *end)
+{
+    metrics_mutex_lock(&file_mutex);
+    int status = chardev_write(handle, buf, len);
+    pthread_mutex_unlock(&file_mutex);
+    return chardev_appended(handle, status, end);
+}
+
+static int chardev_append_staged(storage_handle_t *handle, int stage_fd, off_t stage_len, const char *tail,
+                                 size_t tail_len, off_t *end)
+{
+    metrics_mutex_lock(&file_mutex);
+    int status = write_staged(chardev_write, handle, stage_fd, stage_len, tail, tail_len);
+    pthread_mutex_unlock(&file_mutex);
+    return chardev_appended(handle, status, end);
+}
+
+static int chardev_seekto(storage_handle_t *handle, uint32_t write_cmd, uint32_t cmd_offset)
+{
+    struct aesd_seekto seek_to = { write_cmd, cmd_offset };
+
+    if (ioctl(handle->fd, AESDCHAR_IOCSEEKTO, &seek_to) == -1)
+    {
+        return (errno == EINVAL) ? 1 : -1;
+    }
+    handle->position = lseek(handle->fd, 0, SEEK_CUR);
+    return (handle->position == -1) ? -1 : 0;
+}
+
+static ssize_t chardev_read(storage_handle_t *handle, void *buf, size_t len, off_t *offset)
+{
+    /* The driver reads from the descriptor position, it can't pread() */
+    if (lseek(handle->fd, *offset, SEEK_SET) == -1)
+    {
+        return -1;
+    }
+    ssize_t read_octets = read(handle->fd, buf, len);
+    if (read_octets > 0)
+    {
+        *offset += read_octets;
+    }
+    return read_octets;
+}
+
+/* ----------------------------------- memory ----------------------------------- */
+static int memory_start(const char *path)
+{
+    (void) path;
+    aesd_circular_buffer_init(&ring);
+    ring_pending.buffptr = NULL;
+    ring_pending.size = 0;
+    ring_len = 0;
+    return 0;
+}
+
+static void memory_stop(void)
+{
+    struct aesd_buffer_entry *entry;
+    uint8_t index;
+
+    AESD_CIRCULAR_BUFFER_FOREACH(entry, &ring, index)
+    {
+        free((char *) entry->buffptr);
+    }
+    free((char *) ring_pending.buffptr);
+    memory_start(NULL);
+}
+
+/**
+ * @brief aesd_write() into the ring, file_mutex held
+ */
+static int memory_write(storage_handle_t *handle, const char *buf, size_t len)
+{
+    (void) handle;
+    /* A write without a newline waits for the rest of its entry, as in aesd_write() */
+    char *entry = realloc((char *) ring_pending.buffptr, ring_pending.size + len);
+    if (entry == NULL)
+    {
+        aesd_log(LOG_ERR, "malloc failed\n");
+        return -1;
+    }
+    memcpy(entry + ring_pending.size, buf, len);
+    ring_pending.buffptr = entry;
+    ring_pending.size += len;
+    if (memchr(buf, '\n', len) != NULL)
+    {
+        if (ring.full)
+        {
+            /* add_entry() overwrites the oldest entry, its memory is ours */
+            ring_len -= ring.entry[ring.out_offs].size;
+            free((char *) ring.entry[ring.out_offs].buffptr);
+        }
+        aesd_circular_buffer_add_entry(&ring, &ring_pending);
+        ring_len += ring_pending.size;
+        ring_pending.buffptr = NULL;
+        ring_pending.size = 0;
+        atomic_fetch_add(&entries_added, 1);
+    }
+    return 0;
+}
+
+static int memory_append(storage_handle_t *handle, const char *buf, size_t len, off_t *end)
+{
+    metrics_mutex_lock(&file_mutex);
+    int status = memory_write(handle, buf, len);
+    *end = (off_t) ring_len;
+    pthread_mutex_unlock(&file_mutex);
+    handle->position = 0;
+    return status;
+}
+
+static int memory_append_staged(storage_handle_t *handle, int stage_fd, off_t stage_len, const char *tail,
+                                size_t tail_len, off_t *end)
+{
+    metrics_mutex_lock(&file_mutex);
+    int status = write_staged(memory_write, handle, stage_fd, stage_len, tail, tail_len);
+    *end = (off_t) ring_len;
+    pthread_mutex_unlock(&file_mutex);
+    handle->position = 0;
+    return status;
+}
+
+static int memory_seekto(storage_handle_t *handle, uint32_t write_cmd, uint32_t cmd_offset)
+{
+    off_t position = 0;
+    int status = 1;
+
+    metrics_mutex_lock(&file_mutex);
+    /* write_cmd counts from the oldest entry */
+    if (write_cmd < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
+    {
+        for (uint32_t cmd = 0; cmd <= write_cmd; cmd++)
+        {
+            const struct aesd_buffer_entry *entry =
+                &ring.entry[(ring.out_offs + cmd) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+            if (entry->size == 0)
+            {
+                break;
+            }
+            if (cmd == write_cmd)
+            {
+                status = (cmd_offset < entry->size) ? 0 : 1;
+                break;
+            }
+            position += entry->size;
+        }
+    }
+    pthread_mutex_unlock(&file_mutex);
+    if (status == 0)
+    {
+        handle->position = position + cmd_offset;
+    }
+    return status;
+}
+
+static ssize_t memory_read(storage_handle_t *handle, void *buf, size_t len, off_t *offset)
+{
+    size_t read_octets = 0;
+
+    (void) handle;
+    metrics_mutex_lock(&file_mutex);
+    /* Unlike aesd_read() a read carries on into the next entries */
+    while (read_octets < len && *offset >= 0 && (size_t) *offset < ring_len)
+    {
+        size_t entry_offset;
+        struct aesd_buffer_entry *entry = aesd_circular_buffer_find_entry_offset_for_fpos(&ring, *offset, &entry_offset);
+        if (entry == NULL || entry->size == 0)
+        {
+            break;
+        }
+        size_t chunk = entry->size - entry_offset;
+        if (chunk > len - read_octets)
+        {
+            chunk = len - read_octets;
+        }
+        memcpy((char *) buf + read_octets, entry->buffptr + entry_offset, chunk);
+        read_octets += chunk;
+        *offset += chunk;
+    }
+    pthread_mutex_unlock(&file_mutex);
+    return (ssize_t) read_octets;
+}
+
+static off_t memory_length(void)
+{
+    metrics_mutex_lock(&file_mutex);
+    off_t len = (off_t) ring_len;
+    pthread_mutex_unlock(&file_mutex);
+    return len;
+}
+
+static const storage_backend_t backends[] = {
+    {
+        .name         = "file",
+        .default_path = DATA_FILE_PATH,
+        .flags        = STORAGE_DATA_FILE | STORAGE_APPEND_ONLY,
+        .start        = file_start,
+        .stop         = file_stop,
+        .open         = no_open,
+        .close        = no_close,
+        .append       = file_append,
+        .append_staged = file_append_staged,
+        .seekto       = file_seekto,
+        .read         = file_read,
+        .send         = file_send,
+        .first        = data_file_start,
+        .length       = data_file_committed,
+        .generation   = file_generation,
+    },
+    {
+        .name         = "chardev",
+        .default_path = DEVICE_PATH,
+        .flags        = STORAGE_SEEK_COMMANDS | STORAGE_DESCRIPTOR,
+        .start        = chardev_start,
+        .stop         = chardev_stop,
+        .open         = chardev_open,
+        .close        = chardev_close,
+        .append       = chardev_append,
+        .append_staged = chardev_append_staged,
+        .seekto       = chardev_seekto,
+        .read         = chardev_read,
+        /* aesdchar has no splice_read, sendfile() would always fall back */
+        .send         = NULL,
+        .first        = zero_offset,
+        /* The device size is only known through a descriptor */
+        .length       = zero_offset,
+        .generation   = entries_generation,
+    },
+    {
+        .name         = "memory",
+        .default_path = NULL,
+        .flags        = STORAGE_SEEK_COMMANDS,
+        .start        = memory_start,
+        .stop         = memory_stop,
+        .open         = no_open,
+        .close        = no_close,
+        .append       = memory_append,
+        .append_staged = memory_append_staged,
+        .seekto       = memory_seekto,
+        .read         = memory_read,
+        .send         = NULL,
+        .first        = zero_offset,
+        .length       = memory_length,
+        .generation   = entries_generation,
+    },
+};
+/*---------------------------------- Public Variables ----------------------------------  */
+const storage_backend_t *storage = &backends[USE_AESD_CHAR_DEVICE ? 1 : 0];
+/*--------------------------------- Public Functions ---------------------------------  */
+int storage_select(const char *name)
+{
+    for (size_t i = 0; i < sizeof backends / sizeof backends[0]; i++)
+    {
+        if (strcmp(name, backends[i].name) == 0)
+        {
+            storage = &backends[i];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int storage_open(storage_handle_t *handle)
+{
+    if (handle->opened)
+    {
+        return 0;
+    }
+    handle->position = storage->first();
+    if (storage->open(handle) == -1)
+    {
+        handle->fd = UNINIT_VALUE;
+        return -1;
+    }
+    handle->opened = 1;
+    return 0;
+}
+
+void storage_close(storage_handle_t *handle)
+{
+    if (handle->opened)
+    {
+        storage->close(handle);
+    }
+    handle->opened = 0;
+    handle->fd = UNINIT_VALUE;
+}
+
+int storage_stage_write(storage_stage_t *stage, const char *buf, size_t len)
+{
+    if (stage->len == 0)
+    {
+        stage->fd = open(STAGE_DIR, O_TMPFILE | O_RDWR | O_CLOEXEC, S_IRUSR | S_IWUSR);
+        if (stage->fd == -1 && (errno == EOPNOTSUPP || errno == EISDIR || errno == EINVAL))
+        {
+            /* No O_TMPFILE on this filesystem, unlink a named file right away */
+            char name[] = STAGE_DIR "/aesdsocket-stage.XXXXXX";
+            stage->fd = mkostemp(name, O_CLOEXEC);
+            if (stage->fd != -1)
+            {
+                unlink(name);
+            }
+        }
+        if (stage->fd == -1)
+        {
+            aesd_log(LOG_ERR, "Can't create a staging file in %s: %s\n", STAGE_DIR, strerror(errno));
+            return -1;
+        }
+        metrics_add(METRIC_PACKETS_STAGED, 1);
+    }
+    while (len > 0)
+    {
+        ssize_t written_octets = write(stage->fd, buf, len);
+        if (written_octets == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (written_octets == -1)
+        {
+            aesd_log(LOG_ERR, "Can't stage a packet: %s\n", strerror(errno));
+            if (stage->len == 0)
+            {
+                close(stage->fd);
+            }
+            return -1;
+        }
+        buf += written_octets;
+        len -= written_octets;
+        stage->len += written_octets;
+        metrics_add(METRIC_BYTES_STAGED, written_octets);
+    }
+    return 0;
+}
+
+int storage_stage_commit(storage_handle_t *handle, storage_stage_t *stage, const char *tail, size_t tail_len,
+                         off_t *end)
+{
+    int status = storage->append_staged(handle, stage->fd, stage->len, tail, tail_len, end);
+    storage_stage_discard(stage);
+    return status;
+}
+
+void storage_stage_discard(storage_stage_t *stage)
+{
+    if (stage->len > 0)
+    {
+        close(stage->fd);
+    }
+    stage->len = 0;
+    stage->fd = UNINIT_VALUE;
+}
+
+off_t append_packets(const char *packets, size_t len)
+{
+    if (server_config.group_commit)
+    {
+        off_t committed_len;
+        return (group_commit_append(packets, len, &committed_len) == 0) ? committed_len : -1;
+    }
+    return data_file_append(packets, len);
+}
@@ -0,0 +1,148 @@
+/**
+ * @file storage.h
+ * @brief Storage backends of the packets, selected at run time with -t
+ *
+ *   file     DATA_FILE_PATH, appended through data-file.c. The only backend the
+ *            append log (-m), group commit (-g), segments (-r) and timestamps (-i)
+ *            apply to
+ *   chardev  DEVICE_PATH, the aesdchar driver. Every connection gets its own
+ *            descriptor, the driver keeps the last AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
+ *            writes
+ *   memory   the aesdchar circular buffer run in the server process, it behaves
+ *            like chardev without the driver being loaded, for load tests
+ *
+ * Offsets are positions in the data as a reader sees it. A connection has a
+ * handle holding its read position: an append rewinds it to the oldest data,
+ * a seek command moves it to a write command, which is where the readback of
+ * the packet starts. chardev and memory accept the AESD_SEEKTO_COMMAND text
+ * packets, their offsets restart at 0 whenever the oldest entry is overwritten.
+ *
+ * A packet longer than -B is not buffered whole: its head is staged in an
+ * unlinked file under STAGE_DIR as it arrives and its newline appends the
+ * staged bytes and the rest of the packet as one packet. Nothing of it is
+ * visible before, a connection closed before the newline leaves no trace.
+ */
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* storage_backend_t flags */
+#define STORAGE_DATA_FILE                       0x1     /* data-file.c, -m -g -r -i apply */
+#define STORAGE_SEEK_COMMANDS                   0x2     /* text packets may be AESD_SEEKTO_COMMAND */
+#define STORAGE_DESCRIPTOR                      0x4     /* handles own a descriptor io_uring can read */
+#define STORAGE_APPEND_ONLY                     0x8     /* stored bytes never change, only the oldest are retired */
+
+/**
+ * @brief Storage state of a connection
+ */
+typedef struct storage_handle {
+    int fd;                     /* device descriptor (chardev), UNINIT_VALUE otherwise */
+    off_t position;             /* where the next readback or BINPROTO_OFFSET_CURRENT read starts */
+    int opened;
+} storage_handle_t;
+
+/**
+ * @brief Head of a packet staged in a file until its newline arrives
+ */
+typedef struct storage_stage {
+    int fd;                     /* unlinked staging file, open while len > 0 */
+    off_t len;                  /* bytes staged, 0 when no packet is staged */
+} storage_stage_t;
+
+/**
+ * @brief Operations of a backend, every call but start and stop may run concurrently
+ */
+typedef struct storage_backend {
+    const char *name;           /* -t argument */
+    const char *default_path;
+    unsigned int flags;
+    /* Open or create the storage, -1 on failure */
+    int (*start)(const char *path);
+    /* Release the storage, nothing runs anymore */
+    void (*stop)(void);
+    /* Prepare the handle of a new connection, -1 on failure */
+    int (*open)(storage_handle_t *handle);
+    void (*close)(storage_handle_t *handle);
+    /* Append len bytes and rewind the handle, *end is where the readback of the
+       append stops: the end of these bytes, even when group commit writes them in
+       a batch with other clients' bytes, or -1 for the end of the data. Returns -1
+       if the write failed */
+    int (*append)(storage_handle_t *handle, const char *buf, size_t len, off_t *end);
+    /* append() of a packet made of the stage_len bytes of stage_fd followed by tail */
+    int (*append_staged)(storage_handle_t *handle, int stage_fd, off_t stage_len, const char *tail, size_t tail_len,
+                         off_t *end);
+    /* Move the handle to write_cmd + cmd_offset. Returns 0 on success, 1 if the
+       command is not stored, -1 on error */
+    int (*seekto)(storage_handle_t *handle, uint32_t write_cmd, uint32_t cmd_offset);
+    /* Read up to len bytes at *offset, which is advanced by the bytes read.
+       Returns 0 at the end of the data, -1 on error */
+    ssize_t (*read)(storage_handle_t *handle, void *buf, size_t len, off_t *offset);
+    /* Send [*offset, end) without copying, end -1 sends up to the end. Returns like
+       readback_sendfile(), NULL if the backend can only be read */
+    int (*send)(storage_handle_t *handle, int sock_fd, off_t *offset, off_t end);
+    /* Oldest readable offset */
+    off_t (*first)(void);
+    /* End of the stored data, for the stats */
+    off_t (*length)(void);
+    /* Changes whenever the stored data does, through this server at least */
+    uint64_t (*generation)(void);
+} storage_backend_t;
+
+/**
+ * @brief Backend of the server, set by storage_select() before anything is stored
+ */
+extern const storage_backend_t *storage;
+
+/**
+ * @brief Pick the backend named by a -t argument
+ *
+ * @return 0 on success, -1 for an unknown name
+ */
+int storage_select(const char *name);
+
+/**
+ * @brief Open the handle of a connection on first use
+ *
+ * @return 0 on success, -1 if the backend refused the connection
+ */
+int storage_open(storage_handle_t *handle);
+
+/**
+ * @brief Close the handle of a connection, the handle may be opened again
+ */
+void storage_close(storage_handle_t *handle);
+
+/**
+ * @brief Stage the next bytes of a packet that has no newline yet
+ *
+ * @return 0 on success, -1 if the staging file can't be created or written
+ */
+int storage_stage_write(storage_stage_t *stage, const char *buf, size_t len);
+
+/**
+ * @brief Append the staged packet, completed by tail which ends with its newline, and
+ *        empty the stage
+ *
+ * @return like storage_backend_t append, the stage is emptied either way
+ */
+int storage_stage_commit(storage_handle_t *handle, storage_stage_t *stage, const char *tail, size_t tail_len,
+                         off_t *end);
+
+/**
+ * @brief Drop the staged bytes of a connection that closed before the newline, safe on
+ *        an empty stage
+ */
+void storage_stage_discard(storage_stage_t *stage);
+
+/**
+ * @brief Append packets to the data file with a single write, through the group
+ *        commit writer with -g (file backend)
+ *
+ * @return data file length the readback of these packets stops at, -1 if the write failed
+ */
+off_t append_packets(const char *packets, size_t len);
+
+#endif /*STORAGE_H*/
@@ -0,0 +1,159 @@
+/**
+ * @file timestamp.c
+ * @brief Periodic timestamp lines appended to the data file (file backend)
+ *
+ * The thread polls the timerfd and a stop eventfd. A timerfd read returns the
+ * number of expirations since the previous read, so a thread that was held up
+ * appends a single timestamp and accounts the missed ones instead of catching
+ * up with a burst of lines.
+ */
+/*--------------------------------- Private includes ---------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include "aesdsocket.h"
+#include "timestamp.h"
+#include "log-ring.h"
+/*---------------------------------- Private Variables ----------------------------------  */
+static pthread_t timestamp_id;
+static int timer_fd = UNINIT_VALUE;
+static int stop_fd = UNINIT_VALUE;
+static int running;
+static timestamp_append_fn timestamp_append;
+static unsigned long stat_written;
+static unsigned long stat_missed;
+/*--------------------------------- Private Functions ---------------------------------  */
+/**
+ * @brief Format the current local time as RFC 2822 and append it
+ */
+static void append_timestamp(void)
+{
+    char timestamp[128];
+    struct tm tm_info;
+    time_t now = time(NULL);
+
+    if (localtime_r(&now, &tm_info) == NULL)
+    {
+        return;
+    }
+    size_t len = strftime(timestamp, sizeof(timestamp), "timestamp: %a, %d %b %Y %H:%M:%S %z\n", &tm_info);
+    if (len == 0 || timestamp_append(timestamp, len) == -1)
+    {
+        aesd_log(LOG_ERR, "Can't append the timestamp\n");
+        return;
+    }
+    stat_written++;
+}
+
+static void *timestamp_thread(void *arg)
+{
+    (void) arg;
+    struct pollfd fds[2] = {
+        { .fd = timer_fd, .events = POLLIN },
+        { .fd = stop_fd, .events = POLLIN },
+    };
+
+    while (1)
+    {
+        if (poll(fds, 2, -1) == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            aesd_log(LOG_ERR, "Timestamp poll failed: %s\n", strerror(errno));
+            break;
+        }
+        if (fds[1].revents != 0)
+        {
+            break;
+        }
+        uint64_t expirations;
+        if (read(timer_fd, &expirations, sizeof expirations) != sizeof expirations)
+        {
+            continue;
+        }
+        if (expirations > 1)
+        {
+            stat_missed += expirations - 1;
+            aesd_log(LOG_DEBUG, "Timestamp late, %lu intervals skipped\n", (unsigned long) (expirations - 1));
+        }
+        append_timestamp();
+    }
+    return NULL;
+}
+/*--------------------------------- Public Functions ---------------------------------  */
+int timestamp_start(unsigned int interval_ms, timestamp_append_fn append)
+{
+    if (interval_ms == 0)
+    {
+        return 0;
+    }
+    timestamp_append = append;
+
+    /* Monotonic: a wall clock step doesn't bunch up or delay the timestamps */
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (timer_fd == -1 || stop_fd == -1)
+    {
+        aesd_log(LOG_ERR, "Can't create the timestamp descriptors: %s\n", strerror(errno));
+        goto func_error;
+    }
+
+    struct itimerspec its = {
+        .it_value    = { .tv_sec = interval_ms / 1000, .tv_nsec = (interval_ms % 1000) * 1000000L },
+        .it_interval = { .tv_sec = interval_ms / 1000, .tv_nsec = (interval_ms % 1000) * 1000000L },
+    };
+    if (timerfd_settime(timer_fd, 0, &its, NULL) == -1)
+    {
+        aesd_log(LOG_ERR, "Can't arm the timestamp timer: %s\n", strerror(errno));
+        goto func_error;
+    }
+    if (pthread_create(&timestamp_id, NULL, timestamp_thread, NULL) != 0)
+    {
+        aesd_log(LOG_ERR, "Can't create the timestamp thread\n");
+        goto func_error;
+    }
+    running = 1;
+    return 0;
+
+func_error:
+    if (timer_fd != -1)
+    {
+        close(timer_fd);
+    }
+    if (stop_fd != -1)
+    {
+        close(stop_fd);
+    }
+    timer_fd = UNINIT_VALUE;
+    stop_fd = UNINIT_VALUE;
+    return -1;
+}
+
+void timestamp_stop(void)
+{
+    if (!running)
+    {
+        return;
+    }
+    uint64_t one = 1;
+    ssize_t ignored = write(stop_fd, &one, sizeof one);
+    (void) ignored;
+    pthread_join(timestamp_id, NULL);
+    running = 0;
+
+    close(timer_fd);
+    close(stop_fd);
+    timer_fd = UNINIT_VALUE;
+    stop_fd = UNINIT_VALUE;
+    aesd_log(LOG_DEBUG, "Timestamps: %lu written, %lu intervals skipped\n", stat_written, stat_missed);
+}
@@ -0,0 +1,38 @@
+/**
+ * @file timestamp.h
+ * @brief Periodic timestamp lines appended to the data file (file backend)
+ *
+ * A dedicated thread sleeps on a timerfd and appends the RFC 2822 timestamp
+ * through the same append path as the client packets. No signal is involved,
+ * so the client threads never see an EINTR and the timestamp is formatted and
+ * written outside of any signal handler.
+ */
+#ifndef TIMESTAMP_H
+#define TIMESTAMP_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define DEFAULT_TIMESTAMP_INTERVAL_MS           10000
+
+/**
+ * @brief Append function of the server, returns -1 if the write failed
+ */
+typedef off_t (*timestamp_append_fn)(const char *buf, size_t len);
+
+/**
+ * @brief Start the timestamp thread
+ *
+ * @param interval_ms   [IN]  period between two timestamps, 0 disables them
+ * @param append        [IN]  how the timestamp reaches the data file
+ *
+ * @return 0 on success or when disabled, -1 on failure
+ */
+int timestamp_start(unsigned int interval_ms, timestamp_append_fn append);
+
+/**
+ * @brief Stop and join the timestamp thread, call it before the append path is torn down
+ */
+void timestamp_stop(void);
+
+#endif /*TIMESTAMP_H*/
@@ -0,0 +1,352 @@
+/**
+ * @file uring-io.c
+ * @brief io_uring backed readback for one client connection
+ *
+ * The ring is driven through the raw system calls so no liburing is needed on
+ * the target. A chain is always waited for completely before the next one is
+ * built, so the rings never hold more than one chain.
+ *
+ * Linked requests are cut as soon as one of them completes short: a READ that
+ * hits EOF (or the end of an aesdchar entry) cancels its SEND, which is then
+ * completed synchronously, and the readback continues with a new chain.
+ */
+/*--------------------------------- Private includes ---------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <syslog.h>
+#include "uring-io.h"
+#include "metrics.h"
+#include "log-ring.h"
+/*--------------------------------- Private definitions ---------------------------------  */
+#define URING_IO_SOCKET_INDEX                   0
+#define URING_IO_DATA_FILE_INDEX                1
+/*--------------------------------- Private Functions ---------------------------------  */
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *params)
+{
+    return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int ring_fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int) syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int ring_fd, unsigned opcode, const void *arg, unsigned nr_args)
+{
+    return (int) syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+static struct io_uring_sqe *uring_get_sqe(uring_io_t *ring, unsigned *tail)
+{
+    unsigned index = *tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    (*tail)++;
+    return sqe;
+}
+
+/**
+ * @brief Submit the queued chain and wait for all of its completions
+ *
+ * @param results   [OUT] completion result of every request, indexed by user_data
+ */
+static int uring_submit_and_wait(uring_io_t *ring, unsigned count, int *results)
+{
+    unsigned submitted = 0;
+    unsigned completed = 0;
+
+    while (completed < count)
+    {
+        int ret = sys_io_uring_enter(ring->ring_fd, count - submitted, count - completed, IORING_ENTER_GETEVENTS);
+        if (ret == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            aesd_log(LOG_ERR, "io_uring_enter failed: %s\n", strerror(errno));
+            return -1;
+        }
+        submitted += (unsigned) ret;
+
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail)
+        {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            if (cqe->user_data < count)
+            {
+                results[cqe->user_data] = cqe->res;
+            }
+            completed++;
+            head++;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+static int send_all(int sock_fd, const char *buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t sent = send(sock_fd, buf, len, MSG_NOSIGNAL);
+        if (sent == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        buf += sent;
+        len -= sent;
+    }
+    return 0;
+}
+/*--------------------------------- Public Functions ---------------------------------  */
+int uring_io_supported(void)
+{
+    static int supported = -1;
+
+    if (supported == -1)
+    {
+        struct io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        int ring_fd = sys_io_uring_setup(2, &params);
+        supported = (ring_fd >= 0);
+        if (ring_fd >= 0)
+        {
+            close(ring_fd);
+        }
+    }
+    return supported;
+}
+
+int uring_io_init(uring_io_t *ring, int sock_fd, int data_fd)
+{
+    struct io_uring_params params;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+    ring->sock_fd = sock_fd;
+    ring->ring_fd = sys_io_uring_setup(URING_IO_ENTRIES, &params);
+    if (ring->ring_fd == -1)
+    {
+        return -1;
+    }
+
+    ring->sq_map_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_map_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (ring->cq_map_len > ring->sq_map_len)
+        {
+            ring->sq_map_len = ring->cq_map_len;
+        }
+        ring->cq_map_len = 0;
+    }
+    ring->sq_ptr = mmap(NULL, ring->sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->ring_fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED)
+    {
+        ring->sq_ptr = NULL;
+        goto init_fail;
+    }
+    if (ring->cq_map_len == 0)
+    {
+        ring->cq_ptr = ring->sq_ptr;
+    }
+    else
+    {
+        ring->cq_ptr = mmap(NULL, ring->cq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            ring->ring_fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED)
+        {
+            ring->cq_ptr = NULL;
+            goto init_fail;
+        }
+    }
+    ring->sqes_map_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->ring_fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+    {
+        ring->sqes = NULL;
+        goto init_fail;
+    }
+
+    ring->sq_head = (unsigned *) ((char *) ring->sq_ptr + params.sq_off.head);
+    ring->sq_tail = (unsigned *) ((char *) ring->sq_ptr + params.sq_off.tail);
+    ring->sq_mask = (unsigned *) ((char *) ring->sq_ptr + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) ((char *) ring->sq_ptr + params.sq_off.array);
+    ring->cq_head = (unsigned *) ((char *) ring->cq_ptr + params.cq_off.head);
+    ring->cq_tail = (unsigned *) ((char *) ring->cq_ptr + params.cq_off.tail);
+    ring->cq_mask = (unsigned *) ((char *) ring->cq_ptr + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) ((char *) ring->cq_ptr + params.cq_off.cqes);
+
+    if (posix_memalign((void **) &ring->buffers, 4096, URING_IO_BUFFERS * URING_IO_CHUNK) != 0)
+    {
+        ring->buffers = NULL;
+        goto init_fail;
+    }
+    struct iovec buffers_iov = { .iov_base = ring->buffers, .iov_len = URING_IO_BUFFERS * URING_IO_CHUNK };
+    if (sys_io_uring_register(ring->ring_fd, IORING_REGISTER_BUFFERS, &buffers_iov, 1) == -1)
+    {
+        goto init_fail;
+    }
+
+    int files[2] = { sock_fd, data_fd };
+    ring->has_data_file = (data_fd != -1);
+    if (sys_io_uring_register(ring->ring_fd, IORING_REGISTER_FILES, files, ring->has_data_file ? 2 : 1) == -1)
+    {
+        goto init_fail;
+    }
+    return 0;
+
+init_fail:
+    aesd_log(LOG_DEBUG, "io_uring setup failed: %s\n", strerror(errno));
+    uring_io_exit(ring);
+    return -1;
+}
+
+void uring_io_exit(uring_io_t *ring)
+{
+    if (ring->sqes != NULL)
+    {
+        munmap(ring->sqes, ring->sqes_map_len);
+    }
+    if (ring->cq_ptr != NULL && ring->cq_ptr != ring->sq_ptr)
+    {
+        munmap(ring->cq_ptr, ring->cq_map_len);
+    }
+    if (ring->sq_ptr != NULL)
+    {
+        munmap(ring->sq_ptr, ring->sq_map_len);
+    }
+    if (ring->ring_fd >= 0)
+    {
+        close(ring->ring_fd);
+    }
+    free(ring->buffers);
+    memset(ring, 0, sizeof(*ring));
+    ring->ring_fd = -1;
+}
+
+int uring_io_readback(uring_io_t *ring, int file_fd, off_t end)
+{
+    int positional = (file_fd == -1);
+    uint64_t offset = 0;
+    int results[URING_IO_ENTRIES];
+
+    if (positional && !ring->has_data_file)
+    {
+        return -1;
+    }
+
+    for (;;)
+    {
+        unsigned tail = *ring->sq_tail;
+        unsigned count = 0;
+        unsigned buffers = URING_IO_BUFFERS;
+
+        if (positional && end >= 0)
+        {
+            /* Never read past the published length, the rest may still be in flight */
+            if ((off_t) offset >= end)
+            {
+                return 0;
+            }
+            if ((off_t) (offset + buffers * URING_IO_CHUNK) > end)
+            {
+                buffers = (end - offset + URING_IO_CHUNK - 1) / URING_IO_CHUNK;
+            }
+        }
+        for (unsigned i = 0; i < buffers; i++)
+        {
+            char *buf = ring->buffers + i * URING_IO_CHUNK;
+            uint64_t read_len = URING_IO_CHUNK;
+            if (positional && end >= 0 && (off_t) (offset + (i + 1) * URING_IO_CHUNK) > end)
+            {
+                read_len = end - offset - i * URING_IO_CHUNK;
+            }
+            struct io_uring_sqe *sqe = uring_get_sqe(ring, &tail);
+            sqe->opcode = IORING_OP_READ_FIXED;
+            sqe->flags = IOSQE_IO_LINK | (positional ? IOSQE_FIXED_FILE : 0);
+            sqe->fd = positional ? URING_IO_DATA_FILE_INDEX : file_fd;
+            sqe->addr = (uintptr_t) buf;
+            sqe->len = read_len;
+            sqe->off = positional ? offset + i * URING_IO_CHUNK : (uint64_t) -1;
+            sqe->buf_index = 0;
+            sqe->user_data = count++;
+
+            sqe = uring_get_sqe(ring, &tail);
+            sqe->opcode = IORING_OP_SEND;
+            sqe->flags = IOSQE_FIXED_FILE | ((i + 1 < buffers) ? IOSQE_IO_LINK : 0);
+            sqe->fd = URING_IO_SOCKET_INDEX;
+            sqe->addr = (uintptr_t) buf;
+            sqe->len = read_len;
+            sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+            sqe->user_data = count++;
+        }
+        __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+        if (uring_submit_and_wait(ring, count, results) == -1)
+        {
+            return -1;
+        }
+
+        unsigned index = 0;
+        for (unsigned i = 0; i < buffers; i++, index += 2)
+        {
+            int read_octets = results[index];
+            int sent_octets = results[index + 1];
+
+            if (read_octets <= 0)
+            {
+                /* EOF or read error ends the readback like the synchronous read loop */
+                return 0;
+            }
+            if (sent_octets < 0 && sent_octets != -ECANCELED)
+            {
+                return -1;
+            }
+            if (sent_octets < 0)
+            {
+                sent_octets = 0;
+            }
+            if (sent_octets < read_octets &&
+                send_all(ring->sock_fd, ring->buffers + i * URING_IO_CHUNK + sent_octets, read_octets - sent_octets) == -1)
+            {
+                return -1;
+            }
+            metrics_add(METRIC_BYTES_OUT, read_octets);
+            offset += read_octets;
+            if (read_octets < URING_IO_CHUNK)
+            {
+                /* A short read at a regular file is EOF, the char device returns one entry
+                   per read so keep going there. The rest of the chain has been cancelled. */
+                if (positional)
+                {
+                    return 0;
+                }
+                break;
+            }
+            if (sent_octets < read_octets)
+            {
+                break;
+            }
+        }
+    }
+}
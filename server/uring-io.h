@@ -0,0 +1,81 @@
+/**
+ * @file uring-io.h
+ * @brief io_uring backed readback for one client connection
+ *
+ * The readback is submitted as one chain of linked SQEs (READ_FIXED -> SEND ->
+ * READ_FIXED -> SEND ...) using a registered buffer set and registered
+ * descriptors, so a readback that fits the buffer set costs a single
+ * io_uring_enter() instead of the read/send sequence of the synchronous path.
+ * The append itself goes through data_file_append(), whose offset reservation
+ * can't be expressed inside a chain. The receive isn't on the ring either: the
+ * client thread still calls recv(), so a packet costs recv(), pwrite() and one
+ * io_uring_enter() for its readback.
+ */
+#ifndef URING_IO_H
+#define URING_IO_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <linux/io_uring.h>
+
+#define URING_IO_CHUNK                          (16 * 1024)
+#define URING_IO_BUFFERS                        4
+/* A READ_FIXED/SEND pair per buffer */
+#define URING_IO_ENTRIES                        16
+
+typedef struct uring_io {
+    int ring_fd;
+    int sock_fd;
+    void *sq_ptr;
+    size_t sq_map_len;
+    void *cq_ptr;
+    size_t cq_map_len;
+    struct io_uring_sqe *sqes;
+    size_t sqes_map_len;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    char *buffers;              /* URING_IO_BUFFERS chunks registered as fixed buffer 0 */
+    int has_data_file;          /* the data file is registered as fixed file 1 */
+} uring_io_t;
+
+/**
+ * @brief Check once whether the kernel lets this process create a ring
+ *
+ * @return 1 if io_uring can be used, 0 otherwise
+ */
+int uring_io_supported(void);
+
+/**
+ * @brief Create the ring of a connection and register its buffers and files
+ *
+ * @param ring      [OUT] ring to initialize
+ * @param sock_fd   [IN]  client socket, registered as fixed file 0
+ * @param data_fd   [IN]  data file registered as fixed file 1, -1 if the readback
+ *                        descriptor changes for every packet
+ *
+ * @return 0 on success, -1 if the caller has to keep using the synchronous path
+ */
+int uring_io_init(uring_io_t *ring, int sock_fd, int data_fd);
+
+void uring_io_exit(uring_io_t *ring);
+
+/**
+ * @brief Stream the data file back to the client
+ *
+ * @param ring          [IN]  initialized ring
+ * @param file_fd       [IN]  -1 reads the registered data file from offset 0, any
+ *                            other descriptor is read from its current position
+ * @param end           [IN]  offset the registered data file is read up to, -1 reads
+ *                            up to EOF. Ignored for file_fd
+ *
+ * @return 0 on success, -1 if the socket failed
+ */
+int uring_io_readback(uring_io_t *ring, int file_fd, off_t end);
+
+#endif /*URING_IO_H*/
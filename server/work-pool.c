@@ -0,0 +1,278 @@
+/**
+ * @file work-pool.c
+ * @brief Fixed size worker pool with per worker deques and work stealing
+ *
+ * The deques are bounded rings protected by their own mutex: the owner and
+ * external submitters use the bottom end, thieves the top end, so contention
+ * only happens when a deque is nearly empty. A pool wide pending counter lets
+ * idle workers sleep on a condition variable instead of spinning.
+ */
+/*--------------------------------- Private includes ---------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <syslog.h>
+#include <pthread.h>
+#include "work-pool.h"
+#include "log-ring.h"
+/*--------------------------------- Private definitions ---------------------------------  */
+#define WORK_DEQUE_CAPACITY                     1024    /* must be a power of two */
+
+typedef struct work_item {
+    work_fn_t fn;
+    void *arg;
+} work_item_t;
+
+typedef struct work_deque {
+    pthread_mutex_t lock;
+    unsigned long top;                  /* next slot to steal from */
+    unsigned long bottom;               /* next free slot of the owner end */
+    work_item_t items[WORK_DEQUE_CAPACITY];
+} work_deque_t;
+
+typedef struct worker {
+    pthread_t thread_id;
+    unsigned int index;
+    work_deque_t deque;
+} worker_t;
+
+typedef struct work_pool {
+    worker_t *workers;
+    unsigned int num_workers;
+    int stopping;
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+    atomic_uint idle_workers;
+    atomic_uint next_deque;
+    atomic_ulong pending;
+    atomic_ulong max_pending;
+    atomic_ulong submitted;
+    atomic_ulong rejected;
+    atomic_ulong executed;
+    atomic_ulong steals;
+    atomic_ulong steal_attempts;
+} work_pool_t;
+/*---------------------------------- Private Variables ----------------------------------  */
+static work_pool_t pool = {
+    .idle_lock = PTHREAD_MUTEX_INITIALIZER,
+    .idle_cond = PTHREAD_COND_INITIALIZER,
+};
+/* Worker owning the calling thread, NULL outside of the pool */
+static __thread worker_t *current_worker;
+/*--------------------------------- Private Functions ---------------------------------  */
+static int deque_push_bottom(work_deque_t *deque, work_fn_t fn, void *arg)
+{
+    int retval = -1;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom - deque->top < WORK_DEQUE_CAPACITY)
+    {
+        work_item_t *item = &deque->items[deque->bottom & (WORK_DEQUE_CAPACITY - 1)];
+        item->fn = fn;
+        item->arg = arg;
+        deque->bottom++;
+        retval = 0;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return retval;
+}
+
+static int deque_pop_bottom(work_deque_t *deque, work_item_t *item)
+{
+    int retval = -1;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom != deque->top)
+    {
+        deque->bottom--;
+        *item = deque->items[deque->bottom & (WORK_DEQUE_CAPACITY - 1)];
+        retval = 0;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return retval;
+}
+
+static int deque_steal_top(work_deque_t *deque, work_item_t *item)
+{
+    int retval = -1;
+    /* Never wait behind the owner, another victim may have work */
+    if (pthread_mutex_trylock(&deque->lock) != 0)
+    {
+        return -1;
+    }
+    if (deque->bottom != deque->top)
+    {
+        *item = deque->items[deque->top & (WORK_DEQUE_CAPACITY - 1)];
+        deque->top++;
+        retval = 0;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return retval;
+}
+
+static int worker_steal(worker_t *self, work_item_t *item)
+{
+    atomic_fetch_add_explicit(&pool.steal_attempts, 1, memory_order_relaxed);
+    for (unsigned int i = 1; i < pool.num_workers; i++)
+    {
+        worker_t *victim = &pool.workers[(self->index + i) % pool.num_workers];
+        if (deque_steal_top(&victim->deque, item) == 0)
+        {
+            atomic_fetch_add_explicit(&pool.steals, 1, memory_order_relaxed);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static void *worker_thread(void *arg)
+{
+    worker_t *self = (worker_t *) arg;
+    work_item_t item;
+
+    current_worker = self;
+    for (;;)
+    {
+        if (deque_pop_bottom(&self->deque, &item) == 0 || worker_steal(self, &item) == 0)
+        {
+            atomic_fetch_sub_explicit(&pool.pending, 1, memory_order_relaxed);
+            item.fn(item.arg);
+            atomic_fetch_add_explicit(&pool.executed, 1, memory_order_relaxed);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool.idle_lock);
+        atomic_fetch_add(&pool.idle_workers, 1);
+        while (atomic_load(&pool.pending) == 0 && !pool.stopping)
+        {
+            pthread_cond_wait(&pool.idle_cond, &pool.idle_lock);
+        }
+        atomic_fetch_sub(&pool.idle_workers, 1);
+        int stop = pool.stopping && atomic_load(&pool.pending) == 0;
+        pthread_mutex_unlock(&pool.idle_lock);
+        if (stop)
+        {
+            break;
+        }
+    }
+    current_worker = NULL;
+    return NULL;
+}
+
+static void update_max_pending(unsigned long depth)
+{
+    unsigned long max = atomic_load_explicit(&pool.max_pending, memory_order_relaxed);
+    while (depth > max &&
+           !atomic_compare_exchange_weak_explicit(&pool.max_pending, &max, depth, memory_order_relaxed, memory_order_relaxed))
+    {
+    }
+}
+/*--------------------------------- Public Functions ---------------------------------  */
+int work_pool_init(unsigned int num_workers)
+{
+    if (num_workers == 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        num_workers = (cpus > 0) ? (unsigned int) cpus : 1;
+    }
+    pool.workers = calloc(num_workers, sizeof(worker_t));
+    if (pool.workers == NULL)
+    {
+        aesd_log(LOG_ERR, "Can't allocate the worker pool\n");
+        return -1;
+    }
+    pool.stopping = 0;
+    for (pool.num_workers = 0; pool.num_workers < num_workers; pool.num_workers++)
+    {
+        worker_t *worker = &pool.workers[pool.num_workers];
+        worker->index = pool.num_workers;
+        pthread_mutex_init(&worker->deque.lock, NULL);
+        if (pthread_create(&worker->thread_id, NULL, worker_thread, worker) != 0)
+        {
+            aesd_log(LOG_ERR, "Can't create worker thread\n");
+            pthread_mutex_destroy(&worker->deque.lock);
+            work_pool_shutdown();
+            return -1;
+        }
+    }
+    aesd_log(LOG_INFO, "Started %u pool workers\n", pool.num_workers);
+    return 0;
+}
+
+int work_pool_submit(work_fn_t fn, void *arg)
+{
+    if (pool.num_workers == 0)
+    {
+        return -1;
+    }
+
+    /* Count the job before it becomes visible so a worker never drives pending below zero */
+    unsigned long depth = atomic_fetch_add(&pool.pending, 1) + 1;
+
+    /* A worker queues follow-up jobs locally, everybody else spreads them */
+    unsigned int first = current_worker ? current_worker->index
+                                        : atomic_fetch_add_explicit(&pool.next_deque, 1, memory_order_relaxed);
+    unsigned int i;
+    for (i = 0; i < pool.num_workers; i++)
+    {
+        if (deque_push_bottom(&pool.workers[(first + i) % pool.num_workers].deque, fn, arg) == 0)
+        {
+            break;
+        }
+    }
+    if (i == pool.num_workers)
+    {
+        atomic_fetch_sub(&pool.pending, 1);
+        atomic_fetch_add_explicit(&pool.rejected, 1, memory_order_relaxed);
+        return -1;
+    }
+
+    update_max_pending(depth);
+    atomic_fetch_add_explicit(&pool.submitted, 1, memory_order_relaxed);
+    if (atomic_load(&pool.idle_workers) > 0)
+    {
+        pthread_mutex_lock(&pool.idle_lock);
+        pthread_cond_signal(&pool.idle_cond);
+        pthread_mutex_unlock(&pool.idle_lock);
+    }
+    return 0;
+}
+
+void work_pool_shutdown(void)
+{
+    if (pool.workers == NULL)
+    {
+        return;
+    }
+    pthread_mutex_lock(&pool.idle_lock);
+    pool.stopping = 1;
+    pthread_cond_broadcast(&pool.idle_cond);
+    pthread_mutex_unlock(&pool.idle_lock);
+
+    for (unsigned int i = 0; i < pool.num_workers; i++)
+    {
+        pthread_join(pool.workers[i].thread_id, NULL);
+        pthread_mutex_destroy(&pool.workers[i].deque.lock);
+    }
+
+    work_pool_stats_t stats;
+    work_pool_get_stats(&stats);
+    aesd_log(LOG_INFO, "Work pool: %lu jobs executed, %lu stolen (%lu attempts), max queue depth %lu, %lu rejected\n",
+           stats.executed, stats.steals, stats.steal_attempts, stats.max_queue_depth, stats.rejected);
+
+    free(pool.workers);
+    pool.workers = NULL;
+    pool.num_workers = 0;
+}
+
+void work_pool_get_stats(work_pool_stats_t *stats)
+{
+    stats->workers = pool.num_workers;
+    stats->queue_depth = atomic_load_explicit(&pool.pending, memory_order_relaxed);
+    stats->max_queue_depth = atomic_load_explicit(&pool.max_pending, memory_order_relaxed);
+    stats->submitted = atomic_load_explicit(&pool.submitted, memory_order_relaxed);
+    stats->rejected = atomic_load_explicit(&pool.rejected, memory_order_relaxed);
+    stats->executed = atomic_load_explicit(&pool.executed, memory_order_relaxed);
+    stats->steals = atomic_load_explicit(&pool.steals, memory_order_relaxed);
+    stats->steal_attempts = atomic_load_explicit(&pool.steal_attempts, memory_order_relaxed);
+}
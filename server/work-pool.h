@@ -0,0 +1,52 @@
+/**
+ * @file work-pool.h
+ * @brief Fixed size worker pool with per worker deques and work stealing
+ *
+ * Each worker pops its own deque from the bottom (most recent job first) and
+ * steals from the top of the other deques when it runs dry. Jobs submitted
+ * from outside the pool are spread round robin over the deques.
+ */
+#ifndef WORK_POOL_H
+#define WORK_POOL_H
+
+typedef void (*work_fn_t)(void *arg);
+
+/**
+ * @brief Snapshot of the pool counters
+ */
+typedef struct work_pool_stats {
+    unsigned int workers;
+    unsigned long queue_depth;          /* jobs queued and not yet started */
+    unsigned long max_queue_depth;      /* high watermark of queue_depth */
+    unsigned long submitted;
+    unsigned long rejected;             /* submissions refused because every deque was full */
+    unsigned long executed;
+    unsigned long steals;               /* jobs taken from another worker's deque */
+    unsigned long steal_attempts;       /* scans of the other deques, successful or not */
+} work_pool_stats_t;
+
+/**
+ * @brief Start the workers
+ *
+ * @param num_workers   [IN]  number of threads, 0 uses one per online CPU
+ *
+ * @return 0 on success, -1 on failure
+ */
+int work_pool_init(unsigned int num_workers);
+
+/**
+ * @brief Queue a job, never blocks
+ *
+ * @return 0 if the job was queued, -1 if the pool is full or not running and
+ *         the caller has to run the job itself
+ */
+int work_pool_submit(work_fn_t fn, void *arg);
+
+/**
+ * @brief Run the queued jobs to completion and join the workers
+ */
+void work_pool_shutdown(void);
+
+void work_pool_get_stats(work_pool_stats_t *stats);
+
+#endif /*WORK_POOL_H*/
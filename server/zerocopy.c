@@ -0,0 +1,220 @@
+/**
+ * @file zerocopy.c
+ * @brief MSG_ZEROCOPY sends of the readbacks served from memory, with completion tracking
+ *
+ * A tracker belongs to one connection and is only used by the thread that
+ * currently serves it, the holds are a FIFO ordered by notification id.
+ * Consecutive sends from the same buffer share its hold, so a readback pins
+ * its buffer once however many sends it takes.
+ */
+/*--------------------------------- Private includes ---------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#include "aesdsocket.h"
+#include "zerocopy.h"
+#include "metrics.h"
+#include "log-ring.h"
+/*--------------------------------- Private definitions ---------------------------------  */
+/* sock_extended_err and the address of the offender */
+#define ZEROCOPY_CONTROL_SIZE                   128
+/*--------------------------------- Private Functions ---------------------------------  */
+static zerocopy_hold_t *hold_at(zerocopy_t *zc, unsigned int index)
+{
+    return &zc->holds[(zc->first + index) % ZEROCOPY_MAX_PENDING];
+}
+
+/**
+ * @brief Monotonic clock of the drain deadline, metrics_now() reads 0 when metrics are off
+ */
+static uint64_t monotonic_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/**
+ * @brief Keep a reference on the buffer of the send that got notification id
+ */
+static void hold_buffer(zerocopy_t *zc, const zerocopy_ref_t *ref, uint32_t id)
+{
+    zerocopy_hold_t *last = (zc->count > 0) ? hold_at(zc, zc->count - 1) : NULL;
+
+    if (last != NULL && last->owner == ref->owner)
+    {
+        last->last_id = id;
+        return;
+    }
+    ref->get(ref->owner);
+    zerocopy_hold_t *hold = hold_at(zc, zc->count++);
+    hold->last_id = id;
+    hold->put = ref->put;
+    hold->owner = ref->owner;
+}
+
+/**
+ * @brief Drop the holds whose last send is completed
+ */
+static void release_completed(zerocopy_t *zc)
+{
+    while (zc->count > 0 && (int32_t) (zc->completed - hold_at(zc, 0)->last_id) > 0)
+    {
+        zerocopy_hold_t *hold = hold_at(zc, 0);
+        hold->put(hold->owner);
+        zc->first = (zc->first + 1) % ZEROCOPY_MAX_PENDING;
+        zc->count--;
+    }
+}
+/*--------------------------------- Public Functions ---------------------------------  */
+int zerocopy_init(zerocopy_t *zc, int sock_fd)
+{
+    int one = 1;
+
+    memset(zc, 0, sizeof(*zc));
+    zc->fd = sock_fd;
+    if (server_config.zerocopy_min == 0)
+    {
+        return -1;
+    }
+    if (setsockopt(sock_fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == -1)
+    {
+        aesd_log(LOG_DEBUG, "SO_ZEROCOPY failed: %s, readbacks are copied\n", strerror(errno));
+        return -1;
+    }
+    zc->enabled = 1;
+    return 0;
+}
+
+zerocopy_t *zerocopy_for(zerocopy_t *zc, size_t len)
+{
+    return (zc != NULL && zc->enabled && len >= server_config.zerocopy_min) ? zc : NULL;
+}
+
+ssize_t zerocopy_sendmsg(zerocopy_t *zc, const struct msghdr *msg, const zerocopy_ref_t *ref)
+{
+    if (zc->count > 0)
+    {
+        zerocopy_reap(zc);
+    }
+    int shared = (zc->count > 0 && hold_at(zc, zc->count - 1)->owner == ref->owner);
+    if (shared || zc->count < ZEROCOPY_MAX_PENDING)
+    {
+        ssize_t sent_octets = sendmsg(zc->fd, msg, MSG_NOSIGNAL | MSG_ZEROCOPY);
+        if (sent_octets > 0)
+        {
+            /* Every zerocopy send that took bytes gets the next notification id */
+            hold_buffer(zc, ref, zc->next_id++);
+            metrics_add(METRIC_ZEROCOPY_SENDS, 1);
+            metrics_add(METRIC_ZEROCOPY_BYTES, sent_octets);
+        }
+        if (sent_octets != -1 || errno != ENOBUFS)
+        {
+            return sent_octets;
+        }
+        /* The socket is out of option memory for notifications until some are read */
+    }
+    return sendmsg(zc->fd, msg, MSG_NOSIGNAL);
+}
+
+int zerocopy_reap(zerocopy_t *zc)
+{
+    int notifications = 0;
+
+    if (!zc->enabled)
+    {
+        return 0;
+    }
+    for (;;)
+    {
+        char control[ZEROCOPY_CONTROL_SIZE];
+        struct msghdr msg = { .msg_control = control, .msg_controllen = sizeof(control) };
+
+        if (recvmsg(zc->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                break;
+            }
+            return -1;
+        }
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            struct sock_extended_err err;
+            if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) &&
+                !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))
+            {
+                continue;
+            }
+            memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+            if (err.ee_origin != SO_EE_ORIGIN_ZEROCOPY || err.ee_errno != 0)
+            {
+                continue;
+            }
+            /* [ee_info, ee_data] is the range of the notifications completed */
+            notifications++;
+            if ((int32_t) (err.ee_data + 1 - zc->completed) > 0)
+            {
+                zc->completed = err.ee_data + 1;
+            }
+            if (err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+            {
+                metrics_add(METRIC_ZEROCOPY_COPIED, err.ee_data - err.ee_info + 1);
+            }
+        }
+    }
+    release_completed(zc);
+    return notifications;
+}
+
+void zerocopy_release(zerocopy_t *zc, int wait_ms)
+{
+    uint64_t deadline_ns = monotonic_ns() + (uint64_t) wait_ms * 1000000;
+
+    if (zc->count > 0)
+    {
+        zerocopy_reap(zc);
+    }
+    while (zc->count > 0)
+    {
+        uint64_t now_ns = monotonic_ns();
+        if (now_ns >= deadline_ns)
+        {
+            break;
+        }
+        /* The error queue is reported as POLLERR whatever the requested events */
+        struct pollfd pfd = { .fd = zc->fd, .events = 0 };
+        int ready = poll(&pfd, 1, (int) ((deadline_ns - now_ns + 999999) / 1000000));
+        if (ready == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (ready <= 0 || zerocopy_reap(zc) <= 0)
+        {
+            break;
+        }
+    }
+    if (zc->count > 0)
+    {
+        aesd_log(LOG_DEBUG, "Client %d closed with %u zerocopy buffers in flight\n", zc->fd, zc->count);
+    }
+    /* The socket buffers still in flight hold their own references on the pages, a
+       buffer reused now can only change what this closing client receives */
+    zc->completed = zc->next_id;
+    release_completed(zc);
+    zc->enabled = 0;
+}
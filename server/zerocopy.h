@@ -0,0 +1,100 @@
+/**
+ * @file zerocopy.h
+ * @brief MSG_ZEROCOPY sends of the readbacks served from memory, with completion tracking
+ *
+ * A MSG_ZEROCOPY send pins the pages of the buffer into the socket instead of
+ * copying them, so the buffer must stay unchanged until the kernel reports
+ * that send done on the error queue of the socket. Every zerocopy send of a
+ * connection takes a reference on the buffer it sent from, the tracker drops it
+ * once the completion of the last send that used it is read. Only the append
+ * log (-m) and the readback snapshot (-C) are sent this way: the data file is
+ * already spliced by sendfile(), which copies nothing either.
+ *
+ * The completions of a TCP socket arrive in send order, the tracker only keeps
+ * the watermark below which every notification is done. Loopback and devices
+ * without scatter-gather make the kernel copy the pages anyway, it says so in
+ * the completion and zerocopy only adds cost there.
+ */
+#ifndef ZEROCOPY_H
+#define ZEROCOPY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/* Distinct buffers a connection may have in flight, further sends are copied */
+#define ZEROCOPY_MAX_PENDING                    32
+/* How long closing a connection of a thread of its own waits for the last completions */
+#define ZEROCOPY_DRAIN_MS                       100
+
+/**
+ * @brief Reference on the buffer a send reads from
+ */
+typedef struct zerocopy_ref {
+    void (*get)(void *owner);
+    void (*put)(void *owner);
+    void *owner;
+} zerocopy_ref_t;
+
+typedef struct zerocopy_hold {
+    uint32_t last_id;               /* notification of the last send from owner */
+    void (*put)(void *owner);
+    void *owner;
+} zerocopy_hold_t;
+
+/**
+ * @brief Zerocopy state of one connection
+ */
+typedef struct zerocopy {
+    int fd;
+    int enabled;                    /* SO_ZEROCOPY accepted by the socket */
+    uint32_t next_id;               /* notification the next zerocopy send gets */
+    uint32_t completed;             /* every notification below it is done */
+    unsigned int first;             /* oldest hold in holds */
+    unsigned int count;
+    zerocopy_hold_t holds[ZEROCOPY_MAX_PENDING];
+} zerocopy_t;
+
+/**
+ * @brief Enable MSG_ZEROCOPY on a client socket when -Z is set
+ *
+ * @return 0 if the sends of the connection may use zerocopy, -1 if they are copied,
+ *         the tracker is usable either way
+ */
+int zerocopy_init(zerocopy_t *zc, int sock_fd);
+
+/**
+ * @brief Whether a readback of len bytes is worth sending with zerocopy
+ *
+ * @return the tracker to pass to the send, NULL to copy
+ */
+zerocopy_t *zerocopy_for(zerocopy_t *zc, size_t len);
+
+/**
+ * @brief sendmsg() with MSG_ZEROCOPY, keeping a reference on ref until the kernel
+ *        is done with the bytes sent. Falls back to a copy when the tracker or the
+ *        socket option memory is full
+ *
+ * @return bytes sent, -1 with errno set like sendmsg()
+ */
+ssize_t zerocopy_sendmsg(zerocopy_t *zc, const struct msghdr *msg, const zerocopy_ref_t *ref);
+
+/**
+ * @brief Read the pending completions without blocking and drop the references
+ *        of the buffers the kernel is done with
+ *
+ * @return 0 on success, -1 if the socket reported an error that isn't a completion
+ */
+int zerocopy_reap(zerocopy_t *zc);
+
+/**
+ * @brief Read the completions already reported, wait up to wait_ms for the others and
+ *        drop every reference, before the socket is closed
+ *
+ * @param wait_ms   [IN]  ZEROCOPY_DRAIN_MS from a client thread, 0 from the event loop,
+ *                        which must not block on one connection
+ */
+void zerocopy_release(zerocopy_t *zc, int wait_ms);
+
+#endif /*ZEROCOPY_H*/